@@ -0,0 +1,108 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "audio.h"
+#include "emulator.h"
+
+// Playback falls at most this many frames behind the emulation before
+// skipping ahead. The frontend reports a frame at a time, so one frame
+// behind is normal
+#define MAX_LAG_FRAMES 2
+#define TONE_HZ 440
+#define AMPLITUDE 4000
+
+void chip8_audio_init(Chip8Audio *audio, uint32_t ips, uint32_t sample_rate) {
+  memset(audio, 0, sizeof(*audio));
+  audio->ips = ips;
+  audio->sample_rate = sample_rate;
+  atomic_init(&audio->head, 0);
+  atomic_init(&audio->tail, 0);
+  atomic_init(&audio->frontier, 0);
+}
+
+void chip8_attach_audio(Chip8Emulator *emulator, Chip8Audio *audio) {
+  emulator->audio = audio;
+  if (audio) {
+    chip8_audio_sync(audio, emulator);
+  }
+}
+
+// Adds an edge unless the ring is full, in which case it is dropped and
+// published stays behind on
+static void push_edge(Chip8Audio *audio, uint64_t cycle, uint8_t on) {
+  uint64_t head = atomic_load_explicit(&audio->head, memory_order_relaxed);
+  if (head - atomic_load_explicit(&audio->tail, memory_order_acquire) >=
+      CHIP8_AUDIO_RING) {
+    return;
+  }
+  audio->edges[head % CHIP8_AUDIO_RING] = (Chip8AudioEdge){cycle, on};
+  atomic_store_explicit(&audio->head, head + 1, memory_order_release);
+  audio->published = on;
+}
+
+void chip8_audio_edge(Chip8Audio *audio, uint64_t cycle, int on) {
+  audio->on = on != 0;
+  if (audio->on != audio->published) {
+    push_edge(audio, cycle + audio->cycle_offset, audio->on);
+  }
+}
+
+void chip8_audio_sync(Chip8Audio *audio, const Chip8Emulator *emulator) {
+  // Time stands still across a rewind rather than going back
+  if (emulator->cycles < audio->last_cycle) {
+    audio->cycle_offset += audio->last_cycle - emulator->cycles;
+  }
+  audio->last_cycle = emulator->cycles;
+  uint64_t now = emulator->cycles + audio->cycle_offset;
+
+  // Catches a state that was replaced wholesale or an edge that didn't fit
+  audio->on = emulator->sound_timer != 0;
+  if (audio->on != audio->published) {
+    push_edge(audio, now, audio->on);
+  }
+  atomic_store_explicit(&audio->frontier, now, memory_order_release);
+}
+
+void chip8_audio_render(Chip8Audio *audio, int16_t *samples, int count) {
+  uint64_t frontier =
+      atomic_load_explicit(&audio->frontier, memory_order_acquire);
+  uint64_t max_lag = (uint64_t)audio->ips * MAX_LAG_FRAMES / CHIP8_TIMER_HZ;
+  if (audio->clock + max_lag < frontier) {
+    audio->clock = frontier - max_lag;
+    audio->clock_fraction = 0;
+  }
+
+  uint64_t head = atomic_load_explicit(&audio->head, memory_order_acquire);
+  uint64_t tail = atomic_load_explicit(&audio->tail, memory_order_relaxed);
+  for (int i = 0; i < count; i++) {
+    while (tail != head &&
+           audio->edges[tail % CHIP8_AUDIO_RING].cycle <= audio->clock) {
+      audio->playing = audio->edges[tail % CHIP8_AUDIO_RING].on;
+      tail++;
+    }
+
+    if (audio->playing) {
+      samples[i] = audio->high ? AMPLITUDE : -AMPLITUDE;
+      audio->phase += 2 * TONE_HZ;
+      if (audio->phase >= audio->sample_rate) {
+        audio->phase -= audio->sample_rate;
+        audio->high ^= 1;
+      }
+    } else {
+      samples[i] = 0;
+    }
+
+    // The clock runs at ips / sample_rate cycles per sample, holding at
+    // the frontier until the emulation reports more
+    if (audio->clock < frontier) {
+      audio->clock_fraction += audio->ips;
+      audio->clock += audio->clock_fraction / audio->sample_rate;
+      audio->clock_fraction %= audio->sample_rate;
+      if (audio->clock > frontier) {
+        audio->clock = frontier;
+      }
+    }
+  }
+  atomic_store_explicit(&audio->tail, tail, memory_order_release);
+}
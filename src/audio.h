@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// The beep, for frontends with an audio device. The emulator reports each
+// time the sound timer starts or stops, stamped with its cycle, into a
+// single-producer single-consumer ring. The audio callback replays the
+// edges at the emulated clock rate from its own thread without ever
+// taking a lock or waiting. When the emulation runs ahead, unthrottled or
+// fast-forwarded, playback jumps forward instead of falling behind, and
+// when it stalls playback holds at the last reported cycle
+
+// Edges the ring holds. If it fills the newest are dropped, and
+// chip8_audio_sync puts the current state back once there is room
+#define CHIP8_AUDIO_RING 1024
+
+typedef struct AudioEdge {
+  // Cycles on a timeline that only moves forward, see chip8_audio_sync
+  uint64_t cycle;
+  uint8_t on;
+} Chip8AudioEdge;
+
+typedef struct Chip8Audio {
+  // Set by chip8_audio_init, read by both sides
+  uint32_t ips;
+  uint32_t sample_rate;
+
+  // Producer side, the emulation thread
+  _Alignas(CHIP8_CACHE_LINE) _Atomic uint64_t head;
+  // The emulator's last cycle seen, and what is added to its cycles to
+  // keep the timeline going forward when it is rewound
+  uint64_t last_cycle;
+  uint64_t cycle_offset;
+  // The sound's state as the emulator last reported it, and as last put
+  // in the ring
+  uint8_t on;
+  uint8_t published;
+  // How far the emulation has run, playback never passes it
+  _Atomic uint64_t frontier;
+
+  // Consumer side, the audio callback
+  _Alignas(CHIP8_CACHE_LINE) _Atomic uint64_t tail;
+  // Playback position in cycles, plus a fraction in 1/sample_rate cycles
+  uint64_t clock;
+  uint32_t clock_fraction;
+  // Whether the edges played so far leave the sound on
+  uint8_t playing;
+  // The square wave's phase in 1/sample_rate half periods, and which half
+  // it is in
+  uint32_t phase;
+  uint8_t high;
+
+  Chip8AudioEdge edges[CHIP8_AUDIO_RING];
+} Chip8Audio;
+
+// ips is the emulator's clock rate, see chip8_set_clock
+void chip8_audio_init(Chip8Audio *audio, uint32_t ips, uint32_t sample_rate);
+// Attaches audio, or detaches it when audio is NULL. chip8_init_emulator
+// detaches it again. The sound is reported from the current cycle on
+void chip8_attach_audio(Chip8Emulator *emulator, Chip8Audio *audio);
+// Called by the emulator when the sound timer starts or stops on `cycle`
+void chip8_audio_edge(Chip8Audio *audio, uint64_t cycle, int on);
+// Tells the callback how far the emulation has got. Call it after every
+// batch of instructions and after the emulator's state is replaced, e.g.
+// by rewinding, which it papers over by moving the timeline forward
+void chip8_audio_sync(Chip8Audio *audio, const Chip8Emulator *emulator);
+// Fills `count` mono samples, from the audio thread
+void chip8_audio_render(Chip8Audio *audio, int16_t *samples, int count);
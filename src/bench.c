@@ -0,0 +1,628 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "emulator.h"
+#include "phosphor.h"
+#ifdef CHIP8_JIT
+#include "jit.h"
+#endif
+#ifdef CHIP8_TRACE
+#include "trace.h"
+#endif
+
+// Microbenchmarks for the core. Every case runs a fixed amount of work
+// `repeat` times and reports the fastest and the median run as JSON, so
+// results can be compared across builds and releases
+
+#define DEFAULT_REPEAT 5
+// Instructions each repetition of an instruction benchmark runs
+#define INSTRUCTION_CYCLES 2000000
+// Repeated instructions in a generated program before it jumps back
+#define BODY_LENGTH 1024
+#define BODY_START 0x210
+#define RESET_ITERATIONS 20000
+// Instructions run after each reset by reset/rerun
+#define RERUN_CYCLES 1000
+#define UNPACK_ITERATIONS 200000
+#define PHOSPHOR_ITERATIONS 20000
+// Records in the benchmark checkpoint, each stored or loaded once a pass
+#define CHECKPOINT_RECORDS 1024
+// Ring size for the trace benchmark, big enough that writes miss L1
+#define TRACE_RECORDS 65536
+
+typedef enum Mode {
+  // No decode cache, so every instruction is decoded as it runs
+  MODE_DECODE,
+  MODE_CACHED,
+  MODE_JIT,
+} Mode;
+
+static const char *const MODE_NAMES[] = {"decode", "cached", "jit"};
+
+typedef struct Bench {
+  FILE *out;
+  const char *filter;
+  int repeat;
+  int results;
+  // One time per repetition
+  double *times;
+} Bench;
+
+// A generated program: a short prologue setting up registers, then
+// BODY_LENGTH instructions from BODY_START and a jump back to BODY_START
+typedef struct Program {
+  uint8_t bytes[MAX_PROGRAM_SIZE];
+  long size;
+  // CHIP8_PROFILE_DEFAULT unless the program needs other instructions
+  Chip8Profile profile;
+} Program;
+
+static Chip8Emulator emulator;
+static Chip8DecodeCache decode_cache;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [--output FILE] [--filter TEXT] [--repeat N]\n", name);
+}
+
+static void put_instruction(Program *program, uint16_t address,
+                            uint16_t instruction) {
+  uint16_t offset = address - PROGRAM_START_OFFSET;
+  program->bytes[offset] = instruction >> 8;
+  program->bytes[offset + 1] = instruction & 0xff;
+  if (offset + 2 > program->size) {
+    program->size = offset + 2;
+  }
+}
+
+// Starts a program with up to BODY_START - 0x200 bytes of prologue, the
+// rest of which is padded with jumps to the body
+static void begin_program(Program *program, const uint16_t *prologue,
+                          int prologue_length) {
+  memset(program, 0, sizeof(*program));
+  uint16_t address = PROGRAM_START_OFFSET;
+  for (int i = 0; i < prologue_length; i++, address += 2) {
+    put_instruction(program, address, prologue[i]);
+  }
+  for (; address < BODY_START; address += 2) {
+    put_instruction(program, address, 0x1000 | BODY_START);
+  }
+}
+
+// Fills the body with `instruction`, or with one that targets the next
+// address when `chained` is set (for 1nnn and Bnnn)
+static void fill_body(Program *program, uint16_t instruction, int chained) {
+  uint16_t address = BODY_START;
+  for (int i = 0; i < BODY_LENGTH; i++, address += 2) {
+    uint16_t next = i + 1 < BODY_LENGTH ? address + 2 : BODY_START;
+    put_instruction(program, address,
+                    chained ? (instruction & 0xf000) | next : instruction);
+  }
+  put_instruction(program, address, 0x1000 | BODY_START);
+}
+
+static uint16_t body_end(void) { return BODY_START + BODY_LENGTH * 2 + 2; }
+
+static int selected(const Bench *bench, const char *name) {
+  return !bench->filter || strstr(name, bench->filter);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Writes one result from bench->times, `ops` being the work done by one
+// repetition
+static void report(Bench *bench, const char *name, const char *mode,
+                   uint64_t ops, const char *unit) {
+  qsort(bench->times, bench->repeat, sizeof(double), compare_doubles);
+  double best = bench->times[0] * 1e9 / ops;
+  double median = bench->times[bench->repeat / 2] * 1e9 / ops;
+
+  fprintf(bench->out,
+          "%s\n    {\"name\": \"%s\", \"mode\": \"%s\", \"ops\": %llu, "
+          "\"unit\": \"%s\", \"best_ns\": %.3f, \"median_ns\": %.3f}",
+          bench->results ? "," : "", name, mode, (unsigned long long)ops,
+          unit, best, median);
+  bench->results++;
+  fprintf(stderr, "%-32s %-7s %10.3f ns/%s\n", name, mode, best, unit);
+}
+
+static int prepare(const Program *program, Mode mode) {
+  chip8_init_emulator(&emulator);
+  chip8_set_profile(&emulator, program->profile);
+  if (mode != MODE_DECODE) {
+    chip8_attach_decode_cache(&emulator, &decode_cache);
+  }
+#ifdef CHIP8_JIT
+  static Chip8Jit *jit;
+  if (mode == MODE_JIT) {
+    if (!jit && !(jit = chip8_jit_create())) {
+      return -1;
+    }
+    chip8_attach_jit(&emulator, jit);
+  }
+#else
+  if (mode == MODE_JIT) {
+    return -1;
+  }
+#endif
+  chip8_load_program(&emulator, program->bytes, program->size);
+  return 0;
+}
+
+// Times INSTRUCTION_CYCLES instructions of the program in every mode, after
+// one untimed pass through the body to warm up the caches
+static void bench_program(Bench *bench, const char *name,
+                          const Program *program) {
+  if (!selected(bench, name)) {
+    return;
+  }
+  for (Mode mode = MODE_DECODE; mode <= MODE_JIT; mode++) {
+    if (prepare(program, mode) == -1) {
+      continue;
+    }
+    chip8_run_batch(&emulator, BODY_LENGTH + 16);
+    for (int r = 0; r < bench->repeat; r++) {
+      double start = now_seconds();
+      chip8_run_batch(&emulator, INSTRUCTION_CYCLES);
+      bench->times[r] = now_seconds() - start;
+    }
+    if (emulator.fault) {
+      fprintf(stderr, "%s: %s at pc %x\n", name,
+              chip8_fault_name(emulator.fault), emulator.pc);
+      continue;
+    }
+    report(bench, name, MODE_NAMES[mode], INSTRUCTION_CYCLES, "instruction");
+  }
+}
+
+typedef struct OpcodeCase {
+  const char *name;
+  uint16_t instruction;
+  int chained;
+} OpcodeCase;
+
+// V0 = 0, V1 = 1, V2 = 3 and I = 0xe00 going in, chosen so no skip is
+// taken and stores land away from the code
+static const uint16_t OPCODE_PROLOGUE[] = {0x6000, 0x6101, 0x6203, 0xae00};
+
+static const OpcodeCase OPCODE_CASES[] = {
+    {"opcode/00E0", 0x00e0, 0}, {"opcode/1nnn", 0x1000, 1},
+    {"opcode/3xnn", 0x3001, 0}, {"opcode/4xnn", 0x4000, 0},
+    {"opcode/5xy0", 0x5010, 0}, {"opcode/6xnn", 0x6342, 0},
+    {"opcode/7xnn", 0x7305, 0}, {"opcode/8xy0", 0x8120, 0},
+    {"opcode/8xy1", 0x8121, 0}, {"opcode/8xy2", 0x8122, 0},
+    {"opcode/8xy3", 0x8123, 0}, {"opcode/8xy4", 0x8124, 0},
+    {"opcode/8xy5", 0x8125, 0}, {"opcode/8xy6", 0x8126, 0},
+    {"opcode/8xy7", 0x8127, 0}, {"opcode/8xyE", 0x812e, 0},
+    {"opcode/9xy0", 0x9000, 0}, {"opcode/Annn", 0xae00, 0},
+    {"opcode/Bnnn", 0xb000, 1}, {"opcode/Cxnn", 0xc3ff, 0},
+    {"opcode/Ex9E", 0xe09e, 0}, {"opcode/Fx07", 0xf307, 0},
+    {"opcode/Fx15", 0xf015, 0}, {"opcode/Fx18", 0xf018, 0},
+    {"opcode/Fx1E", 0xf01e, 0}, {"opcode/Fx29", 0xf329, 0},
+    {"opcode/Fx33", 0xf233, 0}, {"opcode/Fx55", 0xff55, 0},
+    {"opcode/Fx65", 0xff65, 0},
+};
+
+static void bench_opcodes(Bench *bench) {
+  static Program program;
+  size_t count = sizeof(OPCODE_CASES) / sizeof(OPCODE_CASES[0]);
+  for (size_t i = 0; i < count; i++) {
+    const OpcodeCase *c = &OPCODE_CASES[i];
+    begin_program(&program, OPCODE_PROLOGUE, 4);
+    fill_body(&program, c->instruction, c->chained);
+    bench_program(bench, c->name, &program);
+  }
+
+  // Each call goes to a return placed after the body
+  begin_program(&program, OPCODE_PROLOGUE, 4);
+  fill_body(&program, 0x2000 | body_end(), 0);
+  put_instruction(&program, body_end(), 0x00ee);
+  bench_program(bench, "opcode/2nnn+00EE", &program);
+}
+
+typedef struct DrawCase {
+  const char *name;
+  uint8_t x, y;
+} DrawCase;
+
+static const DrawCase DRAW_CASES[] = {
+    {"aligned", 0, 0},      {"unaligned", 3, 10}, {"clip_right", 60, 10},
+    {"clip_bottom", 3, 28}, {"wrap", 70, 40},
+};
+
+static void bench_draw(Bench *bench) {
+  static Program program;
+  static const uint8_t HEIGHTS[] = {1, 5, 15};
+  size_t count = sizeof(DRAW_CASES) / sizeof(DRAW_CASES[0]);
+  for (size_t i = 0; i < count; i++) {
+    for (size_t h = 0; h < sizeof(HEIGHTS); h++) {
+      char name[64];
+      snprintf(name, sizeof(name), "draw/%s/h%d", DRAW_CASES[i].name,
+               HEIGHTS[h]);
+      // Sprites come from the font, which is 80 bytes long
+      uint16_t prologue[] = {0x6000 | DRAW_CASES[i].x,
+                             0x6100 | DRAW_CASES[i].y, 0xa000 | 0x50};
+      begin_program(&program, prologue, 3);
+      fill_body(&program, 0xd010 | HEIGHTS[h], 0);
+      bench_program(bench, name, &program);
+    }
+  }
+}
+
+// 16x16 Dxy0 sprites on the 128x64 display, with a sprite straddling the
+// two halves of a row and one drawn to both XO-CHIP planes
+static const DrawCase HIRES_CASES[] = {
+    {"aligned", 0, 0}, {"unaligned", 67, 20}, {"straddle", 60, 20}};
+
+static void bench_draw_hires(Bench *bench) {
+  static Program program;
+  size_t count = sizeof(HIRES_CASES) / sizeof(HIRES_CASES[0]);
+  for (size_t i = 0; i <= count; i++) {
+    int planes = i == count;
+    const DrawCase *draw = &HIRES_CASES[planes ? 1 : i];
+    char name[64];
+    snprintf(name, sizeof(name), "draw/hires_%s/h16",
+             planes ? "two_planes" : draw->name);
+    // Sprites come from the big font, 160 bytes at 0xa0
+    uint16_t prologue[] = {0x00ff, planes ? 0xf301 : 0xf101,
+                           0x6000 | draw->x, 0x6100 | draw->y,
+                           0xa000 | CHIP8_BIG_FONT_OFFSET};
+    begin_program(&program, prologue, 5);
+    program.profile =
+        planes ? CHIP8_PROFILE_XO_CHIP : CHIP8_PROFILE_SUPER_CHIP;
+    fill_body(&program, 0xd010, 0);
+    bench_program(bench, name, &program);
+  }
+}
+
+// A mix of register, index and memory instructions without branches
+static void straight_line_program(Program *program) {
+  static const uint16_t MIX[] = {0x6305, 0x7407, 0x8344, 0x8532, 0x8653,
+                                 0xa400, 0xf41e, 0x8735, 0xf307, 0x8846};
+  begin_program(program, OPCODE_PROLOGUE, 4);
+  uint16_t address = BODY_START;
+  for (int i = 0; i < BODY_LENGTH; i++, address += 2) {
+    put_instruction(program, address, MIX[i % (sizeof(MIX) / sizeof(MIX[0]))]);
+  }
+  put_instruction(program, address, 0x1000 | BODY_START);
+}
+
+static void bench_straight_line(Bench *bench) {
+  static Program program;
+  straight_line_program(&program);
+  bench_program(bench, "rom/straight_line", &program);
+}
+
+// Three instructions: V0 += 1, V1 += V0, jump back
+static void bench_tight_loop(Bench *bench) {
+  static Program program;
+  memset(&program, 0, sizeof(program));
+  put_instruction(&program, 0x200, 0x7001);
+  put_instruction(&program, 0x202, 0x8104);
+  put_instruction(&program, 0x204, 0x1200);
+  bench_program(bench, "rom/tight_loop", &program);
+}
+
+#ifdef CHIP8_TRACE
+// rom/straight_line with a trace recording every instruction and never
+// stopping, to compare against the plain cached run
+static void bench_trace(Bench *bench) {
+  const char *name = "trace/straight_line";
+  if (!selected(bench, name)) {
+    return;
+  }
+  static Program program;
+  straight_line_program(&program);
+  Chip8Trace trace;
+  if (prepare(&program, MODE_CACHED) == -1 ||
+      chip8_trace_init(&trace, TRACE_RECORDS, 0, 0, 0) == -1) {
+    return;
+  }
+  chip8_attach_trace(&emulator, &trace);
+  chip8_run_batch(&emulator, BODY_LENGTH + 16);
+  for (int r = 0; r < bench->repeat; r++) {
+    double start = now_seconds();
+    chip8_run_batch(&emulator, INSTRUCTION_CYCLES);
+    bench->times[r] = now_seconds() - start;
+  }
+  chip8_attach_trace(&emulator, NULL);
+  chip8_trace_free(&trace);
+  report(bench, name, MODE_NAMES[MODE_CACHED], INSTRUCTION_CYCLES,
+         "instruction");
+}
+#endif
+
+static void bench_reset(Bench *bench) {
+  static Program program;
+  begin_program(&program, OPCODE_PROLOGUE, 4);
+  program.size = MAX_PROGRAM_SIZE;
+
+  for (Mode mode = MODE_DECODE; mode <= MODE_JIT; mode++) {
+    if (!selected(bench, "reset/init_load") || prepare(&program, mode) == -1) {
+      continue;
+    }
+    // Keep whatever prepare attached, as a frontend resetting a game would
+    Chip8DecodeCache *cache = emulator.decode_cache;
+    struct Chip8Jit *jit = emulator.jit;
+    for (int r = 0; r < bench->repeat; r++) {
+      double start = now_seconds();
+      for (int i = 0; i < RESET_ITERATIONS; i++) {
+        chip8_init_emulator(&emulator);
+        emulator.decode_cache = cache;
+        emulator.jit = jit;
+        chip8_load_program(&emulator, program.bytes, program.size);
+      }
+      bench->times[r] = now_seconds() - start;
+    }
+    report(bench, "reset/init_load", MODE_NAMES[mode], RESET_ITERATIONS,
+           "reset");
+  }
+
+  // chip8_reset back to the loaded program after running its prologue,
+  // which only touches registers, as a fuzzer resetting between inputs
+  for (Mode mode = MODE_DECODE; mode <= MODE_JIT; mode++) {
+    if (!selected(bench, "reset/dirty") || prepare(&program, mode) == -1) {
+      continue;
+    }
+    static Chip8Emulator pristine;
+    pristine = emulator;
+    for (int r = 0; r < bench->repeat; r++) {
+      double start = now_seconds();
+      for (int i = 0; i < RESET_ITERATIONS; i++) {
+        chip8_run_batch(&emulator, 4);
+        chip8_reset(&emulator, &pristine);
+      }
+      bench->times[r] = now_seconds() - start;
+    }
+    report(bench, "reset/dirty", MODE_NAMES[mode], RESET_ITERATIONS,
+           "reset");
+  }
+
+  // chip8_reset and run a loop again, which should run as fast as it did
+  // the first time
+  for (Mode mode = MODE_DECODE; mode <= MODE_JIT; mode++) {
+    static Program loop;
+    memset(&loop, 0, sizeof(loop));
+    put_instruction(&loop, 0x200, 0x7001);
+    put_instruction(&loop, 0x202, 0x8104);
+    put_instruction(&loop, 0x204, 0x1200);
+    if (!selected(bench, "reset/rerun") || prepare(&loop, mode) == -1) {
+      continue;
+    }
+    static Chip8Emulator pristine;
+    pristine = emulator;
+    for (int r = 0; r < bench->repeat; r++) {
+      double start = now_seconds();
+      for (int i = 0; i < RESET_ITERATIONS; i++) {
+        chip8_reset(&emulator, &pristine);
+        chip8_run_batch(&emulator, RERUN_CYCLES);
+      }
+      bench->times[r] = now_seconds() - start;
+    }
+    report(bench, "reset/rerun", MODE_NAMES[mode],
+           (uint64_t)RESET_ITERATIONS * RERUN_CYCLES, "instruction");
+  }
+}
+
+// The CPU side of presenting a frame, expanding the whole display to
+// 32-bit pixels. The SDL upload and copy are left out so this runs headless
+static void bench_unpack(Bench *bench) {
+  if (!selected(bench, "render/unpack_frame")) {
+    return;
+  }
+  static uint32_t pixels[CHIP8_DISPLAY_WIDTH * CHIP8_DISPLAY_HEIGHT];
+  static const uint32_t palette[4] = {0xff000000, 0xffffffff, 0xffaaaaaa,
+                                      0xff555555};
+  chip8_init_emulator(&emulator);
+  uint64_t row = 0x9e3779b97f4a7c15;
+  for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
+    row ^= row << 13;
+    row ^= row >> 7;
+    row ^= row << 17;
+    emulator.graphics[0][0][y] = row;
+  }
+
+  for (int r = 0; r < bench->repeat; r++) {
+    double start = now_seconds();
+    for (int i = 0; i < UNPACK_ITERATIONS; i++) {
+      chip8_unpack_display(&emulator, 0, CHIP8_DISPLAY_HEIGHT, palette, pixels,
+                           CHIP8_DISPLAY_WIDTH * sizeof(uint32_t));
+      // Keep the stores from being optimized away
+      __asm__ volatile("" : : "r"(pixels) : "memory");
+    }
+    bench->times[r] = now_seconds() - start;
+  }
+  report(bench, "render/unpack_frame", "default", UNPACK_ITERATIONS, "frame");
+}
+
+// Storing emulators that changed one register since their last store, as
+// a fleet does every few seconds, and loading them back
+static void bench_checkpoint(Bench *bench) {
+  int store = selected(bench, "checkpoint/store");
+  int load = selected(bench, "checkpoint/load");
+  if (!store && !load) {
+    return;
+  }
+  static Program program;
+  begin_program(&program, OPCODE_PROLOGUE, 4);
+  program.size = MAX_PROGRAM_SIZE;
+  char path[] = "/tmp/chip8-bench-XXXXXX";
+  int fd;
+  if (prepare(&program, MODE_CACHED) == -1 || (fd = mkstemp(path)) == -1) {
+    return;
+  }
+  close(fd);
+  Chip8Checkpoint checkpoint;
+  int opened = chip8_checkpoint_open(&checkpoint, path, CHECKPOINT_RECORDS);
+  unlink(path);
+  if (opened == -1) {
+    return;
+  }
+
+  // Fill every record first so the pages are mapped in
+  for (int i = 0; i < CHECKPOINT_RECORDS; i++) {
+    chip8_checkpoint_store(&checkpoint, i, 0, &emulator, 0);
+  }
+  if (store) {
+    for (int r = 0; r < bench->repeat; r++) {
+      double start = now_seconds();
+      for (int i = 0; i < CHECKPOINT_RECORDS; i++) {
+        emulator.registers[0] = r + i;
+        chip8_checkpoint_store(&checkpoint, i, 0, &emulator, r);
+      }
+      bench->times[r] = now_seconds() - start;
+    }
+    report(bench, "checkpoint/store", "default", CHECKPOINT_RECORDS,
+           "record");
+  }
+  if (load) {
+    uint64_t user;
+    for (int r = 0; r < bench->repeat; r++) {
+      double start = now_seconds();
+      for (int i = 0; i < CHECKPOINT_RECORDS; i++) {
+        chip8_checkpoint_load(&checkpoint, i, 0, &emulator, &user);
+      }
+      bench->times[r] = now_seconds() - start;
+    }
+    report(bench, "checkpoint/load", "default", CHECKPOINT_RECORDS,
+           "record");
+  }
+  chip8_checkpoint_close(&checkpoint);
+}
+
+// The phosphor's share of presenting a frame on the 128x64 display: one
+// step towards a new display, then expanding the intensities to pixels
+static void bench_phosphor(Bench *bench) {
+  static Chip8Phosphor phosphor;
+  static uint32_t pixels[CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT];
+  static const uint32_t palette[4] = {0xff000000, 0xffffffff, 0xffaaaaaa,
+                                      0xff555555};
+  chip8_init_emulator(&emulator);
+  emulator.hires = 1;
+  uint64_t row = 0x9e3779b97f4a7c15;
+  for (int y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+    for (int word = 0; word < 2; word++) {
+      row ^= row << 13;
+      row ^= row >> 7;
+      row ^= row << 17;
+      emulator.graphics[0][word][y] = row;
+    }
+  }
+  chip8_phosphor_init_decay(&phosphor, 100);
+
+  if (selected(bench, "render/phosphor_step")) {
+    for (int r = 0; r < bench->repeat; r++) {
+      double start = now_seconds();
+      for (int i = 0; i < PHOSPHOR_ITERATIONS; i++) {
+        // Flip a row every frame so there is always something fading
+        emulator.graphics[0][0][i % CHIP8_HIRES_HEIGHT] ^= UINT64_MAX;
+        chip8_phosphor_step(&phosphor,
+                            (const uint64_t(*)[2][CHIP8_HIRES_HEIGHT])
+                                emulator.graphics,
+                            1, 1000.0 / 60);
+      }
+      bench->times[r] = now_seconds() - start;
+    }
+    report(bench, "render/phosphor_step", "default", PHOSPHOR_ITERATIONS,
+           "frame");
+  }
+
+  if (selected(bench, "render/phosphor_unpack")) {
+    for (int r = 0; r < bench->repeat; r++) {
+      double start = now_seconds();
+      for (int i = 0; i < PHOSPHOR_ITERATIONS; i++) {
+        chip8_phosphor_unpack(&phosphor, 0, CHIP8_HIRES_HEIGHT, palette,
+                              pixels, CHIP8_HIRES_WIDTH * sizeof(uint32_t));
+        __asm__ volatile("" : : "r"(pixels) : "memory");
+      }
+      bench->times[r] = now_seconds() - start;
+    }
+    report(bench, "render/phosphor_unpack", "default", PHOSPHOR_ITERATIONS,
+           "frame");
+  }
+}
+
+int main(int argc, char **argv) {
+  Bench bench = {
+      .out = stdout,
+      .repeat = DEFAULT_REPEAT,
+  };
+  const char *output = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (strcmp(argv[i], "--output") == 0) {
+      output = argv[++i];
+    } else if (strcmp(argv[i], "--filter") == 0) {
+      bench.filter = argv[++i];
+    } else if (strcmp(argv[i], "--repeat") == 0) {
+      bench.repeat = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (bench.repeat < 1) {
+    puts("--repeat must be at least 1");
+    return EXIT_FAILURE;
+  }
+
+  if (output) {
+    bench.out = fopen(output, "w");
+    if (!bench.out) {
+      printf("Failed to open %s\n", output);
+      return EXIT_FAILURE;
+    }
+  }
+  bench.times = calloc(bench.repeat, sizeof(double));
+  if (!bench.times) {
+    puts("Failed to allocate the timings");
+    return EXIT_FAILURE;
+  }
+
+  fprintf(bench.out, "{\n  \"version\": 1,\n");
+#ifdef CHIP8_JIT
+  fprintf(bench.out, "  \"jit\": true,\n");
+#else
+  fprintf(bench.out, "  \"jit\": false,\n");
+#endif
+  fprintf(bench.out, "  \"repeat\": %d,\n  \"results\": [", bench.repeat);
+  bench_opcodes(&bench);
+  bench_draw(&bench);
+  bench_draw_hires(&bench);
+  bench_straight_line(&bench);
+  bench_tight_loop(&bench);
+#ifdef CHIP8_TRACE
+  bench_trace(&bench);
+#endif
+  bench_reset(&bench);
+  bench_unpack(&bench);
+  bench_phosphor(&bench);
+  bench_checkpoint(&bench);
+  fprintf(bench.out, "\n  ]\n}\n");
+
+  free(bench.times);
+  if (output) {
+    fclose(bench.out);
+  }
+  return EXIT_SUCCESS;
+}
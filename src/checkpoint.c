@@ -0,0 +1,309 @@
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "emulator.h"
+
+static const uint8_t MAGIC[4] = {'C', '8', 'C', 'K'};
+#define VERSION 3
+
+// Header fields
+#define HEADER_VERSION 4
+#define HEADER_RECORD_SIZE 8
+#define HEADER_SIZE_FIELD 12
+#define HEADER_COUNT 16
+#define HEADER_CHECKSUM 24
+
+// Record fields. The 8-bit ones are sp, the delay and sound timers, hires,
+// planes, key_wait, profile and fault, in that order
+#define RECORD_CHECKSUM 0
+#define RECORD_USER 8
+#define RECORD_CYCLES 16
+#define RECORD_NEXT_TIMER_CYCLE 24
+#define RECORD_IPS 32
+#define RECORD_TIMER_REMAINDER 36
+#define RECORD_RANDOM_STATE 40
+#define RECORD_DIRTY_ROWS 44
+#define RECORD_PC 48
+#define RECORD_INDEX_REGISTER 50
+#define RECORD_BYTES 52
+#define RECORD_REGISTERS 64
+#define RECORD_INPUTS 80
+#define RECORD_KEY_WAIT_CYCLE 96
+#define RECORD_PROGRAM 104
+#define RECORD_STACK 112
+#define RECORD_GRAPHICS 192
+#define RECORD_MEMORY 2240
+
+// Records are compared and written in blocks of this many bytes
+#define BLOCK_SIZE 64
+
+_Static_assert(RECORD_STACK + 2 * STACK_SIZE <= RECORD_GRAPHICS,
+               "the stack must fit before the display");
+_Static_assert(RECORD_GRAPHICS + sizeof(((Chip8Emulator *)0)->graphics) ==
+                   RECORD_MEMORY,
+               "the display must fill the space before the memory");
+_Static_assert(RECORD_MEMORY + MEMORY_SIZE == CHIP8_CHECKPOINT_RECORD_SIZE,
+               "the memory must end the record");
+_Static_assert(RECORD_MEMORY % BLOCK_SIZE == 0 &&
+                   CHIP8_CHECKPOINT_RECORD_SIZE % BLOCK_SIZE == 0,
+               "records must be whole blocks");
+
+static void put_le(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+static uint64_t get_le(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+// The display and checksums go through these a word at a time, so they
+// are plain loads and stores on little endian hosts
+static inline void put_le64(uint8_t *out, uint64_t value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  memcpy(out, &value, sizeof(value));
+}
+
+static inline uint64_t get_le64(const uint8_t *in) {
+  uint64_t value;
+  memcpy(&value, in, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  value = __builtin_bswap64(value);
+#endif
+  return value;
+}
+
+// 64-bit FNV-1a over little endian words rather than bytes, an eighth of
+// the multiplies. `size` is a multiple of 8
+static uint64_t hash_words(uint64_t hash, const uint8_t *bytes, size_t size) {
+  for (size_t i = 0; i < size; i += 8) {
+    hash ^= get_le64(bytes + i);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+#define HASH_START 0xcbf29ce484222325
+
+static uint8_t *record_at(const Chip8Checkpoint *checkpoint, size_t index) {
+  return checkpoint->mapping + CHIP8_CHECKPOINT_HEADER_SIZE +
+         index * CHIP8_CHECKPOINT_RECORD_SIZE;
+}
+
+static void write_header(uint8_t *header, size_t count) {
+  memset(header, 0, CHIP8_CHECKPOINT_HEADER_SIZE);
+  memcpy(header, MAGIC, sizeof(MAGIC));
+  put_le(header + HEADER_VERSION, VERSION, 2);
+  put_le(header + HEADER_RECORD_SIZE, CHIP8_CHECKPOINT_RECORD_SIZE, 4);
+  put_le(header + HEADER_SIZE_FIELD, CHIP8_CHECKPOINT_HEADER_SIZE, 4);
+  put_le(header + HEADER_COUNT, count, 8);
+  put_le(header + HEADER_CHECKSUM,
+         hash_words(HASH_START, header, HEADER_CHECKSUM), 8);
+}
+
+static int header_matches(const uint8_t *header, size_t count) {
+  return memcmp(header, MAGIC, sizeof(MAGIC)) == 0 &&
+         get_le(header + HEADER_VERSION, 2) == VERSION &&
+         get_le(header + HEADER_RECORD_SIZE, 4) ==
+             CHIP8_CHECKPOINT_RECORD_SIZE &&
+         get_le(header + HEADER_SIZE_FIELD, 4) ==
+             CHIP8_CHECKPOINT_HEADER_SIZE &&
+         get_le(header + HEADER_COUNT, 8) == count &&
+         get_le(header + HEADER_CHECKSUM, 8) ==
+             hash_words(HASH_START, header, HEADER_CHECKSUM);
+}
+
+int chip8_checkpoint_open(Chip8Checkpoint *checkpoint, const char *path,
+                          size_t count) {
+  checkpoint->mapping = NULL;
+  checkpoint->mapping_size = 0;
+  checkpoint->count = 0;
+  if (count == 0) {
+    return -1;
+  }
+  size_t size = CHIP8_CHECKPOINT_HEADER_SIZE +
+                count * (size_t)CHIP8_CHECKPOINT_RECORD_SIZE;
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    close(fd);
+    return -1;
+  }
+  // A new file starts as zeros, which no record's checksum matches
+  int created = info.st_size == 0;
+  if ((created && ftruncate(fd, size) == -1) ||
+      (!created && (size_t)info.st_size != size)) {
+    close(fd);
+    return -1;
+  }
+  uint8_t *mapping =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return -1;
+  }
+
+  if (created) {
+    write_header(mapping, count);
+  } else if (!header_matches(mapping, count)) {
+    munmap(mapping, size);
+    return -1;
+  }
+  checkpoint->mapping = mapping;
+  checkpoint->mapping_size = size;
+  checkpoint->count = count;
+  return 0;
+}
+
+void chip8_checkpoint_close(Chip8Checkpoint *checkpoint) {
+  if (checkpoint->mapping) {
+    msync(checkpoint->mapping, checkpoint->mapping_size, MS_SYNC);
+    munmap(checkpoint->mapping, checkpoint->mapping_size);
+  }
+  checkpoint->mapping = NULL;
+  checkpoint->mapping_size = 0;
+  checkpoint->count = 0;
+}
+
+// Copies `size` bytes into the record, skipping the blocks that already
+// match so they don't dirty their pages
+static void store_blocks(uint8_t *destination, const uint8_t *source,
+                         size_t size) {
+  for (size_t i = 0; i < size; i += BLOCK_SIZE) {
+    if (memcmp(destination + i, source + i, BLOCK_SIZE) != 0) {
+      memcpy(destination + i, source + i, BLOCK_SIZE);
+    }
+  }
+}
+
+void chip8_checkpoint_store(Chip8Checkpoint *checkpoint, size_t index,
+                            uint64_t program, const Chip8Emulator *emulator,
+                            uint64_t user) {
+  // Everything before the memory is laid out here first
+  _Alignas(BLOCK_SIZE) uint8_t state[RECORD_MEMORY];
+  memset(state, 0, RECORD_GRAPHICS);
+  put_le(state + RECORD_USER, user, 8);
+  put_le(state + RECORD_CYCLES, emulator->cycles, 8);
+  put_le(state + RECORD_NEXT_TIMER_CYCLE, emulator->next_timer_cycle, 8);
+  put_le(state + RECORD_KEY_WAIT_CYCLE, emulator->key_wait_cycle, 8);
+  put_le(state + RECORD_PROGRAM, program, 8);
+  put_le(state + RECORD_IPS, emulator->ips, 4);
+  put_le(state + RECORD_TIMER_REMAINDER, emulator->timer_remainder, 4);
+  put_le(state + RECORD_RANDOM_STATE, emulator->random_state, 4);
+  put_le(state + RECORD_DIRTY_ROWS, emulator->dirty_rows, 4);
+  put_le(state + RECORD_PC, emulator->pc, 2);
+  put_le(state + RECORD_INDEX_REGISTER, emulator->index_register, 2);
+  uint8_t *bytes = state + RECORD_BYTES;
+  bytes[0] = emulator->sp;
+  bytes[1] = emulator->delay_timer;
+  bytes[2] = emulator->sound_timer;
+  bytes[3] = emulator->hires;
+  bytes[4] = emulator->planes;
+  bytes[5] = emulator->key_wait;
+  bytes[6] = emulator->profile;
+  bytes[7] = emulator->fault;
+  memcpy(state + RECORD_REGISTERS, emulator->registers, 16);
+  memcpy(state + RECORD_INPUTS, emulator->inputs, 16);
+  for (int i = 0; i < STACK_SIZE; i++) {
+    put_le(state + RECORD_STACK + 2 * i, emulator->stack[i], 2);
+  }
+  const uint64_t *graphics = &emulator->graphics[0][0][0];
+  size_t words = sizeof(emulator->graphics) / sizeof(uint64_t);
+  for (size_t i = 0; i < words; i++) {
+    put_le64(state + RECORD_GRAPHICS + 8 * i, graphics[i]);
+  }
+
+  uint64_t checksum = hash_words(HASH_START, state + RECORD_USER,
+                                 RECORD_MEMORY - RECORD_USER);
+  checksum = hash_words(checksum, emulator->memory, MEMORY_SIZE);
+  put_le64(state + RECORD_CHECKSUM, checksum);
+
+  uint8_t *record = record_at(checkpoint, index);
+  store_blocks(record, state, RECORD_MEMORY);
+  store_blocks(record + RECORD_MEMORY, emulator->memory, MEMORY_SIZE);
+}
+
+int chip8_checkpoint_load(const Chip8Checkpoint *checkpoint, size_t index,
+                          uint64_t program, Chip8Emulator *emulator,
+                          uint64_t *user) {
+  if (index >= checkpoint->count) {
+    return -1;
+  }
+  const uint8_t *record = record_at(checkpoint, index);
+  if (get_le64(record + RECORD_CHECKSUM) !=
+      hash_words(HASH_START, record + RECORD_USER,
+                 CHIP8_CHECKPOINT_RECORD_SIZE - RECORD_USER) ||
+      get_le(record + RECORD_PROGRAM, 8) != program) {
+    return -1;
+  }
+
+  Chip8Emulator state;
+  memset(&state, 0, offsetof(Chip8Emulator, graphics));
+  state.cycles = get_le(record + RECORD_CYCLES, 8);
+  state.next_timer_cycle = get_le(record + RECORD_NEXT_TIMER_CYCLE, 8);
+  state.key_wait_cycle = get_le(record + RECORD_KEY_WAIT_CYCLE, 8);
+  state.ips = get_le(record + RECORD_IPS, 4);
+  state.timer_remainder = get_le(record + RECORD_TIMER_REMAINDER, 4);
+  state.random_state = get_le(record + RECORD_RANDOM_STATE, 4);
+  state.dirty_rows = get_le(record + RECORD_DIRTY_ROWS, 4);
+  state.pc = get_le(record + RECORD_PC, 2);
+  state.index_register = get_le(record + RECORD_INDEX_REGISTER, 2);
+  const uint8_t *bytes = record + RECORD_BYTES;
+  state.sp = bytes[0];
+  state.delay_timer = bytes[1];
+  state.sound_timer = bytes[2];
+  state.hires = bytes[3];
+  state.planes = bytes[4];
+  state.key_wait = bytes[5];
+  state.profile = bytes[6];
+  uint8_t fault = bytes[7];
+
+  // A checksum only catches damage, so also refuse states the emulator
+  // could never have been in, e.g. written by a buggy tool
+  if (state.sp > STACK_SIZE || state.hires > 1 ||
+      state.planes >= 1 << CHIP8_PLANES ||
+      (state.key_wait && (state.key_wait & ~0xf) != CHIP8_KEY_WAIT) ||
+      state.profile >= CHIP8_PROFILE_COUNT || fault > CHIP8_FAULT_EXIT ||
+      state.ips < CHIP8_TIMER_HZ || state.timer_remainder >= CHIP8_TIMER_HZ ||
+      state.random_state == 0 || state.cycles >= state.next_timer_cycle ||
+      state.key_wait_cycle > state.cycles) {
+    return -1;
+  }
+  state.fault = fault;
+
+  memcpy(state.registers, record + RECORD_REGISTERS, 16);
+  for (int i = 0; i < 16; i++) {
+    state.inputs[i] = record[RECORD_INPUTS + i] != 0;
+  }
+  for (int i = 0; i < STACK_SIZE; i++) {
+    state.stack[i] = get_le(record + RECORD_STACK + 2 * i, 2);
+  }
+  uint64_t *graphics = &state.graphics[0][0][0];
+  size_t words = sizeof(state.graphics) / sizeof(uint64_t);
+  for (size_t i = 0; i < words; i++) {
+    graphics[i] = get_le64(record + RECORD_GRAPHICS + 8 * i);
+  }
+  memcpy(state.memory, record + RECORD_MEMORY, MEMORY_SIZE);
+
+  chip8_restore_state(emulator, &state);
+  *user = get_le(record + RECORD_USER, 8);
+  return 0;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Machine states of many emulators in one file, so a long batch job can
+// pick up where it was stopped. Every record has the same size and a fixed
+// layout, so the file is mapped and record i is read or written in place
+// at a known offset, without parsing anything.
+//
+// The file is a 64 byte header and then the records, each 64 byte aligned.
+// The header is "C8CK", a version, the record size, the record count and a
+// checksum of the header. A record is its checksum, a value the caller
+// keeps with it, and then the machine state: cycles, timer schedule,
+// clock, random state, pc, I, the 8-bit registers and flags, V0 - VF, the
+// keys, the cycle Fx0A parked on, a hash of the program the state came
+// from, the stack, the display and the memory.
+// All numbers are little endian. The checksums are 64-bit FNV-1a over the
+// little endian 64-bit words after them
+//
+// Storing a record only writes the 64 byte blocks that differ from what is
+// already there, so an emulator that changed little since its last
+// checkpoint dirties few pages. Records are written through the mapping,
+// so a killed process loses nothing it stored. A record the process was
+// killed in the middle of storing fails its checksum and won't load
+
+#define CHIP8_CHECKPOINT_HEADER_SIZE 64
+#define CHIP8_CHECKPOINT_RECORD_SIZE 6336
+
+typedef struct Checkpoint {
+  uint8_t *mapping;
+  size_t mapping_size;
+  size_t count;
+} Chip8Checkpoint;
+
+// Opens the checkpoint at path for storing `count` records, creating it
+// with no records stored if it doesn't exist. Returns 0 on success, or -1
+// if it can't be created or mapped, or exists but isn't a checkpoint of
+// `count` records
+int chip8_checkpoint_open(Chip8Checkpoint *checkpoint, const char *path,
+                          size_t count);
+// Writes back whatever the kernel hasn't yet and unmaps the file
+void chip8_checkpoint_close(Chip8Checkpoint *checkpoint);
+// Stores emulator's state and `user` as record `index`, marked as running
+// `program`, e.g. its chip8_input_log_program_hash. Safe to call from
+// several threads at once for different records
+void chip8_checkpoint_store(Chip8Checkpoint *checkpoint, size_t index,
+                            uint64_t program, const Chip8Emulator *emulator,
+                            uint64_t user);
+// Restores record `index` into an initialized emulator as
+// chip8_restore_state does, keeping what is attached to it, and sets *user
+// to the value stored with it. Returns 0 on success, or -1 if the record
+// was never stored, fails its checksum, was stored for another program or
+// holds an impossible state, in which case emulator is left alone
+int chip8_checkpoint_load(const Chip8Checkpoint *checkpoint, size_t index,
+                          uint64_t program, Chip8Emulator *emulator,
+                          uint64_t *user);
@@ -0,0 +1,527 @@
+#define _DEFAULT_SOURCE
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "emulator.h"
+#include "input_log.h"
+
+static const uint8_t MAGIC[4] = {'C', '8', 'P', 'K'};
+#define VERSION 1
+#define HEADER_SIZE 16
+// Offset, size, hash and name length, before the name and its terminator
+#define ENTRY_SIZE 18
+
+static void put_le(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+static uint64_t get_le(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+void chip8_corpus_classify(const uint8_t *program, size_t size,
+                           Chip8Platform *platform, uint32_t *quirks) {
+  int super_chip = 0;
+  int xo_chip = size > MAX_PROGRAM_SIZE;
+  uint32_t found = 0;
+  // Code and data are mixed, so this only looks at even offsets and can
+  // be fooled by data that happens to decode as an instruction
+  for (size_t i = 0; i + 1 < size; i += 2) {
+    uint16_t ins = (uint16_t)(program[i] << 8 | program[i + 1]);
+    uint8_t x = (ins >> 8) & 0xf;
+    uint8_t y = (ins >> 4) & 0xf;
+    switch (ins >> 12) {
+    case 0x0:
+      if ((ins & 0xfff0) == 0x00d0 && ins != 0x00d0) {
+        xo_chip = 1;
+      } else if (((ins & 0xfff0) == 0x00c0 && ins != 0x00c0) ||
+                 (ins >= 0x00fb && ins <= 0x00ff)) {
+        super_chip = 1;
+      }
+      break;
+    case 0x5:
+      if ((ins & 0xf) == 0x2 || (ins & 0xf) == 0x3) {
+        xo_chip = 1;
+      }
+      break;
+    case 0x8:
+      switch (ins & 0xf) {
+      case 0x1:
+      case 0x2:
+      case 0x3:
+        found |= CHIP8_QUIRK_LOGIC;
+        break;
+      case 0x6:
+      case 0xe:
+        if (x != y) {
+          found |= CHIP8_QUIRK_SHIFT;
+        }
+        break;
+      }
+      break;
+    case 0xb:
+      found |= CHIP8_QUIRK_JUMP;
+      break;
+    case 0xd:
+      if ((ins & 0xf) == 0) {
+        super_chip = 1;
+      }
+      break;
+    case 0xf:
+      switch (ins & 0xff) {
+      case 0x00:
+      case 0x02:
+        // F000 nnnn loads a 16-bit I, F002 loads the audio pattern
+        xo_chip |= x == 0;
+        break;
+      case 0x01:
+        xo_chip |= x != 0;
+        break;
+      case 0x3a:
+        xo_chip = 1;
+        break;
+      case 0x30:
+      case 0x75:
+      case 0x85:
+        super_chip = 1;
+        break;
+      case 0x55:
+      case 0x65:
+        found |= CHIP8_QUIRK_LOAD_STORE;
+        break;
+      }
+      break;
+    }
+  }
+  *platform = xo_chip      ? CHIP8_PLATFORM_XO_CHIP
+              : super_chip ? CHIP8_PLATFORM_SUPER_CHIP
+                           : CHIP8_PLATFORM_CHIP8;
+  *quirks = found;
+}
+
+const char *chip8_platform_name(Chip8Platform platform) {
+  switch (platform) {
+  case CHIP8_PLATFORM_CHIP8:
+    return "chip-8";
+  case CHIP8_PLATFORM_SUPER_CHIP:
+    return "super-chip";
+  case CHIP8_PLATFORM_XO_CHIP:
+    return "xo-chip";
+  }
+  return "unknown";
+}
+
+// Fills in each entry's platform and quirks, and links duplicates to the
+// first entry with the same image through a hash table on the content hash
+static int index_entries(Chip8Corpus *corpus) {
+  size_t slots = 16;
+  while (slots < corpus->count * 2) {
+    slots *= 2;
+  }
+  size_t *table = malloc(slots * sizeof(size_t));
+  if (!table) {
+    return -1;
+  }
+  // Entry index + 1, so 0 is an empty slot
+  memset(table, 0, slots * sizeof(size_t));
+
+  corpus->unique = 0;
+  for (size_t i = 0; i < corpus->count; i++) {
+    Chip8CorpusEntry *entry = &corpus->entries[i];
+    chip8_corpus_classify(entry->data, entry->size, &entry->platform,
+                          &entry->quirks);
+    entry->original = i;
+    size_t slot = entry->hash & (slots - 1);
+    for (; table[slot]; slot = (slot + 1) & (slots - 1)) {
+      const Chip8CorpusEntry *other = &corpus->entries[table[slot] - 1];
+      if (other->hash == entry->hash && other->size == entry->size &&
+          memcmp(other->data, entry->data, entry->size) == 0) {
+        entry->original = table[slot] - 1;
+        break;
+      }
+    }
+    if (entry->original == i) {
+      table[slot] = i + 1;
+      corpus->unique++;
+    }
+  }
+  free(table);
+  return 0;
+}
+
+static int open_archive(Chip8Corpus *corpus, void *mapping, size_t size) {
+  const uint8_t *file = mapping;
+  if (size < HEADER_SIZE || get_le(file + 4, 2) != VERSION) {
+    return -1;
+  }
+  size_t count = get_le(file + 8, 4);
+  size_t table_end = HEADER_SIZE + get_le(file + 12, 4);
+  // Every entry takes at least ENTRY_SIZE + 1 bytes of the table
+  if (table_end > size ||
+      count > (table_end - HEADER_SIZE) / (ENTRY_SIZE + 1)) {
+    return -1;
+  }
+  corpus->entries = calloc(count ? count : 1, sizeof(Chip8CorpusEntry));
+  if (!corpus->entries) {
+    return -1;
+  }
+  corpus->count = count;
+
+  size_t offset = HEADER_SIZE;
+  for (size_t i = 0; i < count; i++) {
+    if (offset + ENTRY_SIZE > table_end) {
+      return -1;
+    }
+    const uint8_t *in = file + offset;
+    size_t image = get_le(in, 4);
+    size_t image_size = get_le(in + 4, 4);
+    size_t name_length = get_le(in + 16, 2);
+    offset += ENTRY_SIZE;
+    if (offset + name_length + 1 > table_end || file[offset + name_length] ||
+        image < table_end || image > size || image_size > size - image ||
+        image_size > CHIP8_CORPUS_MAX_IMAGE) {
+      return -1;
+    }
+    Chip8CorpusEntry *entry = &corpus->entries[i];
+    entry->name = (const char *)file + offset;
+    entry->data = file + image;
+    entry->size = image_size;
+    entry->hash = get_le(in + 8, 8);
+    offset += name_length + 1;
+  }
+  return index_entries(corpus);
+}
+
+// A file found while reading a directory, before it is sorted into place
+typedef struct Pending {
+  char *name;
+  size_t offset;
+  uint32_t size;
+} Pending;
+
+typedef struct Reader {
+  Pending *pending;
+  size_t count;
+  size_t capacity;
+  uint8_t *buffer;
+  size_t size;
+  size_t buffer_capacity;
+} Reader;
+
+// Appends the file at path to the reader's buffer with one read call in
+// the common case. Returns 1 if the file was skipped for its size
+static int read_file(Reader *reader, const char *path, char *name) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    close(fd);
+    return -1;
+  }
+  if (info.st_size > CHIP8_CORPUS_MAX_IMAGE) {
+    close(fd);
+    return 1;
+  }
+  size_t size = (size_t)info.st_size;
+
+  if (reader->size + size > reader->buffer_capacity) {
+    size_t capacity =
+        reader->buffer_capacity ? reader->buffer_capacity : 65536;
+    while (capacity < reader->size + size) {
+      capacity *= 2;
+    }
+    uint8_t *grown = realloc(reader->buffer, capacity);
+    if (!grown) {
+      close(fd);
+      return -1;
+    }
+    reader->buffer = grown;
+    reader->buffer_capacity = capacity;
+  }
+  if (reader->count == reader->capacity) {
+    size_t capacity = reader->capacity ? reader->capacity * 2 : 256;
+    Pending *grown = realloc(reader->pending, capacity * sizeof(Pending));
+    if (!grown) {
+      close(fd);
+      return -1;
+    }
+    reader->pending = grown;
+    reader->capacity = capacity;
+  }
+
+  size_t done = 0;
+  while (done < size) {
+    ssize_t got = read(fd, reader->buffer + reader->size + done, size - done);
+    if (got <= 0) {
+      close(fd);
+      return -1;
+    }
+    done += (size_t)got;
+  }
+  close(fd);
+
+  reader->pending[reader->count++] =
+      (Pending){.name = name, .offset = reader->size, .size = (uint32_t)size};
+  reader->size += size;
+  return 0;
+}
+
+// Reads every regular file under path. prefix is path relative to the
+// corpus root, which the entries are named by
+static int read_directory(Reader *reader, const char *path,
+                          const char *prefix) {
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return -1;
+  }
+  int result = 0;
+  struct dirent *item;
+  while (result == 0 && (item = readdir(dir))) {
+    if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0) {
+      continue;
+    }
+    size_t path_length = strlen(path) + strlen(item->d_name) + 2;
+    size_t name_length = strlen(prefix) + strlen(item->d_name) + 2;
+    char *child = malloc(path_length);
+    char *name = malloc(name_length);
+    if (!child || !name) {
+      free(child);
+      free(name);
+      result = -1;
+      break;
+    }
+    snprintf(child, path_length, "%s/%s", path, item->d_name);
+    snprintf(name, name_length, "%s%s%s", prefix, *prefix ? "/" : "",
+             item->d_name);
+
+    struct stat info;
+    if (stat(child, &info) == -1) {
+      free(name);
+    } else if (S_ISDIR(info.st_mode)) {
+      result = read_directory(reader, child, name);
+      free(name);
+    } else if (!S_ISREG(info.st_mode) ||
+               (result = read_file(reader, child, name)) != 0) {
+      free(name);
+      // Oversized files are skipped rather than failing the whole corpus
+      result = result == 1 ? 0 : result;
+    }
+    free(child);
+  }
+  closedir(dir);
+  return result;
+}
+
+static int compare_pending(const void *a, const void *b) {
+  return strcmp(((const Pending *)a)->name, ((const Pending *)b)->name);
+}
+
+// Moves what the reader collected into the corpus, sorted by name
+static int open_files(Chip8Corpus *corpus, Reader *reader) {
+  qsort(reader->pending, reader->count, sizeof(Pending), compare_pending);
+  corpus->buffer = reader->buffer;
+  reader->buffer = NULL;
+  corpus->entries = calloc(reader->count ? reader->count : 1,
+                           sizeof(Chip8CorpusEntry));
+  corpus->names = calloc(reader->count ? reader->count : 1, sizeof(char *));
+  if (!corpus->entries || !corpus->names) {
+    return -1;
+  }
+  for (size_t i = 0; i < reader->count; i++) {
+    const Pending *pending = &reader->pending[i];
+    Chip8CorpusEntry *entry = &corpus->entries[i];
+    corpus->names[i] = pending->name;
+    entry->name = pending->name;
+    // A corpus of empty files has no buffer
+    entry->data = corpus->buffer ? corpus->buffer + pending->offset
+                                 : (const uint8_t *)"";
+    entry->size = pending->size;
+    entry->hash = chip8_input_log_program_hash(entry->data, entry->size);
+    corpus->count++;
+  }
+  // Names now belong to the corpus
+  reader->count = 0;
+  return index_entries(corpus);
+}
+
+static void free_reader(Reader *reader) {
+  for (size_t i = 0; i < reader->count; i++) {
+    free(reader->pending[i].name);
+  }
+  free(reader->pending);
+  free(reader->buffer);
+}
+
+int chip8_corpus_open(Chip8Corpus *corpus, const char *path) {
+  memset(corpus, 0, sizeof(*corpus));
+  struct stat info;
+  if (stat(path, &info) == -1) {
+    return -1;
+  }
+
+  Reader reader = {0};
+  int result;
+  if (S_ISDIR(info.st_mode)) {
+    result = read_directory(&reader, path, "");
+  } else {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+      return -1;
+    }
+    uint8_t magic[sizeof(MAGIC)];
+    if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+        memcmp(magic, MAGIC, sizeof(MAGIC)) == 0) {
+      corpus->mapping_size = (size_t)info.st_size;
+      corpus->mapping =
+          mmap(NULL, corpus->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (corpus->mapping == MAP_FAILED) {
+        corpus->mapping = NULL;
+        return -1;
+      }
+      if (open_archive(corpus, corpus->mapping, corpus->mapping_size) == -1) {
+        chip8_corpus_close(corpus);
+        return -1;
+      }
+      return 0;
+    }
+    close(fd);
+
+    // A lone ROM is a corpus of one
+    char *name = strdup(path);
+    result = name ? read_file(&reader, path, name) : -1;
+    if (result != 0) {
+      free(name);
+      result = -1;
+    }
+  }
+
+  if (result == 0) {
+    result = open_files(corpus, &reader);
+  }
+  free_reader(&reader);
+  if (result != 0) {
+    chip8_corpus_close(corpus);
+    return -1;
+  }
+  return 0;
+}
+
+void chip8_corpus_close(Chip8Corpus *corpus) {
+  if (corpus->names) {
+    for (size_t i = 0; i < corpus->count; i++) {
+      free(corpus->names[i]);
+    }
+  }
+  free(corpus->names);
+  free(corpus->entries);
+  free(corpus->buffer);
+  if (corpus->mapping) {
+    munmap(corpus->mapping, corpus->mapping_size);
+  }
+  memset(corpus, 0, sizeof(*corpus));
+}
+
+int chip8_corpus_pack(const Chip8Corpus *corpus, const char *path) {
+  size_t table_size = 0;
+  for (size_t i = 0; i < corpus->count; i++) {
+    size_t name_length = strlen(corpus->entries[i].name);
+    if (name_length > UINT16_MAX) {
+      return -1;
+    }
+    table_size += ENTRY_SIZE + name_length + 1;
+  }
+
+  // Unique images go after the table in entry order, and duplicates point
+  // at their original's copy
+  size_t *offsets =
+      malloc((corpus->count ? corpus->count : 1) * sizeof(size_t));
+  uint8_t *table = malloc(HEADER_SIZE + table_size);
+  if (!offsets || !table) {
+    free(offsets);
+    free(table);
+    return -1;
+  }
+  size_t end = HEADER_SIZE + table_size;
+  for (size_t i = 0; i < corpus->count; i++) {
+    const Chip8CorpusEntry *entry = &corpus->entries[i];
+    if (entry->original == i) {
+      offsets[i] = end;
+      end += entry->size;
+    } else {
+      offsets[i] = offsets[entry->original];
+    }
+  }
+  if (end > UINT32_MAX) {
+    free(offsets);
+    free(table);
+    return -1;
+  }
+
+  memcpy(table, MAGIC, sizeof(MAGIC));
+  put_le(table + 4, VERSION, 2);
+  put_le(table + 6, 0, 2);
+  put_le(table + 8, corpus->count, 4);
+  put_le(table + 12, table_size, 4);
+  uint8_t *out = table + HEADER_SIZE;
+  for (size_t i = 0; i < corpus->count; i++) {
+    const Chip8CorpusEntry *entry = &corpus->entries[i];
+    size_t name_length = strlen(entry->name);
+    put_le(out, offsets[i], 4);
+    put_le(out + 4, entry->size, 4);
+    put_le(out + 8, entry->hash, 8);
+    put_le(out + 16, name_length, 2);
+    memcpy(out + ENTRY_SIZE, entry->name, name_length + 1);
+    out += ENTRY_SIZE + name_length + 1;
+  }
+
+  FILE *file = fopen(path, "wb");
+  int result = file ? 0 : -1;
+  if (file && fwrite(table, 1, HEADER_SIZE + table_size, file) !=
+                  HEADER_SIZE + table_size) {
+    result = -1;
+  }
+  for (size_t i = 0; file && result == 0 && i < corpus->count; i++) {
+    const Chip8CorpusEntry *entry = &corpus->entries[i];
+    if (entry->original == i && entry->size &&
+        fwrite(entry->data, 1, entry->size, file) != entry->size) {
+      result = -1;
+    }
+  }
+  if (file && fclose(file) != 0) {
+    result = -1;
+  }
+  free(offsets);
+  free(table);
+  return result;
+}
+
+int chip8_corpus_load(const Chip8Corpus *corpus, size_t index,
+                      Chip8Emulator *emulator) {
+  if (index >= corpus->count) {
+    return -1;
+  }
+  const Chip8CorpusEntry *entry = &corpus->entries[index];
+  if (entry->size > MAX_PROGRAM_SIZE) {
+    return -1;
+  }
+  chip8_load_program(emulator, entry->data, entry->size);
+  return 0;
+}
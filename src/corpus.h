@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// A set of ROMs opened in one go for batch runs, indexed by content. It
+// comes from a directory, read recursively into one buffer with a single
+// read per file, or from a packed archive, which is mapped whole so
+// opening it costs one open and one mmap however many ROMs it holds.
+// `chip8-corpus DIR --pack FILE` turns a directory into an archive. Files
+// bigger than CHIP8_CORPUS_MAX_IMAGE can't be ROMs and are skipped.
+//
+// An archive is a header, a table of entries and then the images. The
+// header is "C8PK", a version, the entry count and the table's size. Each
+// entry is the image's offset and size, its hash, and a name length
+// followed by the name. Identical images are stored once, with every entry
+// pointing at the same offset. All numbers are little endian
+
+// XO-CHIP's 64K address space, less the interpreter area
+#define CHIP8_CORPUS_MAX_IMAGE (0x10000 - 0x200)
+
+typedef enum Platform {
+  CHIP8_PLATFORM_CHIP8 = 0,
+  CHIP8_PLATFORM_SUPER_CHIP,
+  // Uses XO-CHIP instructions, not all of which this emulator runs, or is
+  // too big to load
+  CHIP8_PLATFORM_XO_CHIP,
+} Chip8Platform;
+
+// Instructions a ROM uses whose behavior differs between interpreters, so
+// its output may depend on the quirks emulated
+// 8xy6 or 8xyE with x != y: shifts Vy into Vx, or shifts Vx in place
+#define CHIP8_QUIRK_SHIFT 1
+// Fx55 or Fx65: I is left past the registers or unchanged
+#define CHIP8_QUIRK_LOAD_STORE 2
+// Bnnn: jumps to nnn + V0, or xnn + Vx
+#define CHIP8_QUIRK_JUMP 4
+// 8xy1, 8xy2 or 8xy3: VF is reset or left alone
+#define CHIP8_QUIRK_LOGIC 8
+
+typedef struct CorpusEntry {
+  // Path under the directory, or the name stored in the archive
+  const char *name;
+  // Points into the corpus's buffer or mapping, valid until it is closed
+  const uint8_t *data;
+  uint32_t size;
+  // chip8_input_log_program_hash of the image
+  uint64_t hash;
+  Chip8Platform platform;
+  // CHIP8_QUIRK_* flags
+  uint32_t quirks;
+  // Index of the first entry with the same image, the entry's own index
+  // if it is the first
+  size_t original;
+} Chip8CorpusEntry;
+
+typedef struct Corpus {
+  // Sorted by name when read from a directory, in stored order otherwise
+  Chip8CorpusEntry *entries;
+  size_t count;
+  // Entries that are the first with their image
+  size_t unique;
+
+  // Whichever of these backs the images
+  uint8_t *buffer;
+  void *mapping;
+  size_t mapping_size;
+  // Names read from a directory, owned by the corpus
+  char **names;
+} Chip8Corpus;
+
+// Opens a directory, a packed archive or a single ROM. Returns 0 on
+// success, or -1 if it can't be read or an archive is corrupt
+int chip8_corpus_open(Chip8Corpus *corpus, const char *path);
+void chip8_corpus_close(Chip8Corpus *corpus);
+// Writes the corpus as a packed archive, storing each image once. Returns
+// -1 if the file can't be written
+int chip8_corpus_pack(const Chip8Corpus *corpus, const char *path);
+// Loads entry `index` into an initialized emulator straight from the
+// corpus. Returns -1 if there is no such entry or the image is too big
+// for memory
+int chip8_corpus_load(const Chip8Corpus *corpus, size_t index,
+                      Chip8Emulator *emulator);
+// Guesses the platform from the instructions in the image, and which
+// CHIP8_QUIRK_* behaviors it depends on
+void chip8_corpus_classify(const uint8_t *program, size_t size,
+                           Chip8Platform *platform, uint32_t *quirks);
+const char *chip8_platform_name(Chip8Platform platform);
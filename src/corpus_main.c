@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "corpus.h"
+
+static void usage(const char *name) {
+  printf("usage: %s <directory | archive | program> [--pack FILE] "
+         "[--summary]\n",
+         name);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// One letter per CHIP8_QUIRK_* flag, '-' when it isn't set
+static void quirk_letters(uint32_t quirks, char *out) {
+  static const char LETTERS[] = "SLJV";
+  for (int i = 0; i < 4; i++) {
+    out[i] = quirks & (1u << i) ? LETTERS[i] : '-';
+  }
+  out[4] = '\0';
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *pack = NULL;
+  int summary = 0;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--pack") == 0 && i + 1 < argc) {
+      pack = argv[++i];
+    } else if (strcmp(argv[i], "--summary") == 0) {
+      summary = 1;
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  Chip8Corpus corpus;
+  double start = now_seconds();
+  if (chip8_corpus_open(&corpus, argv[1]) == -1) {
+    printf("Failed to open corpus: %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  double elapsed = now_seconds() - start;
+
+  size_t platforms[3] = {0};
+  if (!summary) {
+    printf("%-8s %-40s %6s %-16s %-10s %-6s %s\n", "entry", "name", "size",
+           "hash", "platform", "quirks", "duplicate of");
+  }
+  for (size_t i = 0; i < corpus.count; i++) {
+    const Chip8CorpusEntry *entry = &corpus.entries[i];
+    if (entry->original == i) {
+      platforms[entry->platform]++;
+    }
+    if (summary) {
+      continue;
+    }
+    char quirks[5];
+    quirk_letters(entry->quirks, quirks);
+    printf("%-8zu %-40s %6u %016llx %-10s %-6s", i, entry->name, entry->size,
+           (unsigned long long)entry->hash,
+           chip8_platform_name(entry->platform), quirks);
+    if (entry->original != i) {
+      printf(" %zu", entry->original);
+    }
+    putchar('\n');
+  }
+
+  printf("entries: %zu\n", corpus.count);
+  printf("unique: %zu\n", corpus.unique);
+  for (int p = 0; p < 3; p++) {
+    printf("%s: %zu\n", chip8_platform_name((Chip8Platform)p), platforms[p]);
+  }
+  printf("seconds: %.6f\n", elapsed);
+
+  int result = EXIT_SUCCESS;
+  if (pack && chip8_corpus_pack(&corpus, pack) == -1) {
+    printf("Failed to write archive: %s\n", pack);
+    result = EXIT_FAILURE;
+  }
+  chip8_corpus_close(&corpus);
+  return result;
+}
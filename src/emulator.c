@@ -5,16 +5,57 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "SDL_events.h"
-#include "SDL_keycode.h"
-#include "SDL_render.h"
+#include "audio.h"
 #include "emulator.h"
+#ifdef CHIP8_JIT
+#include "jit.h"
+#endif
+#ifdef CHIP8_STATS
+#include "stats.h"
+#endif
+#ifdef CHIP8_TRACE
+#include "trace.h"
+#endif
+
+_Static_assert(offsetof(Chip8Emulator, random_state) + 4 <= CHIP8_CACHE_LINE,
+               "the hot state must fit in one cache line");
+
+// Runs `statement` with `stats` pointing at the attached stats, if any.
+// Compiles to nothing without CHIP8_STATS
+#ifdef CHIP8_STATS
+#define STAT(emulator, statement)                                              \
+  do {                                                                         \
+    Chip8Stats *stats = (emulator)->stats;                                     \
+    if (stats) {                                                               \
+      statement;                                                               \
+    }                                                                          \
+  } while (0)
+#else
+#define STAT(emulator, statement) ((void)0)
+#endif
+
+// Runs `statement` with `trace` pointing at the attached trace, while one
+// is attached and still recording. Compiles to nothing without CHIP8_TRACE
+#ifdef CHIP8_TRACE
+#define TRACE(emulator, statement)                                             \
+  do {                                                                         \
+    Chip8Trace *trace = (emulator)->trace;                                     \
+    if (trace && !trace->triggered) {                                          \
+      statement;                                                               \
+    }                                                                          \
+  } while (0)
+#else
+#define TRACE(emulator, statement) ((void)0)
+#endif
+
+// Longest loop chip8_idle_loop recognizes, in instructions
+#define MAX_IDLE_LOOP_LENGTH 8
 
 // Offset into main memeory where fonts are stored
-static const uint16_t FONT_OFFSET = 0x50;
+static const uint16_t FONT_OFFSET = CHIP8_FONT_OFFSET;
 
 // Size of a font character in bytes
-static const uint16_t FONT_SIZE = 5;
+static const uint16_t FONT_SIZE = CHIP8_FONT_SIZE;
 
 // Byte representations of characters supported by the font
 static const uint8_t NUM_ZERO[] = {0xf0, 0x90, 0x90, 0x90, 0xf0};
@@ -34,9 +75,32 @@ static const uint8_t LETTER_D[] = {0xE0, 0x90, 0x90, 0x90, 0xE0};
 static const uint8_t LETTER_E[] = {0xF0, 0x80, 0xF0, 0x80, 0xF0};
 static const uint8_t LETTER_F[] = {0xF0, 0x80, 0xF0, 0x80, 0x80};
 
+// The SUPER-CHIP 8x10 digits, with the XO-CHIP letters after them
+static const uint8_t BIG_FONT[16][CHIP8_BIG_FONT_SIZE] = {
+    {0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF},
+    {0x18, 0x78, 0x78, 0x18, 0x18, 0x18, 0x18, 0x18, 0xFF, 0xFF},
+    {0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF},
+    {0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF},
+    {0xC3, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0x03, 0x03},
+    {0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF},
+    {0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF},
+    {0xFF, 0xFF, 0x03, 0x03, 0x06, 0x0C, 0x18, 0x18, 0x18, 0x18},
+    {0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF},
+    {0xFF, 0xFF, 0xC3, 0xC3, 0xFF, 0xFF, 0x03, 0x03, 0xFF, 0xFF},
+    {0x7E, 0xFF, 0xC3, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3},
+    {0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC, 0xC3, 0xC3, 0xFC, 0xFC},
+    {0x3C, 0xFF, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0xFF, 0x3C},
+    {0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC},
+    {0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF},
+    {0xFF, 0xFF, 0xC0, 0xC0, 0xFF, 0xFF, 0xC0, 0xC0, 0xC0, 0xC0},
+};
+
 void chip8_init_emulator(Chip8Emulator *emulator) {
   memset(emulator, 0, sizeof(Chip8Emulator));
-  
+  chip8_seed_random(emulator, CHIP8_DEFAULT_SEED);
+  chip8_set_clock(emulator, CHIP8_DEFAULT_IPS);
+  emulator->planes = 1;
+
   // Load the fonts, starting at the offset defined by FONT_OFFSET
   uint16_t offset = FONT_OFFSET;
   memcpy(emulator->memory + offset, NUM_ZERO, FONT_SIZE);
@@ -71,16 +135,225 @@ void chip8_init_emulator(Chip8Emulator *emulator) {
   offset += FONT_SIZE;
   memcpy(emulator->memory + offset, LETTER_F, FONT_SIZE);
   assert(offset == 0x9f - FONT_SIZE + 1);
+  memcpy(emulator->memory + CHIP8_BIG_FONT_OFFSET, BIG_FONT, sizeof(BIG_FONT));
+}
+
+// Marks the decoded copies of the instructions overlapping
+// memory[address, address + length) as stale. An instruction
+// starting one byte before the range also overlaps it
+static inline void invalidate_decoded(Chip8Emulator *emulator,
+                                      uint16_t address, uint16_t length) {
+  Chip8DecodeCache *cache = emulator->decode_cache;
+  if (!cache) {
+    return;
+  }
+  uint16_t start = address ? address - 1 : 0;
+  uint16_t end = address + length;
+  if (end > MEMORY_SIZE) {
+    end = MEMORY_SIZE;
+  }
+  for (uint16_t i = start; i < end; i++) {
+    cache->entries[i].handler = NULL;
+  }
+}
+
+// Drops the decoded and compiled code for memory the program wrote to
+static inline void invalidate_code(Chip8Emulator *emulator, uint16_t address,
+                                   uint16_t length) {
+#ifdef CHIP8_JIT
+  if (emulator->jit) {
+    chip8_jit_invalidate(emulator->jit, address, length);
+  }
+#endif
+  invalidate_decoded(emulator, address, length);
+}
+
+// Drops everything decoded or compiled, for when the profile changes what
+// the instructions do
+static void invalidate_all_code(Chip8Emulator *emulator) {
+#ifdef CHIP8_JIT
+  if (emulator->jit) {
+    chip8_jit_reset(emulator->jit);
+  }
+#endif
+  if (emulator->decode_cache) {
+    memset(emulator->decode_cache, 0, sizeof(Chip8DecodeCache));
+  }
 }
 
-void chip8_load_program(Chip8Emulator *emulator, uint8_t *program,
+// Drops the decoded and compiled code for memory a reset put back. The
+// JIT may compile it again, unlike code the program wrote
+static void discard_code(Chip8Emulator *emulator, uint16_t address,
+                         uint16_t length) {
+#ifdef CHIP8_JIT
+  if (emulator->jit) {
+    chip8_jit_discard(emulator->jit, address, length);
+  }
+#endif
+  invalidate_decoded(emulator, address, length);
+}
+
+// Invalidates the code in memory[address, address + length) and records
+// its blocks for chip8_reset
+static inline void mark_written(Chip8Emulator *emulator, uint16_t address,
+                                uint16_t length) {
+  uint16_t first = address / 64;
+  uint16_t last = (address + length - 1) / 64;
+  emulator->written_blocks |= (UINT64_MAX >> (63 - (last - first))) << first;
+  invalidate_code(emulator, address, length);
+}
+
+// Stores bytes from address on, wrapping past the end of memory the way
+// sprite reads do
+static void store_bytes(Chip8Emulator *emulator, uint16_t address,
+                        const uint8_t *bytes, uint16_t length) {
+  address &= MEMORY_SIZE - 1;
+  uint16_t before_end = MEMORY_SIZE - address;
+  if (length > before_end) {
+    memcpy(emulator->memory + address, bytes, before_end);
+    mark_written(emulator, address, before_end);
+    bytes += before_end;
+    length -= before_end;
+    address = 0;
+  }
+  memcpy(emulator->memory + address, bytes, length);
+  mark_written(emulator, address, length);
+}
+
+void chip8_seed_random(Chip8Emulator *emulator, uint32_t seed) {
+  // xorshift never leaves 0, so that seed would only give zeros
+  emulator->random_state = seed ? seed : 1;
+}
+
+void chip8_set_clock(Chip8Emulator *emulator, uint32_t ips) {
+  // Any slower and two ticks could land on the same cycle
+  if (ips < CHIP8_TIMER_HZ) {
+    ips = CHIP8_TIMER_HZ;
+  }
+  emulator->ips = ips;
+  emulator->timer_remainder = ips % CHIP8_TIMER_HZ;
+  emulator->next_timer_cycle = emulator->cycles + ips / CHIP8_TIMER_HZ;
+}
+
+void chip8_set_key(Chip8Emulator *emulator, uint8_t key, int down) {
+  key &= 0xf;
+  // Fx0A finishes when a key goes up, like the original interpreter which
+  // waited for the key to be let go before going on
+  if (emulator->key_wait && !down && emulator->inputs[key]) {
+    emulator->registers[emulator->key_wait & 0xf] = key;
+    emulator->key_wait = 0;
+    emulator->pc += 2;
+  }
+  emulator->inputs[key] = down != 0;
+}
+
+void chip8_load_program(Chip8Emulator *emulator, const uint8_t *program,
                         long program_size) {
   assert(program_size <= MAX_PROGRAM_SIZE);
   assert(program_size >= 0);
   memcpy(emulator->memory + 0x200, program, program_size);
+  if (program_size) {
+    mark_written(emulator, 0x200, program_size);
+  }
+#ifdef CHIP8_JIT
+  // Loading a program isn't self-modification, so start the JIT over
+  if (emulator->jit) {
+    chip8_jit_reset(emulator->jit);
+  }
+#endif
   emulator->pc = 0x200;
 }
 
+void chip8_restore_state(Chip8Emulator *emulator, const Chip8Emulator *state) {
+  for (int i = 0; i < MEMORY_SIZE;) {
+    if (emulator->memory[i] == state->memory[i]) {
+      i++;
+      continue;
+    }
+    int start = i;
+    while (i < MEMORY_SIZE && emulator->memory[i] != state->memory[i]) {
+      i++;
+    }
+    mark_written(emulator, start, i - start);
+  }
+
+  // Whatever either state wrote since the pristine one may differ from it
+  uint64_t written_blocks = emulator->written_blocks;
+  uint8_t display_written = emulator->display_written;
+  uint8_t profile = emulator->profile;
+  Chip8DecodeCache *decode_cache = emulator->decode_cache;
+  struct Chip8Jit *jit = emulator->jit;
+  struct Chip8Audio *audio = emulator->audio;
+#ifdef CHIP8_STATS
+  Chip8Stats *stats = emulator->stats;
+#endif
+#ifdef CHIP8_TRACE
+  Chip8Trace *trace = emulator->trace;
+#endif
+  *emulator = *state;
+  emulator->decode_cache = decode_cache;
+  emulator->jit = jit;
+  emulator->audio = audio;
+#ifdef CHIP8_STATS
+  emulator->stats = stats;
+#endif
+#ifdef CHIP8_TRACE
+  emulator->trace = trace;
+#endif
+  emulator->written_blocks |= written_blocks;
+  emulator->display_written |= display_written;
+  if (emulator->profile != profile) {
+    invalidate_all_code(emulator);
+  }
+}
+
+void chip8_reset(Chip8Emulator *emulator, const Chip8Emulator *pristine) {
+  uint64_t blocks = emulator->written_blocks;
+  while (blocks) {
+    uint16_t address = __builtin_ctzll(blocks) * 64;
+    blocks &= blocks - 1;
+    // Blocks written back as they were, like the program itself after a
+    // load, keep their decoded and compiled code
+    if (memcmp(emulator->memory + address, pristine->memory + address, 64) ==
+        0) {
+      continue;
+    }
+    memcpy(emulator->memory + address, pristine->memory + address, 64);
+    discard_code(emulator, address, 64);
+  }
+  if (emulator->display_written) {
+    memcpy(emulator->graphics, pristine->graphics, sizeof(emulator->graphics));
+  }
+
+  // Everything before the display is a couple of cache lines, cheaper to
+  // copy than to track
+  uint8_t profile = emulator->profile;
+  Chip8DecodeCache *decode_cache = emulator->decode_cache;
+  struct Chip8Jit *jit = emulator->jit;
+  struct Chip8Audio *audio = emulator->audio;
+#ifdef CHIP8_STATS
+  Chip8Stats *stats = emulator->stats;
+#endif
+#ifdef CHIP8_TRACE
+  Chip8Trace *trace = emulator->trace;
+#endif
+  memcpy(emulator, pristine, offsetof(Chip8Emulator, graphics));
+  emulator->decode_cache = decode_cache;
+  emulator->jit = jit;
+  emulator->audio = audio;
+#ifdef CHIP8_STATS
+  emulator->stats = stats;
+#endif
+#ifdef CHIP8_TRACE
+  emulator->trace = trace;
+#endif
+  emulator->written_blocks = 0;
+  emulator->display_written = 0;
+  if (emulator->profile != profile) {
+    invalidate_all_code(emulator);
+  }
+}
+
 // Reads the next instruction from memory and
 // increments the program counter in preparation
 // for the next instruction
@@ -93,221 +366,454 @@ static uint16_t fetch(Chip8Emulator *emulator) {
   return (first << 8) | second;
 }
 
-static inline uint16_t X(uint16_t ins) { return (ins & 0x0f00) >> 8; }
+static void jump(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  emulator->pc = op->nnn;
+}
+
+static void set_register(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  emulator->registers[op->x] = op->nn;
+}
 
-static inline uint16_t Y(uint16_t ins) { return (ins & 0x00f0) >> 4; }
+static void add_to_register(Chip8Emulator *emulator,
+                            const Chip8Instruction *op) {
+  emulator->registers[op->x] += op->nn;
+}
 
-static inline uint16_t N(uint16_t ins) { return ins & 0x000f; }
+static void set_index_register(Chip8Emulator *emulator,
+                               const Chip8Instruction *op) {
+  emulator->index_register = op->nnn;
+}
 
-static inline uint16_t NN(uint16_t ins) { return ins & 0x00ff; }
+int chip8_display_width(const Chip8Emulator *emulator) {
+  return emulator->hires ? CHIP8_HIRES_WIDTH : CHIP8_DISPLAY_WIDTH;
+}
 
-static inline uint16_t NNN(uint16_t ins) { return ins & 0x0fff; }
+int chip8_display_height(const Chip8Emulator *emulator) {
+  return emulator->hires ? CHIP8_HIRES_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+}
 
-static inline void jump(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t dest = NNN(ins);
-  emulator->pc = dest;
+// XORs an 8-pixel wide sprite into plane 0 of the 64x32 display, all a
+// CHIP-8 program ever draws. Returns the pixels that were already on
+__attribute__((always_inline)) static inline uint64_t
+draw_lores(Chip8Emulator *emulator, uint16_t x, uint16_t y, int rows,
+           int wrap) {
+  uint64_t collided = 0;
+  uint32_t dirty = 0;
+  for (int i = 0; i < rows; i++) {
+    int row = wrap ? (y + i) & (CHIP8_DISPLAY_HEIGHT - 1) : y + i;
+    uint64_t data =
+        (uint64_t)emulator->memory[(emulator->index_register + i) & 0xfff]
+        << 56;
+    // Rotated when wrapping, two steps since a shift by 64 is undefined
+    data = wrap ? data >> x | (data << 1) << (63 - x) : data >> x;
+    collided |= emulator->graphics[0][0][row] & data;
+    emulator->graphics[0][0][row] ^= data;
+    dirty |= (uint32_t)(data != 0) << row;
+  }
+  emulator->dirty_rows |= dirty;
+  return collided;
 }
 
-static inline void set_register(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t reg = X(ins);
-  uint16_t val = NN(ins);
-  emulator->registers[reg] = val;
+// Draws to each selected plane in turn, every plane taking the next
+// sprite's worth of data. Each sprite row is placed on a 128-bit display
+// row and XORed into both halves, with collisions gathered without branches
+__attribute__((always_inline)) static inline uint64_t
+draw_planes(Chip8Emulator *emulator, uint16_t x, uint16_t y, int rows,
+            int sprite_height, int wide, int wrap) {
+  int hires = emulator->hires;
+  int height = chip8_display_height(emulator);
+  // 64x32 mode drops what's shifted past the left half
+  uint64_t right_mask = hires ? UINT64_MAX : 0;
+  const uint8_t *memory = emulator->memory;
+  uint16_t address = emulator->index_register;
+  uint64_t collided = 0;
+  uint32_t dirty = 0;
+  for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+    if (!(emulator->planes & (1 << plane))) {
+      continue;
+    }
+    uint64_t *left_rows = emulator->graphics[plane][0];
+    uint64_t *right_rows = emulator->graphics[plane][1];
+    for (int i = 0; i < rows; i++) {
+      int row = wrap ? (y + i) & (height - 1) : y + i;
+      uint64_t data;
+      if (wide) {
+        data = (uint64_t)memory[(address + 2 * i) & 0xfff] << 8 |
+               memory[(address + 2 * i + 1) & 0xfff];
+        data <<= 48;
+      } else {
+        data = (uint64_t)memory[(address + i) & 0xfff] << 56;
+      }
+      uint64_t left, right;
+      if (x < 64) {
+        left = data >> x;
+        // Two steps, since a shift by 64 is undefined
+        right = (data << 1) << (63 - x);
+        // In 64x32 mode what wraps lands back on the left half
+        if (wrap && !hires) {
+          left |= right;
+        }
+      } else {
+        // Only 128x64 mode gets here, and what wraps comes from past x = 127
+        left = wrap ? (data << 1) << (127 - x) : 0;
+        right = data >> (x - 64);
+      }
+      right &= right_mask;
+      collided |= (left_rows[row] & left) | (right_rows[row] & right);
+      left_rows[row] ^= left;
+      right_rows[row] ^= right;
+      dirty |= (uint32_t)((left | right) != 0) << (row >> hires);
+    }
+    address += wide ? 2 * sprite_height : sprite_height;
+  }
+  emulator->dirty_rows |= dirty;
+  return collided;
 }
 
-static inline void add_to_register(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t reg = X(ins);
-  uint16_t val = NN(ins);
-  emulator->registers[reg] += val;
-  emulator->registers[reg] = emulator->registers[reg] % 256;
+// Kept out of line so draw() doesn't pay for draw_planes' registers on
+// CHIP-8 draws, one copy for each way of handling the edges
+__attribute__((noinline)) static uint64_t
+draw_planes_clipped(Chip8Emulator *emulator, uint16_t x, uint16_t y, int rows,
+                    int sprite_height, int wide) {
+  return draw_planes(emulator, x, y, rows, sprite_height, wide, 0);
 }
 
-static inline void set_index_register(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t val = NNN(ins);
-  emulator->index_register = val;
+__attribute__((noinline)) static uint64_t
+draw_planes_wrapped(Chip8Emulator *emulator, uint16_t x, uint16_t y, int rows,
+                    int sprite_height, int wide) {
+  return draw_planes(emulator, x, y, rows, sprite_height, wide, 1);
 }
 
-static inline void draw(Chip8Emulator *emulator, uint16_t ins) {
+__attribute__((always_inline)) static inline void
+draw(Chip8Emulator *emulator, const Chip8Instruction *op, int quirks) {
+  int wrap = (quirks & CHIP8_PROFILE_WRAPS) != 0;
   emulator->registers[0xf] = 0;
-  uint16_t x = emulator->registers[X(ins)] & 63;
-  uint16_t y = emulator->registers[Y(ins)] & 31;
-  uint16_t sprite_height = N(ins);
+  int width = chip8_display_width(emulator);
+  int height = chip8_display_height(emulator);
+  uint16_t x = emulator->registers[op->x] & (width - 1);
+  uint16_t y = emulator->registers[op->y] & (height - 1);
+  // Dxy0 draws a 16x16 sprite, two bytes per row
+  int wide = (quirks & CHIP8_PROFILE_EXTENDED) && op->n == 0;
+  int sprite_height = wide ? 16 : op->n;
+  // Rows past the bottom are dropped, or drawn from the top when wrapping
+  int rows = wrap || sprite_height < height - y ? sprite_height : height - y;
+  STAT(emulator, {
+    stats->draws += 1;
+    stats->draw_rows += rows;
+  });
+
+  uint64_t collided;
+  if (!emulator->hires && !wide && emulator->planes == 1) {
+    collided = draw_lores(emulator, x, y, rows, wrap);
+  } else if (wrap) {
+    collided = draw_planes_wrapped(emulator, x, y, rows, sprite_height, wide);
+  } else {
+    collided = draw_planes_clipped(emulator, x, y, rows, sprite_height, wide);
+  }
+  emulator->registers[0xf] = collided != 0;
+  emulator->display_written = 1;
+  STAT(emulator, stats->draw_collisions += emulator->registers[0xf]);
+  TRACE(emulator, trace->pending |= emulator->registers[0xf]
+                                        ? CHIP8_TRACE_COLLISION
+                                        : 0);
+}
 
-  for (int i = 0; i < sprite_height; i++) {
-    if (y >= CHIP8_DISPLAY_HEIGHT) {
-      break;
+static void clear_screen(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  (void)op;
+  // just zero the selected planes. 64x32 mode only ever sets the first
+  // rows of the left half
+  for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+    if (!(emulator->planes & (1 << plane))) {
+      continue;
     }
-    uint64_t data = (uint64_t)emulator->memory[emulator->index_register + i];
+    if (emulator->hires) {
+      memset(emulator->graphics[plane], 0, sizeof(emulator->graphics[plane]));
+    } else {
+      memset(emulator->graphics[plane][0], 0,
+             CHIP8_DISPLAY_HEIGHT * sizeof(uint64_t));
+    }
+  }
+  emulator->dirty_rows = UINT32_MAX;
+  emulator->display_written = 1;
+}
 
-    uint64_t new_bytes = (data << 56) >> x;
+// Scrolls the selected planes by whole rows, down when rows > 0
+static void scroll_vertical(Chip8Emulator *emulator, int rows) {
+  int height = chip8_display_height(emulator);
+  int distance = rows < 0 ? -rows : rows;
+  if (distance > height) {
+    distance = height;
+  }
+  size_t kept = (height - distance) * sizeof(uint64_t);
+  size_t cleared = distance * sizeof(uint64_t);
+  for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+    if (!(emulator->planes & (1 << plane))) {
+      continue;
+    }
+    for (int half = 0; half < 2; half++) {
+      uint64_t *graphics = emulator->graphics[plane][half];
+      if (rows > 0) {
+        memmove(graphics + distance, graphics, kept);
+        memset(graphics, 0, cleared);
+      } else {
+        memmove(graphics, graphics + distance, kept);
+        memset(graphics + height - distance, 0, cleared);
+      }
+    }
+  }
+  emulator->dirty_rows = UINT32_MAX;
+  emulator->display_written = 1;
+}
 
-    if (new_bytes & emulator->graphics[y]) {
-      emulator->registers[0xf] = 1;
+// Scrolls the selected planes 4 pixels sideways, right when right != 0.
+// Every row shifts the same way, which the compiler vectorizes
+static void scroll_horizontal(Chip8Emulator *emulator, int right) {
+  int height = chip8_display_height(emulator);
+  uint64_t right_mask = emulator->hires ? UINT64_MAX : 0;
+  for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+    if (!(emulator->planes & (1 << plane))) {
+      continue;
+    }
+    uint64_t *left_rows = emulator->graphics[plane][0];
+    uint64_t *right_rows = emulator->graphics[plane][1];
+    if (right) {
+      for (int y = 0; y < height; y++) {
+        right_rows[y] =
+            ((right_rows[y] >> 4) | (left_rows[y] << 60)) & right_mask;
+        left_rows[y] >>= 4;
+      }
+    } else {
+      for (int y = 0; y < height; y++) {
+        left_rows[y] = (left_rows[y] << 4) | (right_rows[y] >> 60);
+        right_rows[y] <<= 4;
+      }
     }
+  }
+  emulator->dirty_rows = UINT32_MAX;
+  emulator->display_written = 1;
+}
 
-    emulator->graphics[y] ^= new_bytes;
+// Scroll distances are in pixels of the current mode
+static void scroll_down(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  scroll_vertical(emulator, op->n);
+}
 
-    // moving to the next row and exiting if the sprite
-    // is cut off from the rest of the screen
-    y += 1;
-  }
+static void scroll_up(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  scroll_vertical(emulator, -op->n);
+}
 
-  // TODO: set the flags register to 0
+static void scroll_right(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  (void)op;
+  scroll_horizontal(emulator, 1);
 }
 
-static inline void clear_screen(Chip8Emulator *emulator) {
-  // just zero the entire graphics area
+static void scroll_left(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  (void)op;
+  scroll_horizontal(emulator, 0);
+}
+
+static void exit_program(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  (void)op;
+  emulator->fault = CHIP8_FAULT_EXIT;
+}
+
+// 00FE and 00FF, switching modes clears every plane
+static void set_resolution(Chip8Emulator *emulator,
+                           const Chip8Instruction *op) {
+  emulator->hires = op->n == 0xf;
   memset(emulator->graphics, 0, sizeof(emulator->graphics));
+  emulator->dirty_rows = UINT32_MAX;
+  emulator->display_written = 1;
 }
 
-static inline void call(Chip8Emulator *emulator, uint16_t ins) {
-  emulator->sp += 1;
+static void select_planes(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  emulator->planes = op->x & ((1 << CHIP8_PLANES) - 1);
+}
+
+static void call(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  if (emulator->sp >= STACK_SIZE) {
+    emulator->fault = CHIP8_FAULT_STACK_OVERFLOW;
+    return;
+  }
   emulator->stack[emulator->sp] = emulator->pc;
-  uint16_t dest = NNN(ins);
-  emulator->pc = dest;
+  emulator->sp += 1;
+  emulator->pc = op->nnn;
 }
 
-static inline void pop(Chip8Emulator *emulator) {
-  emulator->pc = emulator->stack[emulator->sp];
+static void pop(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  (void)op;
+  if (emulator->sp == 0) {
+    emulator->fault = CHIP8_FAULT_STACK_UNDERFLOW;
+    return;
+  }
   emulator->sp -= 1;
+  emulator->pc = emulator->stack[emulator->sp];
 }
 
-static inline void skip3(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t x = emulator->registers[X(ins)];
-  uint16_t nn = NN(ins);
-  if (x == nn) {
+static void skip3(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  if (emulator->registers[op->x] == op->nn) {
     emulator->pc += 2;
+    STAT(emulator, stats->skips_taken[CHIP8_OP_SE_BYTE] += 1);
   }
 }
 
-static inline void skip4(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t x = emulator->registers[X(ins)];
-  uint16_t nn = NN(ins);
-  if (x != nn) {
+static void skip4(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  if (emulator->registers[op->x] != op->nn) {
     emulator->pc += 2;
+    STAT(emulator, stats->skips_taken[CHIP8_OP_SNE_BYTE] += 1);
   }
 }
 
-static inline void skip5(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t x = emulator->registers[X(ins)];
-  uint16_t y = emulator->registers[Y(ins)];
+static void skip5(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  if (emulator->registers[op->x] == emulator->registers[op->y]) {
+    emulator->pc += 2;
+    STAT(emulator, stats->skips_taken[CHIP8_OP_SE_REG] += 1);
+  }
+}
 
-  if (x == y) {
+static void skip6(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  if (emulator->registers[op->x] != emulator->registers[op->y]) {
     emulator->pc += 2;
+    STAT(emulator, stats->skips_taken[CHIP8_OP_SNE_REG] += 1);
   }
 }
 
-static inline void skip6(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t x = emulator->registers[X(ins)];
-  uint16_t y = emulator->registers[Y(ins)];
+// 8xy0 - 8xyE, one handler per arithmetic operation
 
-  if (x != y) {
-    emulator->pc += 2;
+static void arithmetic_set(Chip8Emulator *emulator,
+                           const Chip8Instruction *op) {
+  emulator->registers[op->x] = emulator->registers[op->y];
+}
+
+// The handlers taking `quirks` are the ones whose behavior depends on the
+// profile. DEFINE_PROFILE below wraps them once per profile with quirks a
+// constant, so each copy only keeps its own profile's path
+
+static inline void arithmetic_or(Chip8Emulator *emulator,
+                                 const Chip8Instruction *op, int quirks) {
+  emulator->registers[op->x] |= emulator->registers[op->y];
+  if (quirks & CHIP8_PROFILE_RESETS_VF) {
+    emulator->registers[0xf] = 0;
   }
 }
 
-static inline void arithmetic(Chip8Emulator *emulator, uint16_t ins) {
-  uint16_t opcode = ins & 0xf;
-  uint16_t *x = &emulator->registers[X(ins)];
-  uint16_t y = emulator->registers[Y(ins)];
+static inline void arithmetic_and(Chip8Emulator *emulator,
+                                  const Chip8Instruction *op, int quirks) {
+  emulator->registers[op->x] &= emulator->registers[op->y];
+  if (quirks & CHIP8_PROFILE_RESETS_VF) {
+    emulator->registers[0xf] = 0;
+  }
+}
 
-  switch (opcode) {
+static inline void arithmetic_xor(Chip8Emulator *emulator,
+                                  const Chip8Instruction *op, int quirks) {
+  emulator->registers[op->x] ^= emulator->registers[op->y];
+  if (quirks & CHIP8_PROFILE_RESETS_VF) {
+    emulator->registers[0xf] = 0;
+  }
+}
 
-  // set
-  case 0:
-    *x = y;
-    break;
+static void arithmetic_add(Chip8Emulator *emulator,
+                           const Chip8Instruction *op) {
+  uint16_t sum = emulator->registers[op->x] + emulator->registers[op->y];
+  emulator->registers[op->x] = sum & 0xff;
+  emulator->registers[0xf] = sum > 255;
+}
 
-  // or
-  case 1:
-    *x |= y;
-    break;
+// subtract x - y
+static void arithmetic_sub(Chip8Emulator *emulator,
+                           const Chip8Instruction *op) {
+  uint8_t x = emulator->registers[op->x];
+  uint8_t y = emulator->registers[op->y];
+  emulator->registers[op->x] = (uint8_t)(x - y);
+  emulator->registers[0xf] = x >= y;
+}
 
-  // and
-  case 2:
-    *x &= y;
-    break;
+// shift right
+static inline void arithmetic_shr(Chip8Emulator *emulator,
+                                  const Chip8Instruction *op, int quirks) {
+  uint8_t *x = &emulator->registers[op->x];
+  *x = emulator->registers[quirks & CHIP8_PROFILE_SHIFTS_VX ? op->x : op->y];
+  emulator->registers[0xf] = *x & 0x01;
+  *x = *x >> 1;
+}
 
-  // xor
-  case 3:
-    *x ^= y;
-    break;
+// subtract y - x
+static void arithmetic_subn(Chip8Emulator *emulator,
+                            const Chip8Instruction *op) {
+  uint8_t x = emulator->registers[op->x];
+  uint8_t y = emulator->registers[op->y];
+  if (y >= x) {
+    emulator->registers[op->x] = y - x;
+    emulator->registers[0xf] = 1;
+  } else {
+    // VF is cleared first, so 8Fy7 subtracts from the cleared flag
+    emulator->registers[0xf] = 0;
+    emulator->registers[op->x] = (uint8_t)(y - emulator->registers[op->x]);
+  }
+}
 
-  // add
-  case 4:
-    *x += y;
-    if (*x > 255) {
-      *x &= 0xff;
-      emulator->registers[0xf] = 1;
-    } else {
-      emulator->registers[0xf] = 0;
-    }
-    break;
+// shift left
+static inline void arithmetic_shl(Chip8Emulator *emulator,
+                                  const Chip8Instruction *op, int quirks) {
+  uint16_t y =
+      emulator->registers[quirks & CHIP8_PROFILE_SHIFTS_VX ? op->x : op->y];
+  emulator->registers[op->x] = (y << 1) & 0xff;
+  emulator->registers[0xf] = (y & 0x80) >> 7;
+}
 
-  // subtract x - y
-  case 5:
-    
-    if (*x >= y) {
-      *x = *x - y;
-      emulator->registers[0xf] = 1;
-    } else {
-      uint8_t xsmall = *x;
-      uint8_t ysmall = y;
-      uint8_t sum = xsmall - ysmall;
-
-      // *x = 0;
-      *x = sum;
-      // *x = y - *x;
-      // *x = 255 + *x - y;
-      emulator->registers[0xf] = 0;
-    }
-    break;
+// Unassigned 8xyN operations are ignored
+static void arithmetic_none(Chip8Emulator *emulator,
+                            const Chip8Instruction *op) {
+  (void)emulator;
+  (void)op;
+}
 
-  // shift right
-  case 6: 
-    *x = y;
-    emulator->registers[0xf] = *x & 0x01;
-    *x = *x >> 1;
-    break;
+// Bnnn, or Bxnn where x is also the register
+static inline void jump_with_offset(Chip8Emulator *emulator,
+                                    const Chip8Instruction *op, int quirks) {
+  uint8_t offset = quirks & CHIP8_PROFILE_JUMPS_VX ? op->x : 0;
+  emulator->pc = emulator->registers[offset] + op->nnn;
+}
 
-  // subtract y - x
-  case 7:
-    if (y >= *x) {
-      *x = y - *x;
-      emulator->registers[0xf] = 1;
-    } else {
-      emulator->registers[0xf] = 0;
-      uint8_t xsmall = *x;
-      uint8_t ysmall = y;
-      uint8_t sum = ysmall - xsmall;
-      *x = sum;
-    }
-    break;
+// xorshift32, the same generator the lock-step engine runs per lane
+static void chip8_random(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  uint32_t state = emulator->random_state;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  emulator->random_state = state;
+  emulator->registers[op->x] = state & op->nn;
+}
 
-  // shift left
-  case 0xe:
-    *x = y;
-    uint16_t shifted2 = (*x & 0x80) >> 7;
-    *x = (*x << 1) & 0xff;
-    emulator->registers[0xf] = shifted2;
-    break;
+static void skip_if_key(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  if (emulator->inputs[emulator->registers[op->x] & 0xf]) {
+    emulator->pc += 2;
+    STAT(emulator, stats->skips_taken[CHIP8_OP_SKP] += 1);
   }
 }
 
-static void jump_with_offset(Chip8Emulator *emulator, uint16_t instruction) {
-  uint16_t nnn = NNN(instruction);
-  emulator->pc = emulator->registers[0] + nnn;
+static void skip_if_not_key(Chip8Emulator *emulator,
+                            const Chip8Instruction *op) {
+  if (!emulator->inputs[emulator->registers[op->x] & 0xf]) {
+    emulator->pc += 2;
+    STAT(emulator, stats->skips_taken[CHIP8_OP_SKNP] += 1);
+  }
 }
 
-static void chip8_random(Chip8Emulator *emulator, uint16_t instruction) {
-  uint16_t random = (uint16_t)rand() % 256;
-  uint16_t nn = NN(instruction);
-  uint16_t x = X(instruction);
-  emulator->registers[x] = random & nn;
+// Parks on this instruction by putting pc back on it. Running it again
+// while parked changes nothing, so time passes without any work being done
+static void wait_for_key(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  if (!emulator->key_wait) {
+    emulator->key_wait_cycle = emulator->cycles;
+  }
+  emulator->pc -= 2;
+  emulator->key_wait = CHIP8_KEY_WAIT | op->x;
 }
 
 static void binary_decimal_convert(Chip8Emulator *emulator,
-                                   uint16_t instruction) {
-  uint8_t num = emulator->registers[X(instruction)];
+                                   const Chip8Instruction *op) {
+  uint8_t num = emulator->registers[op->x];
 
   uint8_t biggest_digit = num / 100;
   num = num % 100;
@@ -315,248 +821,702 @@ static void binary_decimal_convert(Chip8Emulator *emulator,
   num = num % 10;
   uint8_t smallest_digit = num;
 
-  emulator->memory[emulator->index_register] = biggest_digit;
-  emulator->memory[emulator->index_register + 1] = middle_digit;
-  emulator->memory[emulator->index_register + 2] = smallest_digit;
+  uint8_t digits[] = {biggest_digit, middle_digit, smallest_digit};
+  store_bytes(emulator, emulator->index_register, digits, sizeof(digits));
 }
 
-static void store_memory(Chip8Emulator *emulator, uint16_t instruction) {
-  for (int i = 0; i <= X(instruction); i++) {
-    emulator->memory[emulator->index_register + i] = emulator->registers[i];
+static inline void store_memory(Chip8Emulator *emulator,
+                                const Chip8Instruction *op, int quirks) {
+  store_bytes(emulator, emulator->index_register, emulator->registers,
+              op->x + 1);
+  if (quirks & CHIP8_PROFILE_MOVES_I) {
+    emulator->index_register += op->x + 1;
   }
 }
 
-static void load_memory(Chip8Emulator *emulator, uint16_t instruction) {
-  for (int i = 0; i <= X(instruction); i++) {
-    emulator->registers[i] = emulator->memory[emulator->index_register + i];
+static inline void load_memory(Chip8Emulator *emulator,
+                               const Chip8Instruction *op, int quirks) {
+  for (int i = 0; i <= op->x; i++) {
+    emulator->registers[i] =
+        emulator->memory[(emulator->index_register + i) & 0xfff];
+  }
+  if (quirks & CHIP8_PROFILE_MOVES_I) {
+    emulator->index_register += op->x + 1;
   }
 }
 
-static void read_display_timer(Chip8Emulator *emulator, uint16_t instruction) {
-  uint16_t x = X(instruction);
-  emulator->registers[x] = emulator->delay_timer;
+static void read_display_timer(Chip8Emulator *emulator,
+                               const Chip8Instruction *op) {
+  emulator->registers[op->x] = emulator->delay_timer;
 }
 
-static void set_display_timer(Chip8Emulator *emulator, uint16_t instruction) {
-  uint16_t x = X(instruction);
-  emulator->delay_timer = emulator->registers[x];
+static void set_display_timer(Chip8Emulator *emulator,
+                              const Chip8Instruction *op) {
+  emulator->delay_timer = emulator->registers[op->x];
 }
 
-static void set_sound_timer(Chip8Emulator *emulator, uint16_t instruction) {
-  uint16_t x = X(instruction);
-  emulator->sound_timer = emulator->registers[x];
+static void set_sound_timer(Chip8Emulator *emulator,
+                            const Chip8Instruction *op) {
+  emulator->sound_timer = emulator->registers[op->x];
+  if (emulator->audio) {
+    chip8_audio_edge(emulator->audio, emulator->cycles,
+                     emulator->sound_timer != 0);
+  }
 }
 
-static void set_index_to_font(Chip8Emulator *emulator, uint16_t instruction) {
-  uint16_t character = emulator->registers[X(instruction)] & 0xf;
+static void set_index_to_font(Chip8Emulator *emulator,
+                              const Chip8Instruction *op) {
+  uint16_t character = emulator->registers[op->x] & 0xf;
   emulator->index_register = FONT_OFFSET + character * FONT_SIZE;
 }
 
-static void add_to_index(Chip8Emulator *emulator, uint16_t instruction) {
-  uint16_t x = emulator->registers[X(instruction)];
-  emulator->index_register += x;
+static void set_index_to_big_font(Chip8Emulator *emulator,
+                                  const Chip8Instruction *op) {
+  uint16_t character = emulator->registers[op->x] & 0xf;
+  emulator->index_register =
+      CHIP8_BIG_FONT_OFFSET + character * CHIP8_BIG_FONT_SIZE;
 }
 
-static void chip8_handle_f_instructions(Chip8Emulator *emulator,
-                                        uint16_t instruction) {
-  uint16_t lower_half = instruction & 0xff;
+static void add_to_index(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  emulator->index_register += emulator->registers[op->x];
+}
 
-  switch (lower_half) {
-  case 0x07:
-    read_display_timer(emulator, instruction);
-    break;
+static void unrecognized(Chip8Emulator *emulator, const Chip8Instruction *op) {
+  (void)emulator;
+  printf("unrecognized instruction %x\n", op->instruction);
+  TRACE(emulator, trace->pending |= CHIP8_TRACE_UNKNOWN);
+}
 
-  case 0x15:
-    set_display_timer(emulator, instruction);
-    break;
+// One profile's copies of the handlers above that take quirks
+typedef struct ProfileHandlers {
+  int quirks;
+  Chip8Handler arithmetic_or;
+  Chip8Handler arithmetic_and;
+  Chip8Handler arithmetic_xor;
+  Chip8Handler arithmetic_shr;
+  Chip8Handler arithmetic_shl;
+  Chip8Handler jump_with_offset;
+  Chip8Handler store_memory;
+  Chip8Handler load_memory;
+  Chip8Handler draw;
+} ProfileHandlers;
+
+#define PROFILE_HANDLER(profile, handler, quirks)                              \
+  static void profile##_##handler(Chip8Emulator *emulator,                     \
+                                  const Chip8Instruction *op) {                \
+    handler(emulator, op, quirks);                                             \
+  }
 
-  case 0x18:
-    set_sound_timer(emulator, instruction);
-    break;
+// Defines `name`, a profile's handlers, and the handlers themselves
+#define DEFINE_PROFILE(name, profile_quirks)                                   \
+  PROFILE_HANDLER(name, arithmetic_or, profile_quirks)                         \
+  PROFILE_HANDLER(name, arithmetic_and, profile_quirks)                        \
+  PROFILE_HANDLER(name, arithmetic_xor, profile_quirks)                        \
+  PROFILE_HANDLER(name, arithmetic_shr, profile_quirks)                        \
+  PROFILE_HANDLER(name, arithmetic_shl, profile_quirks)                        \
+  PROFILE_HANDLER(name, jump_with_offset, profile_quirks)                      \
+  PROFILE_HANDLER(name, store_memory, profile_quirks)                          \
+  PROFILE_HANDLER(name, load_memory, profile_quirks)                           \
+  PROFILE_HANDLER(name, draw, profile_quirks)                                  \
+  static const ProfileHandlers name = {                                        \
+      .quirks = (profile_quirks),                                              \
+      .arithmetic_or = name##_arithmetic_or,                                   \
+      .arithmetic_and = name##_arithmetic_and,                                 \
+      .arithmetic_xor = name##_arithmetic_xor,                                 \
+      .arithmetic_shr = name##_arithmetic_shr,                                 \
+      .arithmetic_shl = name##_arithmetic_shl,                                 \
+      .jump_with_offset = name##_jump_with_offset,                             \
+      .store_memory = name##_store_memory,                                     \
+      .load_memory = name##_load_memory,                                       \
+      .draw = name##_draw,                                                     \
+  };
+
+// default and cosmac keep the CHIP-8 decoding and draw, so Dxy0 draws
+// nothing and the SUPER-CHIP instructions are unrecognized
+DEFINE_PROFILE(default_profile, 0)
+DEFINE_PROFILE(cosmac_profile,
+               CHIP8_PROFILE_MOVES_I | CHIP8_PROFILE_RESETS_VF)
+DEFINE_PROFILE(super_chip_profile, CHIP8_PROFILE_SHIFTS_VX |
+                                       CHIP8_PROFILE_JUMPS_VX |
+                                       CHIP8_PROFILE_EXTENDED)
+DEFINE_PROFILE(xo_chip_profile, CHIP8_PROFILE_MOVES_I | CHIP8_PROFILE_WRAPS |
+                                    CHIP8_PROFILE_EXTENDED)
+
+static const ProfileHandlers *const PROFILES[CHIP8_PROFILE_COUNT] = {
+    [CHIP8_PROFILE_DEFAULT] = &default_profile,
+    [CHIP8_PROFILE_COSMAC] = &cosmac_profile,
+    [CHIP8_PROFILE_SUPER_CHIP] = &super_chip_profile,
+    [CHIP8_PROFILE_XO_CHIP] = &xo_chip_profile,
+};
+
+static Chip8Handler decode_arithmetic(const ProfileHandlers *profile,
+                                      uint16_t instruction) {
+  switch (instruction & 0xf) {
+  case 0x0:
+    return arithmetic_set;
+  case 0x1:
+    return profile->arithmetic_or;
+  case 0x2:
+    return profile->arithmetic_and;
+  case 0x3:
+    return profile->arithmetic_xor;
+  case 0x4:
+    return arithmetic_add;
+  case 0x5:
+    return arithmetic_sub;
+  case 0x6:
+    return profile->arithmetic_shr;
+  case 0x7:
+    return arithmetic_subn;
+  case 0xe:
+    return profile->arithmetic_shl;
+  default:
+    return arithmetic_none;
+  }
+}
 
-  case 0x29:
-    set_index_to_font(emulator, instruction);
-    break;
+static Chip8Handler decode_e_instructions(uint16_t instruction) {
+  switch (instruction & 0xff) {
+  case 0x9e:
+    return skip_if_key;
+  case 0xa1:
+    return skip_if_not_key;
+  default:
+    return unrecognized;
+  }
+}
 
+static Chip8Handler decode_f_instructions(const ProfileHandlers *profile,
+                                          uint16_t instruction) {
+  int extended = profile->quirks & CHIP8_PROFILE_EXTENDED;
+  switch (instruction & 0xff) {
+  case 0x01:
+    return extended ? select_planes : unrecognized;
+  case 0x07:
+    return read_display_timer;
+  case 0x0a:
+    return wait_for_key;
+  case 0x15:
+    return set_display_timer;
+  case 0x18:
+    return set_sound_timer;
+  case 0x1e:
+    return add_to_index;
+  case 0x29:
+    return set_index_to_font;
+  case 0x30:
+    return extended ? set_index_to_big_font : unrecognized;
   case 0x33:
-    binary_decimal_convert(emulator, instruction);
-    break;
-
+    return binary_decimal_convert;
   case 0x55:
-    store_memory(emulator, instruction);
-    break;
-
+    return profile->store_memory;
   case 0x65:
-    load_memory(emulator, instruction);
-    break;
-  
-  case 0x1e:
-    add_to_index(emulator, instruction);
-    break;
-
+    return profile->load_memory;
   default:
-    printf("unrecognized instruction %x\n", instruction);
-    break;
+    return unrecognized;
   }
 }
 
-static void chip8_handle_e_instructions(Chip8Emulator *emulator, uint16_t instruction) {
-  uint16_t lower_half = instruction & 0xff;
-
-  uint16_t x = emulator->registers[X(instruction)];
-  switch (lower_half) {
-  case 0x9e:
-  if (emulator->inputs[x]) {
-    emulator->pc += 2;
-    puts("hello");
+// Takes in the 16 bit instruction and splits it into its operands
+// and the handler that runs it
+static Chip8Handler decode_0_instructions(const ProfileHandlers *profile,
+                                          uint16_t instruction) {
+  switch (instruction) {
+  case 0x00e0:
+    return clear_screen;
+  case 0x00ee:
+    return pop;
   }
-  break;
-  
-  case 0xa1:
-  if (!emulator->inputs[x]) {
-    emulator->pc += 2;
+  if (!(profile->quirks & CHIP8_PROFILE_EXTENDED)) {
+    return unrecognized;
   }
-  break;
-
-  
+  switch (instruction & 0xfff0) {
+  case 0x00c0:
+    return scroll_down;
+  case 0x00d0:
+    return scroll_up;
+  }
+  switch (instruction) {
+  case 0x00fb:
+    return scroll_right;
+  case 0x00fc:
+    return scroll_left;
+  case 0x00fd:
+    return exit_program;
+  case 0x00fe:
+  case 0x00ff:
+    return set_resolution;
   default:
-    printf("unrecognized instruction %x\n", instruction);
-    break;
+    return unrecognized;
   }
 }
 
-// Takes in the 16 bit instruction, decoding it into its component
-// parts and running it
-static void decode_and_execute(Chip8Emulator *emulator, uint16_t instruction) {
-  // The instruction's "name" is the first 4 bits of the instruction
-  uint16_t instruction_type = (instruction & 0xf000) >> 12;
+// Handlers for the instructions the profile affects come from its table
+static void decode(const ProfileHandlers *profile, Chip8Instruction *op,
+                   uint16_t instruction) {
+  op->instruction = instruction;
+  op->nnn = instruction & 0x0fff;
+  op->x = (instruction & 0x0f00) >> 8;
+  op->y = (instruction & 0x00f0) >> 4;
+  op->nn = instruction & 0x00ff;
+  op->n = instruction & 0x000f;
 
-  switch (instruction_type) {
+  // The instruction's "name" is the first 4 bits of the instruction
+  switch ((instruction & 0xf000) >> 12) {
   case 0x0:
-    if (instruction == 0x00e0) {
-      clear_screen(emulator);
-    } else if (instruction == 0x00ee) {
-      pop(emulator);
-    } else {
-      printf("unrecognized instruction %x\n", instruction);
-    }
+    op->handler = decode_0_instructions(profile, instruction);
     break;
-
   case 0x1:
-    jump(emulator, instruction);
+    op->handler = jump;
     break;
-
   case 0x2:
-    call(emulator, instruction);
+    op->handler = call;
     break;
-
   case 0x3:
-    skip3(emulator, instruction);
+    op->handler = skip3;
     break;
-
   case 0x4:
-    skip4(emulator, instruction);
+    op->handler = skip4;
     break;
-
   case 0x5:
-    skip5(emulator, instruction);
+    op->handler = skip5;
     break;
-
   case 0x6:
-    set_register(emulator, instruction);
+    op->handler = set_register;
     break;
-
   case 0x7:
-    add_to_register(emulator, instruction);
+    op->handler = add_to_register;
     break;
-
   case 0x8:
-    arithmetic(emulator, instruction);
+    op->handler = decode_arithmetic(profile, instruction);
     break;
-
   case 0x9:
-    skip6(emulator, instruction);
+    op->handler = skip6;
     break;
-
   case 0xa:
-    set_index_register(emulator, instruction);
+    op->handler = set_index_register;
     break;
-
   case 0xb:
-    jump_with_offset(emulator, instruction);
+    op->handler = profile->jump_with_offset;
     break;
-
   case 0xc:
-    chip8_random(emulator, instruction);
+    op->handler = chip8_random;
     break;
-
   case 0xd:
-    draw(emulator, instruction);
+    op->handler = profile->draw;
     break;
-
   case 0xe:
-    chip8_handle_e_instructions(emulator, instruction);
-    break;
-
-  case 0xf:
-    chip8_handle_f_instructions(emulator, instruction);
+    op->handler = decode_e_instructions(instruction);
     break;
-
   default:
-    printf("unrecognized instruction %x\n", instruction);
+    op->handler = decode_f_instructions(profile, instruction);
     break;
   }
 }
 
-static void handle_timers(Chip8Emulator *emulator, uint32_t delta_t) {
+// Runs the timer tick due at next_timer_cycle and schedules the next one
+static inline void tick_timers(Chip8Emulator *emulator) {
   if (emulator->delay_timer) {
-    emulator->delay_timer_acc += delta_t; 
+    emulator->delay_timer -= 1;
+    STAT(emulator, stats->delay_underflows += !emulator->delay_timer);
+  }
+  if (emulator->sound_timer) {
+    emulator->sound_timer -= 1;
+    STAT(emulator, stats->sound_underflows += !emulator->sound_timer);
+    if (!emulator->sound_timer && emulator->audio) {
+      chip8_audio_edge(emulator->audio, emulator->next_timer_cycle, 0);
+    }
+  }
 
-    if (emulator->delay_timer_acc >= 16) {
-      emulator->delay_timer_acc -= 16;
-      emulator->delay_timer -= 1;
-    }   
+  uint64_t step = (uint64_t)emulator->timer_remainder + emulator->ips;
+  emulator->next_timer_cycle += step / CHIP8_TIMER_HZ;
+  emulator->timer_remainder = step % CHIP8_TIMER_HZ;
+}
+
+#ifdef CHIP8_TRACE
+// Records an instruction that just ran and checks the triggers. The
+// handlers flag unknown instructions and collisions in trace->pending
+static inline void trace_instruction(const Chip8Emulator *emulator,
+                                     Chip8Trace *trace, uint16_t pc,
+                                     uint16_t instruction) {
+  uint8_t x = (instruction >> 8) & 0xf;
+  trace->records[trace->written++ & trace->mask] = (Chip8TraceRecord){
+      .cycle = emulator->cycles,
+      .pc = pc,
+      .instruction = instruction,
+      .index_register = emulator->index_register,
+      .vx = emulator->registers[x],
+      .vf = emulator->registers[0xf],
+  };
+  int fired = trace->pending;
+  trace->pending = 0;
+  if ((uint16_t)(pc - trace->first_pc) <=
+      (uint16_t)(trace->last_pc - trace->first_pc)) {
+    fired |= CHIP8_TRACE_PC;
+  }
+  if (emulator->fault || emulator->pc + 1 >= MEMORY_SIZE) {
+    fired |= CHIP8_TRACE_FAULT;
+  }
+  // Only the lowest, so the file names a single trigger
+  fired &= trace->triggers;
+  trace->triggered = fired & -fired;
+}
+#endif
+
+// Runs the instruction at pc, going through the decode cache when
+// one is attached so each address is only decoded once
+void chip8_step(Chip8Emulator *emulator) {
+  if (emulator->fault) {
+    return;
+  }
+  if (emulator->pc + 1 >= MEMORY_SIZE) {
+    emulator->fault = CHIP8_FAULT_PC_OUT_OF_RANGE;
+    return;
+  }
+
+  emulator->cycles += 1;
+#ifdef CHIP8_TRACE
+  // Jumps move pc, so the trace needs it from before the handler runs
+  uint16_t pc = emulator->pc;
+#endif
+  Chip8DecodeCache *cache = emulator->decode_cache;
+  if (!cache) {
+    Chip8Instruction op;
+    decode(PROFILES[emulator->profile], &op, fetch(emulator));
+    STAT(emulator, chip8_stats_count(stats, emulator->pc - 2, op.instruction,
+                                     PROFILES[emulator->profile]->quirks));
+    op.handler(emulator, &op);
+    TRACE(emulator, trace_instruction(emulator, trace, pc, op.instruction));
+  } else {
+    Chip8Instruction *op = &cache->entries[emulator->pc];
+    if (!op->handler) {
+      decode(PROFILES[emulator->profile], op,
+             (emulator->memory[emulator->pc] << 8) |
+                 emulator->memory[emulator->pc + 1]);
+    }
+    STAT(emulator, chip8_stats_count(stats, emulator->pc, op->instruction,
+                                     PROFILES[emulator->profile]->quirks));
+    emulator->pc += 2;
+    // Writes to the code only clear handlers, so op->instruction survives
+    op->handler(emulator, op);
+    TRACE(emulator, trace_instruction(emulator, trace, pc, op->instruction));
+  }
+
+  if (emulator->cycles == emulator->next_timer_cycle) {
+    tick_timers(emulator);
+  }
+}
+
+void chip8_catch_up_timers(Chip8Emulator *emulator, uint64_t cycle) {
+  // Usually at most one tick is due, and stepping through a few is cheaper
+  // than dividing by ips to jump over them
+  for (int i = 0; i < 4; i++) {
+    if (cycle < emulator->next_timer_cycle) {
+      return;
+    }
+    tick_timers(emulator);
   }
+  // Tick j lands on next_timer_cycle + (timer_remainder + j * ips) / 60,
+  // which gives the number of ticks due without stepping through them
+  uint64_t due = cycle - emulator->next_timer_cycle + 1;
+  uint64_t ticks =
+      (due * CHIP8_TIMER_HZ - emulator->timer_remainder + emulator->ips - 1) /
+      emulator->ips;
 
+  if (emulator->delay_timer) {
+    uint64_t delay = emulator->delay_timer;
+    emulator->delay_timer = ticks < delay ? delay - ticks : 0;
+    STAT(emulator, stats->delay_underflows += !emulator->delay_timer);
+  }
   if (emulator->sound_timer) {
-    emulator->sound_timer_acc += delta_t;
+    uint64_t sound = emulator->sound_timer;
+    emulator->sound_timer = ticks < sound ? sound - ticks : 0;
+    STAT(emulator, stats->sound_underflows += !emulator->sound_timer);
+    if (!emulator->sound_timer && emulator->audio) {
+      // It stopped on tick sound - 1, counting from 0
+      chip8_audio_edge(emulator->audio,
+                       emulator->next_timer_cycle +
+                           (emulator->timer_remainder +
+                            (sound - 1) * emulator->ips) /
+                               CHIP8_TIMER_HZ,
+                       0);
+    }
+  }
+
+  uint64_t elapsed = emulator->timer_remainder + ticks * emulator->ips;
+  emulator->next_timer_cycle += elapsed / CHIP8_TIMER_HZ;
+  emulator->timer_remainder = elapsed % CHIP8_TIMER_HZ;
+}
+
+uint64_t chip8_run_batch(Chip8Emulator *emulator, uint64_t cycles) {
+#ifdef CHIP8_JIT
+  int use_jit = emulator->jit != NULL;
+  // Compiled blocks would run past the stats hooks uncounted, and past
+  // the trace hooks unrecorded until the trace stops
+  STAT(emulator, use_jit = 0);
+  TRACE(emulator, use_jit = 0);
+  if (use_jit) {
+    return chip8_jit_run(emulator, cycles);
+  }
+#endif
+  // The last loop found not to be idle, so a busy loop isn't checked on
+  // every iteration. Code may change under it, but that only costs a skip
+  uint16_t not_idle = MEMORY_SIZE;
+  uint64_t i = 0;
+  while (i < cycles) {
+    uint16_t pc = emulator->pc;
+    chip8_step(emulator);
+    if (emulator->fault) {
+      return i;
+    }
+    i++;
+    // Loops close with a backward jump, so that's when to look for idle ones.
+    // Fx0A parks by staying put, which counts as one
+    if (emulator->pc <= pc && emulator->pc != not_idle) {
+      uint64_t skipped = chip8_skip_idle(emulator, cycles - i);
+      if (!skipped) {
+        not_idle = emulator->pc;
+      }
+      i += skipped;
+    }
+  }
+  return cycles;
+}
+
+// Checks for an idle loop at pc, see chip8_idle_loop. On success *end is
+// the address of the jump that closes it
+static int find_idle_loop(const Chip8Emulator *emulator, uint16_t *end) {
+  uint16_t start = emulator->pc;
+  int flags = CHIP8_IDLE_LOOP;
+  for (int i = 0; i < MAX_IDLE_LOOP_LENGTH; i++) {
+    uint16_t address = start + 2 * i;
+    if (address + 1 >= MEMORY_SIZE) {
+      return 0;
+    }
+    uint16_t instruction =
+        (emulator->memory[address] << 8) | emulator->memory[address + 1];
+    // Only skips may come before the jump back, so the loop either goes
+    // around or skips past the jump and leaves
+    switch (instruction >> 12) {
+    case 0x1:
+      if ((instruction & 0x0fff) != start) {
+        return 0;
+      }
+      *end = address;
+      return flags;
+    case 0x3:
+    case 0x4:
+    case 0x5:
+    case 0x9:
+      break;
+    case 0xe:
+      if ((instruction & 0xff) != 0x9e && (instruction & 0xff) != 0xa1) {
+        return 0;
+      }
+      flags |= CHIP8_IDLE_KEYS;
+      break;
+    case 0xf:
+      if ((instruction & 0xff) != 0x07) {
+        return 0;
+      }
+      flags |= CHIP8_IDLE_TIMER;
+      break;
+    default:
+      return 0;
+    }
+  }
+  return 0;
+}
+
+int chip8_idle_loop(const Chip8Emulator *emulator) {
+  if (emulator->key_wait) {
+    return CHIP8_IDLE_LOOP | CHIP8_IDLE_KEYS;
+  }
+  uint16_t end;
+  return find_idle_loop(emulator, &end);
+}
+
+uint64_t chip8_skip_idle(Chip8Emulator *emulator, uint64_t cycles) {
+  // Skipped instructions would go uncounted
+  STAT(emulator, return 0);
+  if (emulator->key_wait) {
+    // Keys don't change in the middle of a batch, so nothing runs until
+    // it ends
+    emulator->cycles += cycles;
+    chip8_catch_up_timers(emulator, emulator->cycles);
+    return cycles;
+  }
+  uint16_t start = emulator->pc;
+  uint16_t end;
+  if (!cycles || !find_idle_loop(emulator, &end)) {
+    return 0;
+  }
+
+  uint8_t registers[16];
+  memcpy(registers, emulator->registers, sizeof(registers));
+  uint64_t next_timer_cycle = emulator->next_timer_cycle;
+  uint64_t length = 0;
+  do {
+    chip8_step(emulator);
+    length += 1;
+  } while (emulator->pc != start && emulator->pc <= end && length < cycles);
+  if (emulator->pc != start ||
+      emulator->next_timer_cycle != next_timer_cycle ||
+      memcmp(registers, emulator->registers, sizeof(registers)) != 0) {
+    return length;
+  }
+
+  // The loop went around without changing anything, so every iteration
+  // after it is the same until a timer tick or key change. Keys don't
+  // change in the middle of a batch, and the last skipped iteration ends
+  // before the tick so chip8_step still runs it
+  uint64_t room = cycles - length;
+  uint64_t until_tick = next_timer_cycle - emulator->cycles - 1;
+  if (room > until_tick) {
+    room = until_tick;
+  }
+  uint64_t skipped = room / length * length;
+  emulator->cycles += skipped;
+  return length + skipped;
+}
+
+void chip8_attach_decode_cache(Chip8Emulator *emulator,
+                               Chip8DecodeCache *cache) {
+  emulator->decode_cache = cache;
+  if (cache) {
+    memset(cache, 0, sizeof(Chip8DecodeCache));
+  }
+}
 
-    if (emulator->sound_timer_acc >= 16) {
-      emulator->sound_timer_acc -= 16;
-      emulator->sound_timer -= 1;
-    }   
+void chip8_set_profile(Chip8Emulator *emulator, Chip8Profile profile) {
+  assert(profile < CHIP8_PROFILE_COUNT);
+  if (emulator->profile != profile) {
+    emulator->profile = profile;
+    invalidate_all_code(emulator);
   }
 }
 
-void chip8_run(Chip8Emulator *emulator, uint64_t delta_t, SDL_Event event) {
-  uint16_t ins = fetch(emulator);
-  decode_and_execute(emulator, ins);
-  handle_timers(emulator, delta_t);
+int chip8_profile_quirks(Chip8Profile profile) {
+  return PROFILES[profile]->quirks;
 }
 
-void chip8_render_grid(SDL_Renderer *r, double width, double height) {
-  SDL_SetRenderDrawColor(r, 0xff, 0xff, 0, 0x0f);
-  for (int x = 1; x < CHIP8_DISPLAY_WIDTH; x++) {
-    SDL_RenderDrawLine(r, width / 64.0 * x, 0, width / 64 * x, height);
+const char *chip8_profile_name(Chip8Profile profile) {
+  switch (profile) {
+  case CHIP8_PROFILE_DEFAULT:
+    return "default";
+  case CHIP8_PROFILE_COSMAC:
+    return "cosmac";
+  case CHIP8_PROFILE_SUPER_CHIP:
+    return "super-chip";
+  case CHIP8_PROFILE_XO_CHIP:
+    return "xo-chip";
+  case CHIP8_PROFILE_COUNT:
+    break;
   }
+  return "unknown";
+}
 
-  for (int y = 1; y < CHIP8_DISPLAY_HEIGHT; y++) {
-    SDL_RenderDrawLine(r, 0, height / 32.0 * y, width, height / 32 * y);
+static int plane_empty(const Chip8Emulator *emulator, int plane) {
+  uint64_t any = 0;
+  for (int y = 0; y < CHIP8_HIRES_HEIGHT; y++) {
+    any |= emulator->graphics[plane][0][y] | emulator->graphics[plane][1][y];
   }
+  return any == 0;
+}
+
+uint64_t chip8_framebuffer_hash(const Chip8Emulator *emulator) {
+  // 64 bit FNV-1a over the visible rows, most significant byte first so the
+  // hash doesn't depend on the host's byte order. Empty planes past the
+  // first are left out, so a CHIP-8 display hashes as it always has
+  uint64_t hash = 0xcbf29ce484222325;
+  int words = chip8_display_width(emulator) / 64;
+  int height = chip8_display_height(emulator);
+  for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+    if (plane > 0 && plane_empty(emulator, plane)) {
+      continue;
+    }
+    for (int y = 0; y < height; y++) {
+      for (int word = 0; word < words; word++) {
+        uint64_t row = emulator->graphics[plane][word][y];
+        for (int shift = 56; shift >= 0; shift -= 8) {
+          hash ^= (row >> shift) & 0xff;
+          hash *= 0x100000001b3;
+        }
+      }
+    }
+  }
+  return hash;
+}
+
+void chip8_unpack_display(const Chip8Emulator *emulator, int first_row,
+                          int rows, const uint32_t palette[4], void *pixels,
+                          int pitch) {
+  chip8_unpack_graphics(emulator->graphics, emulator->hires, first_row, rows,
+                        palette, pixels, pitch);
 }
 
-// TODO: lower number of drawcalls by calling SDL_RenderFillRects for all 32 *
-// 64 pixels at once
-void chip8_render_display(SDL_Renderer *r, double width, double height,
-                          Chip8Emulator *emulator) {
-  for (int x = 0; x < CHIP8_DISPLAY_WIDTH; x++) {
-    for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
-      SDL_Rect pixel = {width / 64.0 * x, height / 32.0 * y,
-                        width / 64.0 * (x + 1), height / 32.0 * (y + 1)};
-      int color =
-          emulator->graphics[y] & (0x8000000000000000 >> x) ? 0xff : 0x00;
-      SDL_SetRenderDrawColor(r, color, color, color, 0xff);
-      SDL_RenderFillRect(r, &pixel);
+void chip8_unpack_graphics(
+    const uint64_t graphics[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT], int hires,
+    int first_row, int rows, const uint32_t palette[4], void *pixels,
+    int pitch) {
+  int words = hires ? 2 : 1;
+  for (int y = 0; y < rows; y++) {
+    uint32_t *out = (uint32_t *)((uint8_t *)pixels + (size_t)y * pitch);
+    for (int word = 0; word < words; word++, out += 64) {
+      uint64_t low = graphics[0][word][first_row + y];
+      uint64_t high = graphics[1][word][first_row + y];
+      // Branch free so the compiler can vectorize it. Only XO-CHIP
+      // programs draw to plane 1, so most rows need just two colors
+      if (!high) {
+        for (int x = 0; x < 64; x++) {
+          uint32_t mask = -((uint32_t)(low >> (63 - x)) & 1);
+          out[x] = (palette[1] & mask) | (palette[0] & ~mask);
+        }
+        continue;
+      }
+      for (int x = 0; x < 64; x++) {
+        uint32_t low_mask = -((uint32_t)(low >> (63 - x)) & 1);
+        uint32_t high_mask = -((uint32_t)(high >> (63 - x)) & 1);
+        uint32_t plane0 = (palette[1] & low_mask) | (palette[0] & ~low_mask);
+        uint32_t both = (palette[3] & low_mask) | (palette[2] & ~low_mask);
+        out[x] = (both & high_mask) | (plane0 & ~high_mask);
+      }
     }
   }
 }
+
+const char *chip8_fault_name(Chip8Fault fault) {
+  switch (fault) {
+  case CHIP8_FAULT_NONE:
+    return "none";
+  case CHIP8_FAULT_PC_OUT_OF_RANGE:
+    return "pc out of range";
+  case CHIP8_FAULT_STACK_OVERFLOW:
+    return "stack overflow";
+  case CHIP8_FAULT_STACK_UNDERFLOW:
+    return "stack underflow";
+  case CHIP8_FAULT_EXIT:
+    return "exited";
+  }
+  return "unknown";
+}
+
+long chip8_read_program(const char *path, uint8_t *buffer) {
+  FILE *program = fopen(path, "rb");
+  if (!program) {
+    return -1;
+  }
+  fseek(program, 0, SEEK_END);
+  long file_len = ftell(program);
+  if (file_len > MAX_PROGRAM_SIZE || file_len == -1) {
+    fclose(program);
+    return -1;
+  }
+  rewind(program);
+  if (file_len > 0 && fread(buffer, file_len, 1, program) != 1) {
+    fclose(program);
+    return -1;
+  }
+  fclose(program);
+  return file_len;
+}
@@ -1,43 +1,269 @@
 #pragma once
 
-#include "SDL_events.h"
-#include "SDL_render.h"
-#include <SDL.h>
 #include <stdint.h>
 
 #define MEMORY_SIZE 4096
 #define PROGRAM_START_OFFSET 512
 #define MAX_PROGRAM_SIZE (MEMORY_SIZE - PROGRAM_START_OFFSET)
-#define STACK_SIZE 1024
+// Return addresses, the 16 levels the original interpreters allowed
+#define STACK_SIZE 16
+#define CHIP8_CACHE_LINE 64
+
+// Random number seed chip8_init_emulator starts with
+#define CHIP8_DEFAULT_SEED 1
 
 // width is 8 bytes or 64 bits
 #define CHIP8_DISPLAY_WIDTH 64
 // height is 4 bytes or 32 bits
 #define CHIP8_DISPLAY_HEIGHT 32
+// SUPER-CHIP high resolution mode
+#define CHIP8_HIRES_WIDTH 128
+#define CHIP8_HIRES_HEIGHT 64
+// XO-CHIP bitplanes, each pixel picks one of four colors
+#define CHIP8_PLANES 2
+
+// Where the built-in font lives in memory, and the size of one glyph
+#define CHIP8_FONT_OFFSET 0x50
+#define CHIP8_FONT_SIZE 5
+// The SUPER-CHIP 8x10 font Fx30 points at, right after the small one
+#define CHIP8_BIG_FONT_OFFSET 0xa0
+#define CHIP8_BIG_FONT_SIZE 10
+
+// The delay and sound timers count down at 60 Hz of emulated time
+#define CHIP8_TIMER_HZ 60
+// Instructions per emulated second chip8_init_emulator starts with
+#define CHIP8_DEFAULT_IPS 700
+
+// Set in key_wait while the emulator is parked on Fx0A
+#define CHIP8_KEY_WAIT 0x10
+
+// Why an emulator stopped running. A faulted emulator ignores further
+// instructions until it is initialized again
+typedef enum Fault {
+  CHIP8_FAULT_NONE = 0,
+  // pc ran off the end of memory
+  CHIP8_FAULT_PC_OUT_OF_RANGE,
+  // 2nnn with a full stack
+  CHIP8_FAULT_STACK_OVERFLOW,
+  // 00EE with an empty stack
+  CHIP8_FAULT_STACK_UNDERFLOW,
+  // 00FD, the SUPER-CHIP exit instruction
+  CHIP8_FAULT_EXIT,
+} Chip8Fault;
+
+// Interpreters differ on a few instructions, and a program written for
+// one may not run right on another. A profile picks the behavior for all
+// of them. Each profile gets its own copy of the handlers involved, built
+// at compile time with its choices fixed, so picking one costs nothing
+// per instruction
+typedef enum Profile {
+  // What this emulator has always done: 8xy6/8xyE shift Vy, Bnnn adds V0,
+  // Fx55/Fx65 leave I alone, 8xy1/2/3 leave VF alone, sprites are clipped
+  // at the edges and the SUPER-CHIP instructions are unrecognized
+  CHIP8_PROFILE_DEFAULT = 0,
+  // The original COSMAC VIP interpreter, which moves I past the registers
+  // and resets VF on logic operations
+  CHIP8_PROFILE_COSMAC,
+  // SUPER-CHIP 1.1, which shifts Vx in place, makes Bxnn add Vx and adds
+  // the 128x64 display instructions
+  CHIP8_PROFILE_SUPER_CHIP,
+  // XO-CHIP, which moves I past the registers, wraps sprites around and
+  // adds the 128x64 display and plane instructions
+  CHIP8_PROFILE_XO_CHIP,
+  CHIP8_PROFILE_COUNT,
+} Chip8Profile;
+
+// Flags chip8_profile_quirks returns, one per behavior that differs
+// 8xy6/8xyE shift Vx in place rather than Vy into Vx
+#define CHIP8_PROFILE_SHIFTS_VX 1
+// Bxnn jumps to xnn + Vx rather than nnn + V0
+#define CHIP8_PROFILE_JUMPS_VX 2
+// Fx55/Fx65 leave I just past the last register
+#define CHIP8_PROFILE_MOVES_I 4
+// 8xy1/2/3 set VF to 0
+#define CHIP8_PROFILE_RESETS_VF 8
+// Sprites wrap around the display edges rather than being clipped
+#define CHIP8_PROFILE_WRAPS 16
+// The SUPER-CHIP and XO-CHIP instructions run: 00Cn, 00Dn, 00FB - 00FF,
+// Fn01, Fx30 and Dxy0 as a 16x16 sprite. Without it they are
+// unrecognized and Dxy0 draws nothing
+#define CHIP8_PROFILE_EXTENDED 32
+
+struct Emulator;
+struct Instruction;
+struct Chip8Jit;
+struct Chip8Stats;
+struct Chip8Trace;
+struct Chip8Audio;
+
+typedef void (*Chip8Handler)(struct Emulator *emulator,
+                             const struct Instruction *op);
+
+// An instruction split into its operands, along with the handler that runs it
+typedef struct Instruction {
+  Chip8Handler handler;
+  uint16_t instruction;
+  uint16_t nnn;
+  uint8_t x;
+  uint8_t y;
+  uint8_t nn;
+  uint8_t n;
+} Chip8Instruction;
+
+// Decoded instructions for every address in memory. An entry with a NULL
+// handler has not been decoded yet, or was overwritten since it was decoded
+typedef struct DecodeCache {
+  Chip8Instruction entries[MEMORY_SIZE];
+} Chip8DecodeCache;
 
 typedef struct Emulator {
-  uint8_t memory[MEMORY_SIZE];
-  uint16_t stack[STACK_SIZE];
-  // sp == Stack pointer
-  uint16_t sp;
-  // program counter
-  uint16_t pc;
-  // The registers, named/indexed V0 - VF
-  uint16_t registers[16];
+  // Hot state, touched by nearly every instruction. It fills the first
+  // cache line, which the alignment keeps from straddling two
+  _Alignas(CHIP8_CACHE_LINE) uint16_t pc;
   uint16_t index_register;
-  uint64_t delay_timer_acc;
+  // The registers, named/indexed V0 - VF
+  uint8_t registers[16];
+  // sp == Stack pointer, the number of entries on the stack
+  uint8_t sp;
   uint8_t delay_timer;
-  uint64_t sound_timer_acc;
   uint8_t sound_timer;
-  uint64_t graphics[CHIP8_DISPLAY_HEIGHT];
+  // 1 = SUPER-CHIP 128x64 mode, 0 = 64x32
+  uint8_t hires;
+  Chip8Fault fault;
+  // Bit y is set when display row y changes, or rows 2y and 2y + 1 in
+  // 128x64 mode. The frontend clears it once the change is on screen
+  uint32_t dirty_rows;
+  // Optional, owned by the caller. NULL decodes every instruction as it runs
+  Chip8DecodeCache *decode_cache;
+  // Instructions run since chip8_init_emulator
+  uint64_t cycles;
+  // The timers tick when cycles reaches this
+  uint64_t next_timer_cycle;
+  // xorshift32 state for Cxnn, never 0
+  uint32_t random_state;
+  // Bit p set = drawing, clearing and scrolling apply to plane p. Fn01
+  // picks them, CHIP-8 and SUPER-CHIP programs only ever use plane 0
+  uint8_t planes;
+  // While Fx0A waits for a key, CHIP8_KEY_WAIT | x, otherwise 0. The
+  // emulator is parked on the Fx0A until chip8_set_key sees a key go up
+  uint8_t key_wait;
+  // A Chip8Profile, see chip8_set_profile
+  uint8_t profile;
+
   // 1 = that key is down 
   uint8_t inputs[16];
+  uint16_t stack[STACK_SIZE];
+  // Optional, only used when built with CHIP8_JIT. See jit.h
+  struct Chip8Jit *jit;
+  // Instructions per emulated second, see chip8_set_clock
+  uint32_t ips;
+  // ips * ticks % CHIP8_TIMER_HZ, the fraction of a cycle the timer
+  // schedule is behind exact 60 Hz
+  uint32_t timer_remainder;
+#ifdef CHIP8_STATS
+  // Optional, see stats.h
+  struct Chip8Stats *stats;
+#endif
+#ifdef CHIP8_TRACE
+  // Optional, see trace.h
+  struct Chip8Trace *trace;
+#endif
+  // Optional, told when the sound timer starts and stops. See audio.h
+  struct Chip8Audio *audio;
+  // What chip8_reset has to put back. Bit b is set once anything in
+  // memory[64b, 64b + 64) is written, and display_written once anything
+  // is drawn, cleared or scrolled
+  uint64_t written_blocks;
+  uint8_t display_written;
+  // cycles when the emulator parked on the Fx0A in key_wait, counting it
+  uint64_t key_wait_cycle;
+
+  // Cold state, each in its own cache lines. A display row is 128 pixels
+  // in two words, graphics[plane][0][y] holding the left half with x = 0
+  // in its top bit. Keeping each half's rows together lets row operations
+  // run down the display as plain array loops, and 64x32 mode only uses
+  // the first 32 words of the left half
+  _Alignas(CHIP8_CACHE_LINE) uint64_t
+      graphics[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT];
+  _Alignas(CHIP8_CACHE_LINE) uint8_t memory[MEMORY_SIZE];
 } Chip8Emulator;
 
 void chip8_init_emulator(Chip8Emulator *emulator);
-void chip8_load_program(Chip8Emulator *emulator, uint8_t *program,
+// Restarts the Cxnn random numbers from seed, so runs can be repeated
+void chip8_seed_random(Chip8Emulator *emulator, uint32_t seed);
+// Presses or releases a key. Releasing one while parked on Fx0A stores it
+// in Vx and moves on past the Fx0A
+void chip8_set_key(Chip8Emulator *emulator, uint8_t key, int down);
+void chip8_load_program(Chip8Emulator *emulator, const uint8_t *program,
                         long program_size);
-void chip8_run(Chip8Emulator *emulator, uint64_t delta_t, SDL_Event event);
-void chip8_render_grid(SDL_Renderer *r, double width, double height);
-void chip8_render_display(SDL_Renderer *r, double width, double height,
-                          Chip8Emulator *emulator);
+// Sets the instructions per emulated second, at least CHIP8_TIMER_HZ. The
+// timers tick every ips / 60 instructions from the current cycle on, with
+// the remainder spread so tick k lands on cycle k * ips / 60 exactly
+void chip8_set_clock(Chip8Emulator *emulator, uint32_t ips);
+// Runs a single instruction, ticking the timers if it was the last one
+// before a tick
+void chip8_step(Chip8Emulator *emulator);
+// Runs `cycles` instructions back to back. Returns the number run, which is
+// less than `cycles` if the emulator faults
+uint64_t chip8_run_batch(Chip8Emulator *emulator, uint64_t cycles);
+// Runs every timer tick scheduled at or before `cycle` in one go. chip8_step
+// ticks the timers itself, so this is for code that runs instructions
+// without it, like the JIT
+void chip8_catch_up_timers(Chip8Emulator *emulator, uint64_t cycle);
+// Flags chip8_idle_loop returns
+// pc is at the start of a loop that can't change anything by going around
+#define CHIP8_IDLE_LOOP 1
+// The loop reads the delay timer, so it may end after a timer tick
+#define CHIP8_IDLE_TIMER 2
+// The loop reads the keys, so it may end after a key change
+#define CHIP8_IDLE_KEYS 4
+// Returns 0 unless pc is at the start of a short busy-wait loop that only
+// reads the delay timer and keys, such as Fx07 3x00 1nnn or ExA1 1nnn, or
+// the emulator is parked on Fx0A, which counts as a loop reading the keys
+int chip8_idle_loop(const Chip8Emulator *emulator);
+// If pc is at an idle loop, runs one iteration of it, and if that left the
+// machine as it was, skips as many more iterations as fit in `cycles`
+// without running them. A parked emulator lets all `cycles` pass at once,
+// only ticking the timers. Returns the instructions run and skipped
+uint64_t chip8_skip_idle(Chip8Emulator *emulator, uint64_t cycles);
+// Attaches a decode cache, or detaches it when cache is NULL. The cache is
+// cleared, and chip8_init_emulator detaches it again
+void chip8_attach_decode_cache(Chip8Emulator *emulator,
+                               Chip8DecodeCache *cache);
+// Copies the machine state from a snapshot taken with a plain struct copy,
+// keeping the decode cache, JIT and audio attached to emulator. Only code
+// in the memory that differs is invalidated, unless the profile does
+void chip8_restore_state(Chip8Emulator *emulator, const Chip8Emulator *state);
+// Puts emulator back the way it was when it was a copy of `pristine`,
+// taken with a plain struct copy, or last reset to it. Only the state
+// before the display, the display if it was written, and the memory blocks
+// written since are copied, so a reset costs about as much as what the
+// program touched. The decode cache, JIT and audio stay attached
+void chip8_reset(Chip8Emulator *emulator, const Chip8Emulator *pristine);
+// Switches to another profile's behavior. Code decoded or compiled for
+// the old one is thrown away
+void chip8_set_profile(Chip8Emulator *emulator, Chip8Profile profile);
+// CHIP8_PROFILE_* flags for the behaviors profile differs in
+int chip8_profile_quirks(Chip8Profile profile);
+const char *chip8_profile_name(Chip8Profile profile);
+// Size of the display in the current mode
+int chip8_display_width(const Chip8Emulator *emulator);
+int chip8_display_height(const Chip8Emulator *emulator);
+// Hash of the display contents, stable across hosts
+uint64_t chip8_framebuffer_hash(const Chip8Emulator *emulator);
+// Expands `rows` display rows starting at first_row into one 32-bit pixel
+// per CHIP-8 pixel, with `pitch` bytes between output rows. A pixel gets
+// palette[p], where bit i of p is set if the pixel is on in plane i
+void chip8_unpack_display(const Chip8Emulator *emulator, int first_row,
+                          int rows, const uint32_t palette[4], void *pixels,
+                          int pitch);
+// The same for a copy of the display taken out of an emulator, `hires`
+// being its mode
+void chip8_unpack_graphics(
+    const uint64_t graphics[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT], int hires,
+    int first_row, int rows, const uint32_t palette[4], void *pixels,
+    int pitch);
+const char *chip8_fault_name(Chip8Fault fault);
+// Reads a program file into buffer, which must hold MAX_PROGRAM_SIZE bytes.
+// Returns the program size, or -1 if the file could not be read
+long chip8_read_program(const char *path, uint8_t *buffer);
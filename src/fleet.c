@@ -0,0 +1,406 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "emulator.h"
+#include "fleet.h"
+
+// Returned by the deque operations when there is nothing to take
+#define EMPTY -1
+
+// Steal sweeps an idle worker makes, yielding between them, before it
+// goes to sleep until there is work to steal or the fleet is done
+#define IDLE_SWEEPS 64
+
+// Chase-Lev work-stealing deque of instance indices. The owning worker
+// pushes and pops at the bottom, everyone else steals from the top. Every
+// instance is in at most one deque, so a capacity of the instance count
+// means it never has to grow
+typedef struct Deque {
+  _Atomic int64_t top;
+  _Atomic int64_t bottom;
+  _Atomic int64_t *items;
+  int64_t mask;
+} Deque;
+
+typedef struct Worker {
+  struct Fleet *fleet;
+  pthread_t thread;
+  unsigned index;
+  Deque deque;
+} Worker;
+
+typedef struct Fleet {
+  Chip8FleetInstance *instances;
+  const Chip8FleetOptions *options;
+  Worker *workers;
+  unsigned worker_count;
+  // Instances that haven't halted yet
+  _Atomic size_t remaining;
+  // Idle workers sleep on wake until wake_count moves past what they saw
+  // before their last sweep. sleepers counts the ones that may be asleep
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  uint64_t wake_count;
+  _Atomic unsigned sleepers;
+  // When each instance was last checkpointed, in CLOCK_MONOTONIC
+  // nanoseconds. Only the worker running an instance touches its entry
+  uint64_t *stored;
+} Fleet;
+
+static int deque_init(Deque *deque, size_t capacity) {
+  size_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  deque->items = calloc(size, sizeof(*deque->items));
+  if (!deque->items) {
+    return -1;
+  }
+  deque->mask = size - 1;
+  atomic_init(&deque->top, 0);
+  atomic_init(&deque->bottom, 0);
+  return 0;
+}
+
+static void deque_push(Deque *deque, int64_t item) {
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  atomic_store_explicit(&deque->items[bottom & deque->mask], item,
+                        memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+}
+
+static int64_t deque_pop(Deque *deque) {
+  int64_t bottom =
+      atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+  if (top > bottom) {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return EMPTY;
+  }
+
+  int64_t item = atomic_load_explicit(&deque->items[bottom & deque->mask],
+                                      memory_order_relaxed);
+  if (top == bottom) {
+    // Last item, race any thieves for it
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+      item = EMPTY;
+    }
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  }
+  return item;
+}
+
+static int64_t deque_steal(Deque *deque) {
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+  if (top >= bottom) {
+    return EMPTY;
+  }
+  int64_t item = atomic_load_explicit(&deque->items[top & deque->mask],
+                                      memory_order_relaxed);
+  if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                               memory_order_seq_cst,
+                                               memory_order_relaxed)) {
+    return EMPTY;
+  }
+  return item;
+}
+
+static uint64_t now_nanoseconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static Chip8FleetHalt halt_reason(const Chip8FleetInstance *instance) {
+  if (instance->emulator.fault) {
+    return CHIP8_HALT_FAULT;
+  }
+  if (instance->emulator.key_wait) {
+    return CHIP8_HALT_KEY_WAIT;
+  }
+  if (instance->cycles >= instance->cycle_limit) {
+    return CHIP8_HALT_CYCLE_LIMIT;
+  }
+  return CHIP8_HALT_RUNNING;
+}
+
+// Runs an instance for up to one quantum
+static void run_slice(Chip8FleetInstance *instance,
+                      const Chip8FleetOptions *options) {
+  uint64_t budget = instance->cycle_limit - instance->cycles;
+  if (budget > options->quantum) {
+    budget = options->quantum;
+  }
+
+  Chip8Emulator *emulator = &instance->emulator;
+  uint64_t ran = chip8_run_batch(emulator, budget);
+  if (emulator->key_wait) {
+    // Parking lets the rest of the batch pass with nothing run. Only count
+    // what ran, up to and including the Fx0A
+    ran -= emulator->cycles - emulator->key_wait_cycle;
+  }
+  instance->cycles += ran;
+  instance->halt = halt_reason(instance);
+}
+
+// Stores an instance that just ran a slice if it halted or is due
+static void checkpoint_instance(Fleet *fleet, int64_t item) {
+  const Chip8FleetOptions *options = fleet->options;
+  Chip8FleetInstance *instance = &fleet->instances[item];
+  uint64_t now = now_nanoseconds();
+  if (instance->halt == CHIP8_HALT_RUNNING &&
+      now - fleet->stored[item] <
+          (uint64_t)options->checkpoint_seconds * 1000000000) {
+    return;
+  }
+  fleet->stored[item] = now;
+  chip8_checkpoint_store(options->checkpoint, item, instance->program_hash,
+                         &instance->emulator, instance->cycles);
+}
+
+static int64_t find_work(Worker *worker, uint32_t *seed) {
+  int64_t item = deque_pop(&worker->deque);
+  if (item != EMPTY) {
+    return item;
+  }
+
+  // Try every other worker once, starting from a random one
+  Fleet *fleet = worker->fleet;
+  *seed = *seed * 1664525 + 1013904223;
+  unsigned start = *seed % fleet->worker_count;
+  for (unsigned i = 0; i < fleet->worker_count; i++) {
+    unsigned victim = (start + i) % fleet->worker_count;
+    if (victim == worker->index) {
+      continue;
+    }
+    item = deque_steal(&fleet->workers[victim].deque);
+    if (item != EMPTY) {
+      return item;
+    }
+  }
+  return EMPTY;
+}
+
+// Wakes one sleeping worker if the deque just pushed to holds more than
+// the instance its owner is about to pop again
+static void wake_idle(Fleet *fleet, Deque *deque) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!atomic_load_explicit(&fleet->sleepers, memory_order_relaxed)) {
+    return;
+  }
+  int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  if (bottom - top < 2) {
+    return;
+  }
+  pthread_mutex_lock(&fleet->lock);
+  fleet->wake_count++;
+  pthread_cond_signal(&fleet->wake);
+  pthread_mutex_unlock(&fleet->lock);
+}
+
+// Looks for work, backing off and then sleeping while there is none.
+// Returns EMPTY once every instance has halted
+static int64_t wait_for_work(Worker *worker, uint32_t *seed) {
+  Fleet *fleet = worker->fleet;
+  for (;;) {
+    for (int sweep = 0; sweep < IDLE_SWEEPS; sweep++) {
+      if (!atomic_load_explicit(&fleet->remaining, memory_order_acquire)) {
+        return EMPTY;
+      }
+      int64_t item = find_work(worker, seed);
+      if (item != EMPTY) {
+        return item;
+      }
+      sched_yield();
+    }
+
+    // Announce the sleep before the last sweep, so a push after it either
+    // shows up in the sweep or sees the sleeper and wakes it
+    atomic_fetch_add_explicit(&fleet->sleepers, 1, memory_order_seq_cst);
+    pthread_mutex_lock(&fleet->lock);
+    uint64_t seen = fleet->wake_count;
+    pthread_mutex_unlock(&fleet->lock);
+    int64_t item = find_work(worker, seed);
+    if (item == EMPTY) {
+      pthread_mutex_lock(&fleet->lock);
+      while (fleet->wake_count == seen &&
+             atomic_load_explicit(&fleet->remaining, memory_order_acquire)) {
+        pthread_cond_wait(&fleet->wake, &fleet->lock);
+      }
+      pthread_mutex_unlock(&fleet->lock);
+    }
+    atomic_fetch_sub_explicit(&fleet->sleepers, 1, memory_order_relaxed);
+    if (item != EMPTY) {
+      return item;
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  Worker *worker = arg;
+  Fleet *fleet = worker->fleet;
+  uint32_t seed = worker->index * 2654435761u + 1;
+
+  for (;;) {
+    int64_t item = find_work(worker, &seed);
+    if (item == EMPTY) {
+      item = wait_for_work(worker, &seed);
+      if (item == EMPTY) {
+        break;
+      }
+    }
+
+    Chip8FleetInstance *instance = &fleet->instances[item];
+    run_slice(instance, fleet->options);
+    if (fleet->stored) {
+      checkpoint_instance(fleet, item);
+    }
+    if (instance->halt == CHIP8_HALT_RUNNING) {
+      deque_push(&worker->deque, item);
+      wake_idle(fleet, &worker->deque);
+    } else {
+      instance->framebuffer_hash =
+          chip8_framebuffer_hash(&instance->emulator);
+      if (atomic_fetch_sub_explicit(&fleet->remaining, 1,
+                                    memory_order_release) == 1) {
+        // The last halt releases every sleeping worker
+        pthread_mutex_lock(&fleet->lock);
+        pthread_cond_broadcast(&fleet->wake);
+        pthread_mutex_unlock(&fleet->lock);
+      }
+    }
+  }
+  return NULL;
+}
+
+int chip8_fleet_run(Chip8FleetInstance *instances, size_t count,
+                    const Chip8FleetOptions *options) {
+  if (!options->quantum || !options->cycles_per_frame ||
+      options->cycles_per_frame > UINT32_MAX / CHIP8_TIMER_HZ ||
+      (options->checkpoint && options->checkpoint->count < count)) {
+    return -1;
+  }
+  unsigned threads = options->threads;
+  if (!threads) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (unsigned)online : 1;
+  }
+
+  Fleet fleet = {
+      .instances = instances,
+      .options = options,
+      .worker_count = threads,
+  };
+  atomic_init(&fleet.remaining, count);
+  atomic_init(&fleet.sleepers, 0);
+  pthread_mutex_init(&fleet.lock, NULL);
+  pthread_cond_init(&fleet.wake, NULL);
+
+  fleet.workers = calloc(threads, sizeof(Worker));
+  if (options->checkpoint) {
+    fleet.stored = malloc(count * sizeof(uint64_t));
+  }
+  if (!fleet.workers || (options->checkpoint && !fleet.stored)) {
+    free(fleet.workers);
+    free(fleet.stored);
+    pthread_cond_destroy(&fleet.wake);
+    pthread_mutex_destroy(&fleet.lock);
+    return -1;
+  }
+
+  int result = 0;
+  unsigned initialized = 0;
+  for (; initialized < threads; initialized++) {
+    Worker *worker = &fleet.workers[initialized];
+    worker->fleet = &fleet;
+    worker->index = initialized;
+    if (deque_init(&worker->deque, count) == -1) {
+      result = -1;
+      goto Cleanup;
+    }
+  }
+
+  // Deal the instances out round robin before any worker starts, leaving
+  // out the ones a checkpoint resumed already halted
+  uint64_t start = now_nanoseconds();
+  uint32_t ips = (uint32_t)(options->cycles_per_frame * CHIP8_TIMER_HZ);
+  size_t dealt = 0;
+  for (size_t i = 0; i < count; i++) {
+    Chip8FleetInstance *instance = &instances[i];
+    // Setting the clock reschedules the timers, which a resumed instance
+    // already has right
+    if (instance->emulator.ips != ips) {
+      chip8_set_clock(&instance->emulator, ips);
+    }
+    if (fleet.stored) {
+      fleet.stored[i] = start;
+    }
+    instance->halt = halt_reason(instance);
+    if (instance->halt != CHIP8_HALT_RUNNING) {
+      instance->framebuffer_hash =
+          chip8_framebuffer_hash(&instance->emulator);
+      atomic_fetch_sub_explicit(&fleet.remaining, 1, memory_order_relaxed);
+      continue;
+    }
+    deque_push(&fleet.workers[dealt++ % threads].deque, (int64_t)i);
+  }
+
+  unsigned started = 0;
+  for (; started < threads; started++) {
+    Worker *worker = &fleet.workers[started];
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+      break;
+    }
+  }
+  if (started == 0) {
+    result = -1;
+    goto Cleanup;
+  }
+  // With fewer workers than planned, the ones running steal the rest
+  for (unsigned i = 0; i < started; i++) {
+    pthread_join(fleet.workers[i].thread, NULL);
+  }
+
+Cleanup:
+  for (unsigned i = 0; i < initialized; i++) {
+    free(fleet.workers[i].deque.items);
+  }
+  free(fleet.workers);
+  free(fleet.stored);
+  pthread_cond_destroy(&fleet.wake);
+  pthread_mutex_destroy(&fleet.lock);
+  return result;
+}
+
+const char *chip8_fleet_halt_name(Chip8FleetHalt halt) {
+  switch (halt) {
+  case CHIP8_HALT_RUNNING:
+    return "running";
+  case CHIP8_HALT_CYCLE_LIMIT:
+    return "cycle limit";
+  case CHIP8_HALT_FAULT:
+    return "fault";
+  case CHIP8_HALT_KEY_WAIT:
+    return "key wait";
+  }
+  return "unknown";
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "checkpoint.h"
+#include "emulator.h"
+
+// Runs many emulators across a pool of worker threads. Each worker owns a
+// work-stealing deque of instances; an instance runs for one quantum at a
+// time and goes back on the deque until it halts, and idle workers steal
+// from the others so the load stays balanced
+
+typedef enum FleetHalt {
+  CHIP8_HALT_RUNNING = 0,
+  // Ran cycle_limit instructions
+  CHIP8_HALT_CYCLE_LIMIT,
+  // Stopped early, see emulator.fault
+  CHIP8_HALT_FAULT,
+  // Parked on Fx0A. Nothing presses keys in a fleet, so it is taken off the
+  // run queue rather than left to idle out its cycle_limit
+  CHIP8_HALT_KEY_WAIT,
+} Chip8FleetHalt;
+
+typedef struct FleetInstance {
+  // Initialized with a program loaded by the caller
+  Chip8Emulator emulator;
+  uint64_t cycle_limit;
+  // Instructions run so far, 0 unless resumed from a checkpoint. An
+  // instance already at cycle_limit, faulted or parked on Fx0A doesn't run
+  uint64_t cycles;
+  // Marks the instance's checkpoint records, so a checkpoint only resumes
+  // the program it was stored for. Usually chip8_input_log_program_hash
+  uint64_t program_hash;
+
+  // Filled in by chip8_fleet_run
+  Chip8FleetHalt halt;
+  uint64_t framebuffer_hash;
+} Chip8FleetInstance;
+
+typedef struct FleetOptions {
+  // 0 = one per online CPU
+  unsigned threads;
+  // Instructions an instance runs before it is requeued
+  uint64_t quantum;
+  // Instructions per emulated frame, after which the timers tick. Set on
+  // every instance's clock before it runs, so it must be at most
+  // UINT32_MAX / CHIP8_TIMER_HZ
+  uint64_t cycles_per_frame;
+  // Optional, with a record per instance. An instance is stored there with
+  // its cycles as the record's value after the first quantum that ends
+  // checkpoint_seconds after its last store, and again when it halts
+  Chip8Checkpoint *checkpoint;
+  unsigned checkpoint_seconds;
+} Chip8FleetOptions;
+
+// Runs every instance until it halts. Returns 0 on success, or -1 if the
+// options are invalid or the worker threads could not be started
+int chip8_fleet_run(Chip8FleetInstance *instances, size_t count,
+                    const Chip8FleetOptions *options);
+const char *chip8_fleet_halt_name(Chip8FleetHalt halt);
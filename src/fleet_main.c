@@ -0,0 +1,325 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checkpoint.h"
+#include "corpus.h"
+#include "emulator.h"
+#include "fleet.h"
+#include "input_log.h"
+#include "profile.h"
+#include "trace.h"
+
+// Instructions --trace keeps per instance when --trace-records isn't given
+#define DEFAULT_TRACE_RECORDS 4096
+
+static void usage(const char *name) {
+  printf("usage: %s [--threads N] [--quantum N] [--cycles N] [--copies N] "
+         "[--cycles-per-frame N] [--corpus PATH] [--profiles FILE] "
+         "[--checkpoint FILE] [--checkpoint-interval SECONDS] "
+         "[--trace DIR] [--trace-records N] [--trace-on TRIGGERS] "
+         "<program>...\n",
+         name);
+}
+
+static void free_traces(Chip8Trace *traces, size_t count) {
+  for (size_t i = 0; traces && i < count; i++) {
+    chip8_trace_free(&traces[i]);
+  }
+  free(traces);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+  Chip8FleetOptions options = {
+      .threads = 0,
+      .quantum = 100000,
+      .cycles_per_frame = 12,
+      .checkpoint_seconds = 60,
+  };
+  uint64_t cycles = 10000000;
+  uint64_t copies = 1;
+  const char *corpus_path = NULL;
+  const char *profiles_path = NULL;
+  const char *checkpoint_path = NULL;
+  const char *trace_dir = NULL;
+  const char *trace_on = NULL;
+  uint64_t trace_records = DEFAULT_TRACE_RECORDS;
+
+  int first_program = 1;
+  while (first_program < argc && strncmp(argv[first_program], "--", 2) == 0) {
+    const char *flag = argv[first_program];
+    if (first_program + 1 == argc) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    uint64_t value = strtoull(argv[first_program + 1], NULL, 0);
+    if (strcmp(flag, "--corpus") == 0) {
+      corpus_path = argv[first_program + 1];
+    } else if (strcmp(flag, "--profiles") == 0) {
+      profiles_path = argv[first_program + 1];
+    } else if (strcmp(flag, "--checkpoint") == 0) {
+      checkpoint_path = argv[first_program + 1];
+    } else if (strcmp(flag, "--checkpoint-interval") == 0) {
+      options.checkpoint_seconds = (unsigned)value;
+    } else if (strcmp(flag, "--trace") == 0) {
+      trace_dir = argv[first_program + 1];
+    } else if (strcmp(flag, "--trace-on") == 0) {
+      trace_on = argv[first_program + 1];
+    } else if (strcmp(flag, "--trace-records") == 0) {
+      trace_records = value;
+    } else if (strcmp(flag, "--threads") == 0) {
+      options.threads = (unsigned)value;
+    } else if (strcmp(flag, "--quantum") == 0) {
+      options.quantum = value;
+    } else if (strcmp(flag, "--cycles") == 0) {
+      cycles = value;
+    } else if (strcmp(flag, "--copies") == 0) {
+      copies = value;
+    } else if (strcmp(flag, "--cycles-per-frame") == 0) {
+      options.cycles_per_frame = value;
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    first_program += 2;
+  }
+  // Flags go before the programs, so one after them is missing its value
+  // or misplaced rather than a file name
+  for (int i = first_program; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) == 0) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+#ifndef CHIP8_TRACE
+  if (trace_dir) {
+    puts("This build does not include traces, configure with -DCHIP8_TRACE=ON");
+    return EXIT_FAILURE;
+  }
+#endif
+  int trace_triggers = 0;
+  uint16_t trace_first_pc = 0;
+  uint16_t trace_last_pc = 0;
+  if (trace_on &&
+      chip8_parse_trace_triggers(trace_on, &trace_triggers, &trace_first_pc,
+                                 &trace_last_pc) == -1) {
+    printf("Unknown trace triggers: %s\n", trace_on);
+    return EXIT_FAILURE;
+  }
+
+  // Every program runs under the default profile unless the database lists it
+  Chip8ProfileDatabase profiles = {0};
+  if (profiles_path &&
+      chip8_profile_database_load(&profiles, profiles_path) == -1) {
+    printf("Failed to load profiles: %s\n", profiles_path);
+    return EXIT_FAILURE;
+  }
+
+  // Each distinct image in the corpus runs once, skipping ones too big for
+  // memory. They are loaded straight out of the corpus
+  Chip8Corpus corpus = {0};
+  size_t corpus_programs = 0;
+  if (corpus_path) {
+    if (chip8_corpus_open(&corpus, corpus_path) == -1) {
+      printf("Failed to open corpus: %s\n", corpus_path);
+      chip8_profile_database_free(&profiles);
+      return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < corpus.count; i++) {
+      corpus_programs += corpus.entries[i].original == i &&
+                         corpus.entries[i].size <= MAX_PROGRAM_SIZE;
+    }
+  }
+
+  size_t program_count = (size_t)(argc - first_program) + corpus_programs;
+  if (program_count == 0 || copies == 0 || options.quantum == 0 ||
+      options.cycles_per_frame == 0 ||
+      options.cycles_per_frame > UINT32_MAX / CHIP8_TIMER_HZ) {
+    usage(argv[0]);
+    chip8_corpus_close(&corpus);
+    chip8_profile_database_free(&profiles);
+    return EXIT_FAILURE;
+  }
+
+  size_t count = program_count * copies;
+  // Aligned so every emulator's hot state gets a cache line to itself
+  Chip8FleetInstance *instances = aligned_alloc(
+      _Alignof(Chip8FleetInstance), count * sizeof(Chip8FleetInstance));
+  const char **names = malloc(program_count * sizeof(char *));
+  if (!instances || !names) {
+    puts("Failed to allocate the instances");
+    free(instances);
+    free(names);
+    chip8_corpus_close(&corpus);
+    chip8_profile_database_free(&profiles);
+    return EXIT_FAILURE;
+  }
+  memset(instances, 0, count * sizeof(Chip8FleetInstance));
+
+  uint8_t buffer[MAX_PROGRAM_SIZE];
+  size_t next_entry = 0;
+  for (size_t p = 0; p < program_count; p++) {
+    Chip8FleetInstance *first = &instances[p * copies];
+    chip8_init_emulator(&first->emulator);
+    if (p < (size_t)(argc - first_program)) {
+      names[p] = argv[first_program + p];
+      long file_len = chip8_read_program(names[p], buffer);
+      if (file_len == -1) {
+        printf("Failed to load program: %s\n", names[p]);
+        free(instances);
+        free(names);
+        chip8_corpus_close(&corpus);
+        chip8_profile_database_free(&profiles);
+        return EXIT_FAILURE;
+      }
+      chip8_set_profile(&first->emulator,
+                        chip8_profile_lookup(&profiles, buffer, file_len));
+      chip8_load_program(&first->emulator, buffer, file_len);
+      first->program_hash = chip8_input_log_program_hash(buffer, file_len);
+    } else {
+      while (corpus.entries[next_entry].original != next_entry ||
+             chip8_corpus_load(&corpus, next_entry, &first->emulator) == -1) {
+        next_entry++;
+      }
+      const Chip8CorpusEntry *entry = &corpus.entries[next_entry++];
+      chip8_set_profile(&first->emulator,
+                        chip8_profile_lookup(&profiles, entry->data,
+                                             entry->size));
+      first->program_hash =
+          chip8_input_log_program_hash(entry->data, entry->size);
+      names[p] = entry->name;
+    }
+    first->cycle_limit = cycles;
+    for (uint64_t c = 1; c < copies; c++) {
+      instances[p * copies + c].emulator = first->emulator;
+      instances[p * copies + c].cycle_limit = cycles;
+      instances[p * copies + c].program_hash = first->program_hash;
+    }
+  }
+
+  // Every instance records into a ring of its own, which only the worker
+  // running it writes
+  Chip8Trace *traces = NULL;
+  if (trace_dir) {
+    traces = calloc(count, sizeof(Chip8Trace));
+    int failed = !traces;
+    for (size_t i = 0; i < count && !failed; i++) {
+      failed = chip8_trace_init(&traces[i], trace_records, trace_triggers,
+                                trace_first_pc, trace_last_pc) == -1;
+#ifdef CHIP8_TRACE
+      chip8_attach_trace(&instances[i].emulator, &traces[i]);
+#endif
+    }
+    if (failed) {
+      puts("Failed to allocate the traces");
+      free_traces(traces, count);
+      free(instances);
+      free(names);
+      chip8_corpus_close(&corpus);
+      chip8_profile_database_free(&profiles);
+      return EXIT_FAILURE;
+    }
+  }
+
+  // A checkpoint from an earlier run with the same arguments picks every
+  // instance it stored up where it left off. Records stored for another
+  // program don't load, so those instances start over
+  Chip8Checkpoint checkpoint = {0};
+  uint64_t resumed_cycles = 0;
+  if (checkpoint_path) {
+    if (chip8_checkpoint_open(&checkpoint, checkpoint_path, count) == -1) {
+      printf("Failed to open checkpoint: %s\n", checkpoint_path);
+      free_traces(traces, count);
+      free(instances);
+      free(names);
+      chip8_corpus_close(&corpus);
+      chip8_profile_database_free(&profiles);
+      return EXIT_FAILURE;
+    }
+    options.checkpoint = &checkpoint;
+    size_t resumed = 0;
+    for (size_t i = 0; i < count; i++) {
+      Chip8FleetInstance *instance = &instances[i];
+      if (chip8_checkpoint_load(&checkpoint, i, instance->program_hash,
+                                &instance->emulator, &instance->cycles) == 0) {
+        resumed++;
+        resumed_cycles += instance->cycles;
+      }
+    }
+    printf("resumed: %zu of %zu\n", resumed, count);
+  }
+
+  double start = now_seconds();
+  if (chip8_fleet_run(instances, count, &options) == -1) {
+    puts("Failed to start the fleet");
+    free_traces(traces, count);
+    free(instances);
+    free(names);
+    chip8_corpus_close(&corpus);
+    chip8_profile_database_free(&profiles);
+    chip8_checkpoint_close(&checkpoint);
+    return EXIT_FAILURE;
+  }
+  double elapsed = now_seconds() - start;
+
+  uint64_t total = 0;
+  printf("%-8s %-32s %12s %-16s %-16s\n", "instance", "program", "cycles",
+         "halt", "framebuffer");
+  for (size_t i = 0; i < count; i++) {
+    Chip8FleetInstance *instance = &instances[i];
+    const char *halt = instance->halt == CHIP8_HALT_FAULT
+                           ? chip8_fault_name(instance->emulator.fault)
+                           : chip8_fleet_halt_name(instance->halt);
+    printf("%-8zu %-32s %12llu %-16s %016llx\n", i, names[i / copies],
+           (unsigned long long)instance->cycles, halt,
+           (unsigned long long)instance->framebuffer_hash);
+    total += instance->cycles;
+  }
+
+  printf("instances: %zu\n", count);
+  printf("cycles: %llu\n", (unsigned long long)total);
+  printf("seconds: %.6f\n", elapsed);
+  // Only what ran this time counts towards the speed
+  printf("instructions/second: %.0f\n",
+         elapsed > 0 ? (double)(total - resumed_cycles) / elapsed : 0.0);
+
+  // Without triggers every instance's last instructions are kept,
+  // otherwise only the ones that stopped on one
+  int status = EXIT_SUCCESS;
+  size_t traces_written = 0;
+  for (size_t i = 0; traces && i < count; i++) {
+    if (trace_triggers && !traces[i].triggered) {
+      continue;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%zu.c8tr", trace_dir, i);
+    if (chip8_trace_save(&traces[i], path) == -1) {
+      printf("Failed to write trace: %s\n", path);
+      status = EXIT_FAILURE;
+      break;
+    }
+    traces_written++;
+  }
+  if (traces) {
+    printf("traces: %zu\n", traces_written);
+  }
+
+  free_traces(traces, count);
+  free(instances);
+  free(names);
+  chip8_corpus_close(&corpus);
+  chip8_profile_database_free(&profiles);
+  chip8_checkpoint_close(&checkpoint);
+  return status;
+}
@@ -0,0 +1,524 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "emulator.h"
+#include "frame_stream.h"
+
+static const uint8_t MAGIC[4] = {'C', '8', 'F', 'S'};
+#define VERSION 1
+#define HEADER_SIZE 8
+
+#define RECORD_REPEAT 0
+#define RECORD_LORES 1
+#define RECORD_HIRES 2
+
+// Frames the emulation thread can get ahead of the writer
+#define SLOT_COUNT 256
+// Queued frames it takes to wake a sleeping writer. Fewer wait for its
+// timeout instead, so a slow program doesn't pay for a wakeup per frame
+#define WAKE_BATCH 32
+// Longest either thread sleeps before looking at the ring again
+#define WAIT_NS 10000000
+// Records are small, so the file buffers plenty of them per write call
+#define WRITE_BUFFER_SIZE (1 << 16)
+// Unchanged bytes needed to end a run of changed ones, as in rewind.c
+#define MIN_ZERO_RUN 8
+// A LEB128 count below 2^14 takes two bytes, and every run but the last is
+// followed by at least MIN_ZERO_RUN unchanged bytes
+#define MAX_DELTA_SIZE                                                         \
+  (CHIP8_FRAME_HIRES_SIZE + 4 * (CHIP8_FRAME_HIRES_SIZE / MIN_ZERO_RUN + 1))
+
+// The record kind and a delta size of up to three LEB128 bytes
+#define RECORD_HEADER_SIZE 4
+
+_Static_assert(MIN_ZERO_RUN <= 8, "a zero word has to end a literal");
+_Static_assert(MAX_DELTA_SIZE <= sizeof(((Chip8FrameReader *)0)->delta),
+               "the reader holds a whole delta");
+
+typedef struct Slot {
+  // Unchanged frames shown before this one
+  uint64_t repeats;
+  // 0 for the slot closing the stream, which only carries repeats
+  uint8_t has_frame;
+  uint8_t hires;
+  uint64_t graphics[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT];
+} Slot;
+
+struct Chip8FrameStream {
+  FILE *file;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  // Slots filled by the emulation thread and emptied by the writer
+  _Atomic uint64_t head;
+  _Atomic uint64_t tail;
+  // Set by whichever thread is about to sleep on `wake`
+  _Atomic int writer_waiting;
+  _Atomic int pusher_waiting;
+  _Atomic int closing;
+
+  // Emulation thread only
+  int started;
+  uint64_t unchanged;
+
+  // Writer only
+  uint64_t previous[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT];
+  uint8_t hires;
+  int have_previous;
+  uint64_t pending_repeats;
+  long long bytes;
+  int failed;
+  // Set when bytes may be sitting in the file's buffer
+  int unflushed;
+  uint64_t xor[CHIP8_FRAME_HIRES_SIZE / sizeof(uint64_t)];
+  uint8_t record[RECORD_HEADER_SIZE + MAX_DELTA_SIZE];
+
+  Slot slots[SLOT_COUNT];
+};
+
+static size_t put_leb(uint8_t *out, uint64_t value) {
+  size_t size = 0;
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    out[size++] = byte | (value ? 0x80 : 0);
+  } while (value);
+  return size;
+}
+
+static size_t frame_size(int hires) {
+  return hires ? CHIP8_FRAME_HIRES_SIZE : CHIP8_FRAME_LORES_SIZE;
+}
+
+// Sleeps on `wake` until signaled or WAIT_NS passes, returning ETIMEDOUT in
+// the second case. The caller holds the lock and has flagged itself waiting
+static int timed_wait(Chip8FrameStream *stream) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += WAIT_NS;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+  return pthread_cond_timedwait(&stream->wake, &stream->lock, &deadline);
+}
+
+static void wake(Chip8FrameStream *stream) {
+  pthread_mutex_lock(&stream->lock);
+  pthread_cond_signal(&stream->wake);
+  pthread_mutex_unlock(&stream->lock);
+}
+
+static void write_bytes(Chip8FrameStream *stream, const uint8_t *bytes,
+                        size_t size) {
+  if (fwrite(bytes, 1, size, stream->file) != size) {
+    stream->failed = 1;
+  }
+  stream->bytes += size;
+  stream->unflushed = 1;
+}
+
+// XORs the slot's display with the previous frame's, word by word in the
+// stream's order, and makes it the previous frame. Returns the word count
+static size_t xor_frame(Chip8FrameStream *stream, const Slot *slot,
+                        uint64_t *out) {
+  int height = slot->hires ? CHIP8_HIRES_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+  int halves = slot->hires ? 2 : 1;
+  size_t words = 0;
+  for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+    for (int y = 0; y < height; y++) {
+      for (int half = 0; half < halves; half++) {
+        uint64_t word = slot->graphics[plane][half][y];
+        uint64_t *previous = &stream->previous[plane][half][y];
+        out[words++] = word ^ *previous;
+        *previous = word;
+      }
+    }
+  }
+  return words;
+}
+
+// Run-length encodes an XORed frame as in frame_stream.h, returning the
+// size. Byte j of a word is its (7 - j)th from the bottom, so the zero
+// bytes at either end of a word come from counting its zero bits
+static size_t encode_delta(const uint64_t *xor, size_t words, uint8_t *out) {
+  size_t out_size = 0;
+  size_t encoded = 0;
+  size_t k = 0;
+  for (;;) {
+    while (k < words && !xor[k]) {
+      k++;
+    }
+    if (k == words) {
+      break;
+    }
+    size_t start = 8 * k + __builtin_clzll(xor[k]) / 8;
+
+    // A literal ends at MIN_ZERO_RUN zero bytes, which a whole zero word
+    // always is
+    size_t last = k;
+    while (last + 1 < words && xor[last + 1] &&
+           __builtin_ctzll(xor[last]) / 8 +
+                   __builtin_clzll(xor[last + 1]) / 8 <
+               MIN_ZERO_RUN) {
+      last++;
+    }
+    size_t end = 8 * last + 8 - __builtin_ctzll(xor[last]) / 8;
+
+    out_size += put_leb(out + out_size, start - encoded);
+    out_size += put_leb(out + out_size, end - start);
+    for (size_t i = start; i < end; i++) {
+      out[out_size++] = xor[i / 8] >> (56 - 8 * (i % 8));
+    }
+    encoded = end;
+    k = last + 1;
+  }
+  return out_size;
+}
+
+static void flush_repeats(Chip8FrameStream *stream) {
+  if (!stream->pending_repeats) {
+    return;
+  }
+  uint8_t record[11];
+  record[0] = RECORD_REPEAT;
+  size_t size = 1 + put_leb(record + 1, stream->pending_repeats);
+  write_bytes(stream, record, size);
+  stream->pending_repeats = 0;
+}
+
+static void write_slot(Chip8FrameStream *stream, const Slot *slot) {
+  stream->pending_repeats += slot->repeats;
+  if (!slot->has_frame) {
+    return;
+  }
+
+  // A frame of the other size is encoded against a blank one
+  int new_size = !stream->have_previous || stream->hires != slot->hires;
+  if (new_size) {
+    memset(stream->previous, 0, sizeof(stream->previous));
+    stream->hires = slot->hires;
+    stream->have_previous = 1;
+  }
+  size_t words = xor_frame(stream, slot, stream->xor);
+  uint8_t *delta = stream->record + RECORD_HEADER_SIZE;
+  size_t delta_size = encode_delta(stream->xor, words, delta);
+  // Drawing a sprite and erasing it again marks rows dirty for nothing
+  if (!delta_size && !new_size) {
+    stream->pending_repeats++;
+    return;
+  }
+
+  flush_repeats(stream);
+  // The header goes right before the delta, so the record is one write
+  uint8_t header[RECORD_HEADER_SIZE];
+  header[0] = slot->hires ? RECORD_HIRES : RECORD_LORES;
+  size_t header_size = 1 + put_leb(header + 1, delta_size);
+  memcpy(delta - header_size, header, header_size);
+  write_bytes(stream, delta - header_size, header_size + delta_size);
+}
+
+static void *writer_main(void *arg) {
+  Chip8FrameStream *stream = arg;
+  uint64_t tail = 0;
+  for (;;) {
+    uint64_t head = atomic_load_explicit(&stream->head, memory_order_acquire);
+    if (tail == head) {
+      // The last slot is published before closing is set, so it is
+      // visible by the time closing is
+      if (atomic_load(&stream->closing)) {
+        if (atomic_load(&stream->head) == tail) {
+          break;
+        }
+        continue;
+      }
+      pthread_mutex_lock(&stream->lock);
+      atomic_store(&stream->writer_waiting, 1);
+      int timed_out = 0;
+      if (atomic_load(&stream->head) == tail &&
+          !atomic_load(&stream->closing)) {
+        timed_out = timed_wait(stream) == ETIMEDOUT;
+      }
+      atomic_store(&stream->writer_waiting, 0);
+      pthread_mutex_unlock(&stream->lock);
+      // A program that has gone quiet gets its last frames flushed, so a
+      // reader at the other end of a pipe isn't left waiting on them
+      if (timed_out && stream->unflushed) {
+        if (fflush(stream->file) != 0) {
+          stream->failed = 1;
+        }
+        stream->unflushed = 0;
+      }
+      continue;
+    }
+
+    for (; tail != head; tail++) {
+      write_slot(stream, &stream->slots[tail % SLOT_COUNT]);
+      atomic_store_explicit(&stream->tail, tail + 1, memory_order_release);
+    }
+    if (atomic_load(&stream->pusher_waiting)) {
+      wake(stream);
+    }
+  }
+  flush_repeats(stream);
+  return NULL;
+}
+
+// Waits until the writer has emptied slot `head`, then returns it
+static Slot *claim_slot(Chip8FrameStream *stream, uint64_t head) {
+  while (head - atomic_load_explicit(&stream->tail, memory_order_acquire) >=
+         SLOT_COUNT) {
+    pthread_mutex_lock(&stream->lock);
+    atomic_store(&stream->pusher_waiting, 1);
+    if (head - atomic_load(&stream->tail) >= SLOT_COUNT) {
+      timed_wait(stream);
+    }
+    atomic_store(&stream->pusher_waiting, 0);
+    pthread_mutex_unlock(&stream->lock);
+  }
+  return &stream->slots[head % SLOT_COUNT];
+}
+
+static void publish_slot(Chip8FrameStream *stream, uint64_t head) {
+  atomic_store(&stream->head, head + 1);
+  if (atomic_load(&stream->writer_waiting) &&
+      head + 1 - atomic_load(&stream->tail) >= WAKE_BATCH) {
+    wake(stream);
+  }
+}
+
+Chip8FrameStream *chip8_frame_stream_open(const char *path) {
+  Chip8FrameStream *stream = calloc(1, sizeof(Chip8FrameStream));
+  if (!stream) {
+    return NULL;
+  }
+  stream->file = fopen(path, "wb");
+  if (!stream->file) {
+    free(stream);
+    return NULL;
+  }
+
+  setvbuf(stream->file, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+  uint8_t header[HEADER_SIZE] = {0};
+  memcpy(header, MAGIC, sizeof(MAGIC));
+  header[4] = VERSION & 0xff;
+  header[5] = VERSION >> 8;
+  write_bytes(stream, header, HEADER_SIZE);
+
+  atomic_init(&stream->head, 0);
+  atomic_init(&stream->tail, 0);
+  atomic_init(&stream->writer_waiting, 0);
+  atomic_init(&stream->pusher_waiting, 0);
+  atomic_init(&stream->closing, 0);
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->wake, NULL);
+  if (pthread_create(&stream->thread, NULL, writer_main, stream) != 0) {
+    pthread_cond_destroy(&stream->wake);
+    pthread_mutex_destroy(&stream->lock);
+    fclose(stream->file);
+    free(stream);
+    return NULL;
+  }
+  return stream;
+}
+
+void chip8_frame_stream_push(Chip8FrameStream *stream,
+                             Chip8Emulator *emulator) {
+  // Every change to the display marks a row dirty, so a clean display is
+  // the frame before it again
+  if (stream->started && !emulator->dirty_rows) {
+    stream->unchanged++;
+    return;
+  }
+  stream->started = 1;
+  emulator->dirty_rows = 0;
+
+  uint64_t head = atomic_load_explicit(&stream->head, memory_order_relaxed);
+  Slot *slot = claim_slot(stream, head);
+  slot->repeats = stream->unchanged;
+  slot->has_frame = 1;
+  slot->hires = emulator->hires;
+  if (emulator->hires) {
+    memcpy(slot->graphics, emulator->graphics, sizeof(slot->graphics));
+  } else {
+    for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+      memcpy(slot->graphics[plane][0], emulator->graphics[plane][0],
+             CHIP8_DISPLAY_HEIGHT * sizeof(uint64_t));
+    }
+  }
+  stream->unchanged = 0;
+  publish_slot(stream, head);
+}
+
+long long chip8_frame_stream_close(Chip8FrameStream *stream) {
+  if (stream->unchanged) {
+    uint64_t head = atomic_load_explicit(&stream->head, memory_order_relaxed);
+    Slot *slot = claim_slot(stream, head);
+    slot->repeats = stream->unchanged;
+    slot->has_frame = 0;
+    publish_slot(stream, head);
+  }
+  atomic_store(&stream->closing, 1);
+  wake(stream);
+  pthread_join(stream->thread, NULL);
+
+  int failed = stream->failed;
+  if (fclose(stream->file) != 0) {
+    failed = 1;
+  }
+  long long bytes = stream->bytes;
+  pthread_cond_destroy(&stream->wake);
+  pthread_mutex_destroy(&stream->lock);
+  free(stream);
+  return failed ? -1 : bytes;
+}
+
+// Reads a LEB128 number. Returns -1 at the end of the file or if it
+// doesn't fit in 64 bits
+static int read_leb(FILE *file, uint64_t *value) {
+  *value = 0;
+  for (int shift = 0;; shift += 7) {
+    int byte = fgetc(file);
+    if (byte == EOF || shift > 63) {
+      return -1;
+    }
+    *value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return 0;
+    }
+  }
+}
+
+static size_t get_leb(const uint8_t *in, size_t size, size_t *offset,
+                      int *ok) {
+  size_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    if (*offset >= size || shift > 28) {
+      *ok = 0;
+      return 0;
+    }
+    uint8_t byte = in[(*offset)++];
+    value |= (size_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+// Applies a delta to frame. Returns -1 if it runs outside the frame
+static int decode_delta(const uint8_t *delta, size_t delta_size,
+                        uint8_t *frame, size_t size) {
+  size_t offset = 0;
+  size_t i = 0;
+  while (offset < delta_size) {
+    int ok = 1;
+    size_t skip = get_leb(delta, delta_size, &offset, &ok);
+    size_t length = get_leb(delta, delta_size, &offset, &ok);
+    if (!ok || skip > size - i || length > size - i - skip ||
+        length > delta_size - offset) {
+      return -1;
+    }
+    i += skip;
+    for (size_t j = 0; j < length; j++) {
+      frame[i++] ^= delta[offset++];
+    }
+  }
+  return 0;
+}
+
+int chip8_frame_reader_open(Chip8FrameReader *reader, const char *path) {
+  memset(reader, 0, sizeof(*reader));
+  reader->file = fopen(path, "rb");
+  if (!reader->file) {
+    return -1;
+  }
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, 1, HEADER_SIZE, reader->file) != HEADER_SIZE ||
+      memcmp(header, MAGIC, sizeof(MAGIC)) != 0 ||
+      (header[4] | header[5] << 8) != VERSION) {
+    chip8_frame_reader_close(reader);
+    return -1;
+  }
+  return 0;
+}
+
+void chip8_frame_reader_close(Chip8FrameReader *reader) {
+  if (reader->file) {
+    fclose(reader->file);
+    reader->file = NULL;
+  }
+}
+
+int chip8_frame_reader_next(Chip8FrameReader *reader) {
+  if (reader->repeats) {
+    reader->repeats--;
+    reader->changed = 0;
+    return 1;
+  }
+
+  int kind = fgetc(reader->file);
+  if (kind == EOF) {
+    return 0;
+  }
+  uint64_t value;
+  if (read_leb(reader->file, &value) == -1) {
+    return -1;
+  }
+  if (kind == RECORD_REPEAT) {
+    if (!reader->started || value == 0) {
+      return -1;
+    }
+    reader->repeats = value - 1;
+    reader->changed = 0;
+    return 1;
+  }
+  if ((kind != RECORD_LORES && kind != RECORD_HIRES) ||
+      value > sizeof(reader->delta) ||
+      fread(reader->delta, 1, value, reader->file) != value) {
+    return -1;
+  }
+
+  Chip8Frame *frame = &reader->frame;
+  int hires = kind == RECORD_HIRES;
+  size_t size = frame_size(hires);
+  if (!reader->started || frame->hires != hires) {
+    memset(frame->bytes, 0, size);
+    frame->hires = hires;
+    reader->started = 1;
+  }
+  if (decode_delta(reader->delta, value, frame->bytes, size) == -1) {
+    return -1;
+  }
+  reader->changed = 1;
+  return 1;
+}
+
+int chip8_frame_width(const Chip8Frame *frame) {
+  return frame->hires ? CHIP8_HIRES_WIDTH : CHIP8_DISPLAY_WIDTH;
+}
+
+int chip8_frame_height(const Chip8Frame *frame) {
+  return frame->hires ? CHIP8_HIRES_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+}
+
+int chip8_frame_pixel(const Chip8Frame *frame, int x, int y) {
+  int row_bytes = chip8_frame_width(frame) / 8;
+  size_t plane_size = frame_size(frame->hires) / CHIP8_PLANES;
+  size_t offset = (size_t)y * row_bytes + x / 8;
+  int shift = 7 - x % 8;
+  int pixel = 0;
+  for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+    pixel |= ((frame->bytes[plane * plane_size + offset] >> shift) & 1)
+             << plane;
+  }
+  return pixel;
+}
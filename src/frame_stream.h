@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "emulator.h"
+
+// Every frame of a headless run, streamed to a file or pipe. The emulation
+// thread only copies the display into a ring of slots, and only when
+// dirty_rows says it may have changed. A writer thread XORs each frame
+// against the one before, run-length encodes the difference and writes
+// it, so a run of mostly still frames takes a few bytes per change.
+//
+// The stream is "C8FS", a version and two reserved bytes, then records:
+//   0x00 n            the previous frame is shown n more times
+//   0x01 size delta   a 64x32 frame
+//   0x02 size delta   a 128x64 frame
+// n and size are LEB128. A frame is each plane in turn, row by row, with
+// the leftmost pixel in the top bit of a row's first byte. The delta is
+// `size` bytes of runs against the previous frame, or a blank one if that
+// was the other size: a LEB128 count of unchanged bytes, a LEB128 count of
+// changed bytes and those bytes XORed with the previous frame. Unchanged
+// bytes after the last run are left out
+
+#define CHIP8_FRAME_LORES_SIZE                                                 \
+  (CHIP8_PLANES * CHIP8_DISPLAY_HEIGHT * CHIP8_DISPLAY_WIDTH / 8)
+#define CHIP8_FRAME_HIRES_SIZE                                                 \
+  (CHIP8_PLANES * CHIP8_HIRES_HEIGHT * CHIP8_HIRES_WIDTH / 8)
+
+typedef struct Chip8FrameStream Chip8FrameStream;
+
+// Opens path for writing and starts the writer thread. Returns NULL if the
+// file can't be opened or the thread can't be started
+Chip8FrameStream *chip8_frame_stream_open(const char *path);
+// Adds the emulator's display as the next frame and clears dirty_rows.
+// Waits if the writer has fallen a whole ring of frames behind
+void chip8_frame_stream_push(Chip8FrameStream *stream,
+                             Chip8Emulator *emulator);
+// Writes the frames still queued, stops the writer and closes the file.
+// Returns the bytes written, or -1 if any write failed
+long long chip8_frame_stream_close(Chip8FrameStream *stream);
+
+// A decoded frame, in the stream's layout
+typedef struct Frame {
+  uint8_t hires;
+  uint8_t bytes[CHIP8_FRAME_HIRES_SIZE];
+} Chip8Frame;
+
+typedef struct FrameReader {
+  FILE *file;
+  Chip8Frame frame;
+  // 1 if the frame differs from the one before, which the first always does
+  int changed;
+  int started;
+  // Times the current frame is still to be shown
+  uint64_t repeats;
+  uint8_t delta[CHIP8_FRAME_HIRES_SIZE * 2];
+} Chip8FrameReader;
+
+// Returns 0 on success, or -1 if the file can't be read or isn't a frame
+// stream
+int chip8_frame_reader_open(Chip8FrameReader *reader, const char *path);
+void chip8_frame_reader_close(Chip8FrameReader *reader);
+// Advances to the next frame, left in reader->frame. Returns 1 if there is
+// one, 0 at the end of the stream, or -1 if the stream is corrupt
+int chip8_frame_reader_next(Chip8FrameReader *reader);
+// Size of the frame in pixels
+int chip8_frame_width(const Chip8Frame *frame);
+int chip8_frame_height(const Chip8Frame *frame);
+// Bit i of the result is set if the pixel is on in plane i
+int chip8_frame_pixel(const Chip8Frame *frame, int x, int y);
@@ -0,0 +1,223 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "frame_stream.h"
+
+// Same colors as the SDL frontend, indexed by the pixel's planes
+static const uint8_t PALETTE[4][3] = {
+    {0x00, 0x00, 0x00},
+    {0xff, 0xff, 0xff},
+    {0xaa, 0xaa, 0xaa},
+    {0x55, 0x55, 0x55},
+};
+
+// Stored deflate blocks hold at most this many bytes
+#define STORED_BLOCK 65535
+
+static void usage(const char *name) {
+  printf("usage: %s <stream> [--png PREFIX] [--scale N] [--changes]\n", name);
+}
+
+static uint32_t crc_table[256];
+
+static void init_crc_table(void) {
+  for (uint32_t n = 0; n < 256; n++) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; k++) {
+      c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    }
+    crc_table[n] = c;
+  }
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t size) {
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) {
+    crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void put_be32(uint8_t *out, uint32_t value) {
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+static int write_chunk(FILE *file, const char *type, const uint8_t *data,
+                       size_t size) {
+  uint8_t header[8];
+  put_be32(header, size);
+  memcpy(header + 4, type, 4);
+  uint8_t trailer[4];
+  put_be32(trailer, crc32(crc32(0, header + 4, 4), data, size));
+  if (fwrite(header, 1, 8, file) != 8 ||
+      (size && fwrite(data, 1, size, file) != size) ||
+      fwrite(trailer, 1, 4, file) != 4) {
+    return -1;
+  }
+  return 0;
+}
+
+// Wraps raw in a zlib stream of stored blocks. The frames are tiny, so
+// compressing them isn't worth a dependency
+static size_t store_zlib(const uint8_t *raw, size_t size, uint8_t *out) {
+  size_t out_size = 0;
+  out[out_size++] = 0x78;
+  out[out_size++] = 0x01;
+  uint32_t a = 1, b = 0;
+  size_t offset = 0;
+  do {
+    size_t block = size - offset < STORED_BLOCK ? size - offset : STORED_BLOCK;
+    out[out_size++] = offset + block == size;
+    out[out_size++] = block & 0xff;
+    out[out_size++] = block >> 8;
+    out[out_size++] = ~block & 0xff;
+    out[out_size++] = (~block >> 8) & 0xff;
+    memcpy(out + out_size, raw + offset, block);
+    out_size += block;
+    for (size_t i = offset; i < offset + block; i++) {
+      a = (a + raw[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+    offset += block;
+  } while (offset < size);
+  put_be32(out + out_size, b << 16 | a);
+  return out_size + 4;
+}
+
+// Writes the frame as an 8-bit paletted PNG. Every image is 128x64 times
+// scale, with 64x32 frames drawn at double size, so a sequence that
+// switches modes stays one size
+static int write_png(const char *path, const Chip8Frame *frame, int scale) {
+  int width = CHIP8_HIRES_WIDTH * scale;
+  int height = CHIP8_HIRES_HEIGHT * scale;
+  int pixel_size = scale * (frame->hires ? 1 : 2);
+  size_t row_size = 1 + (size_t)width;
+  size_t raw_size = row_size * height;
+  size_t blocks = raw_size / STORED_BLOCK + 1;
+  uint8_t *raw = malloc(raw_size);
+  uint8_t *data = malloc(raw_size + 5 * blocks + 6);
+  if (!raw || !data) {
+    free(raw);
+    free(data);
+    return -1;
+  }
+  for (int y = 0; y < height; y++) {
+    uint8_t *row = raw + row_size * y;
+    row[0] = 0;
+    for (int x = 0; x < width; x++) {
+      row[1 + x] = chip8_frame_pixel(frame, x / pixel_size, y / pixel_size);
+    }
+  }
+  size_t data_size = store_zlib(raw, raw_size, data);
+
+  static const uint8_t SIGNATURE[8] = {0x89, 'P', 'N', 'G', '\r', '\n',
+                                       0x1a, '\n'};
+  uint8_t ihdr[13];
+  put_be32(ihdr, width);
+  put_be32(ihdr + 4, height);
+  // 8 bits per pixel, paletted, no interlacing
+  ihdr[8] = 8;
+  ihdr[9] = 3;
+  ihdr[10] = 0;
+  ihdr[11] = 0;
+  ihdr[12] = 0;
+
+  int result = -1;
+  FILE *file = fopen(path, "wb");
+  if (file) {
+    if (fwrite(SIGNATURE, 1, 8, file) == 8 &&
+        write_chunk(file, "IHDR", ihdr, sizeof(ihdr)) == 0 &&
+        write_chunk(file, "PLTE", &PALETTE[0][0], sizeof(PALETTE)) == 0 &&
+        write_chunk(file, "IDAT", data, data_size) == 0 &&
+        write_chunk(file, "IEND", NULL, 0) == 0) {
+      result = 0;
+    }
+    if (fclose(file) != 0) {
+      result = -1;
+    }
+  }
+  free(raw);
+  free(data);
+  return result;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  const char *prefix = NULL;
+  int scale = 1;
+  int changes_only = 0;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--changes") == 0) {
+      changes_only = 1;
+    } else if (strcmp(argv[i], "--png") == 0 && i + 1 < argc) {
+      prefix = argv[++i];
+    } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+      scale = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (scale < 1 || scale > 64) {
+    puts("--scale must be between 1 and 64");
+    return EXIT_FAILURE;
+  }
+
+  Chip8FrameReader *reader = malloc(sizeof(Chip8FrameReader));
+  if (!reader) {
+    puts("Failed to allocate the reader");
+    return EXIT_FAILURE;
+  }
+  if (chip8_frame_reader_open(reader, argv[1]) == -1) {
+    printf("Failed to open frame stream: %s\n", argv[1]);
+    free(reader);
+    return EXIT_FAILURE;
+  }
+  init_crc_table();
+
+  // Frames are named by their index in the run, so with --changes the gaps
+  // in the numbering show how long each one stayed up
+  uint64_t frames = 0;
+  uint64_t changes = 0;
+  uint64_t written = 0;
+  int status = EXIT_SUCCESS;
+  int result;
+  while ((result = chip8_frame_reader_next(reader)) == 1) {
+    changes += reader->changed;
+    if (prefix && (reader->changed || !changes_only)) {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s%08llu.png", prefix,
+               (unsigned long long)frames);
+      if (write_png(path, &reader->frame, scale) == -1) {
+        printf("Failed to write %s\n", path);
+        status = EXIT_FAILURE;
+        break;
+      }
+      written++;
+    }
+    frames++;
+  }
+  if (result == -1) {
+    printf("Corrupt frame stream after frame %llu\n",
+           (unsigned long long)frames);
+    status = EXIT_FAILURE;
+  }
+
+  printf("frames: %llu\n", (unsigned long long)frames);
+  printf("changes: %llu\n", (unsigned long long)changes);
+  if (prefix) {
+    printf("images: %llu\n", (unsigned long long)written);
+  }
+  chip8_frame_reader_close(reader);
+  free(reader);
+  return status;
+}
@@ -0,0 +1,218 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+#ifdef CHIP8_JIT
+#include "jit.h"
+#endif
+
+// libFuzzer target. An input is a program and the keys held while it runs:
+//   u16 LE   program size in the low 12 bits, cut down to what the input
+//            holds, and the profile it runs under in the top 4, modulo
+//            CHIP8_PROFILE_COUNT
+//   bytes    the program, loaded at 0x200
+//   u16 LE   key masks, bit i = key i held, one per frame
+// Every input is run for at least MIN_FRAMES frames and at most
+// MAX_FRAMES. Between inputs the emulator is put back with chip8_reset
+// rather than initialized again, and anything that breaks an invariant
+// aborts so the fuzzer keeps the input. Built with the JIT, the same input
+// also runs through it and must end in the same state as the interpreter,
+// both as loaded and again after a chip8_reset back to the loaded program,
+// which keeps whatever it compiled from memory the run didn't change
+
+#define FRAME_CYCLES 64
+#define MIN_FRAMES 16
+#define MAX_FRAMES 512
+
+// Aborts with the failed condition, which the fuzzer reports as a crash
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,        \
+              #condition);                                                     \
+      abort();                                                                 \
+    }                                                                          \
+  } while (0)
+
+static Chip8Emulator pristine;
+static Chip8Emulator interpreter;
+static Chip8DecodeCache decode_cache;
+#ifdef CHIP8_JIT
+static Chip8Emulator compiled;
+// compiled as the input's program was loaded into it
+static Chip8Emulator loaded;
+#endif
+
+static uint16_t get_le16(const uint8_t *bytes) {
+  return bytes[0] | bytes[1] << 8;
+}
+
+static void setup(void) {
+  // Random programs print an unrecognized instruction every few cycles
+  if (!freopen("/dev/null", "w", stdout)) {
+    abort();
+  }
+  chip8_init_emulator(&pristine);
+  chip8_set_clock(&pristine, FRAME_CYCLES * CHIP8_TIMER_HZ);
+  interpreter = pristine;
+  chip8_attach_decode_cache(&interpreter, &decode_cache);
+#ifdef CHIP8_JIT
+  compiled = pristine;
+  Chip8Jit *jit = chip8_jit_create();
+  CHECK(jit != NULL);
+  chip8_attach_jit(&compiled, jit);
+#endif
+}
+
+// Checks that a reset put back exactly the pristine state, which catches
+// any write chip8_reset wasn't told about
+static void check_reset(const Chip8Emulator *emulator) {
+  size_t pointers = offsetof(Chip8Emulator, decode_cache);
+  CHECK(memcmp(emulator, &pristine, pointers) == 0);
+  CHECK(emulator->cycles == pristine.cycles);
+  CHECK(emulator->next_timer_cycle == pristine.next_timer_cycle);
+  CHECK(emulator->random_state == pristine.random_state);
+  CHECK(emulator->planes == pristine.planes);
+  CHECK(emulator->key_wait == pristine.key_wait);
+  CHECK(emulator->profile == pristine.profile);
+  CHECK(memcmp(emulator->inputs, pristine.inputs, sizeof(pristine.inputs)) ==
+        0);
+  CHECK(memcmp(emulator->stack, pristine.stack, sizeof(pristine.stack)) == 0);
+  CHECK(memcmp(emulator->graphics, pristine.graphics,
+               sizeof(pristine.graphics)) == 0);
+  CHECK(memcmp(emulator->memory, pristine.memory, MEMORY_SIZE) == 0);
+}
+
+// Invariants that hold after any instruction
+static void check_state(const Chip8Emulator *emulator) {
+  CHECK(emulator->sp <= STACK_SIZE);
+  CHECK(emulator->random_state != 0);
+  CHECK(emulator->cycles < emulator->next_timer_cycle);
+  CHECK(!emulator->key_wait || (emulator->key_wait & ~0xf) == CHIP8_KEY_WAIT);
+  // A decoded instruction must still be what memory holds
+  const Chip8DecodeCache *cache = emulator->decode_cache;
+  if (cache) {
+    for (int i = 0; i + 1 < MEMORY_SIZE; i++) {
+      if (cache->entries[i].handler) {
+        uint16_t instruction =
+            emulator->memory[i] << 8 | emulator->memory[i + 1];
+        CHECK(cache->entries[i].instruction == instruction);
+      }
+    }
+  }
+}
+
+#ifdef CHIP8_JIT
+static void check_same(const Chip8Emulator *a, const Chip8Emulator *b) {
+  CHECK(a->fault == b->fault);
+  if (a->fault) {
+    // Where a faulted run stopped inside a batch differs between the two
+    return;
+  }
+  size_t pointers = offsetof(Chip8Emulator, decode_cache);
+  CHECK(memcmp(a, b, pointers) == 0);
+  CHECK(a->cycles == b->cycles);
+  CHECK(a->random_state == b->random_state);
+  CHECK(a->planes == b->planes);
+  CHECK(a->key_wait == b->key_wait);
+  CHECK(a->key_wait_cycle == b->key_wait_cycle);
+  CHECK(memcmp(a->stack, b->stack, sizeof(a->stack)) == 0);
+  CHECK(memcmp(a->graphics, b->graphics, sizeof(a->graphics)) == 0);
+  CHECK(memcmp(a->memory, b->memory, MEMORY_SIZE) == 0);
+}
+#endif
+
+static void run_frames(Chip8Emulator *emulator, const uint8_t *keys,
+                       size_t key_frames, size_t frames) {
+  for (size_t frame = 0; frame < frames && !emulator->fault; frame++) {
+    uint16_t held = frame < key_frames ? get_le16(keys + 2 * frame) : 0;
+    for (int i = 0; i < 16; i++) {
+      chip8_set_key(emulator, i, (held >> i) & 1);
+    }
+    chip8_run_batch(emulator, FRAME_CYCLES);
+    check_state(emulator);
+  }
+}
+
+// Runs the program from a reset and a fresh load. If `copy` isn't NULL the
+// emulator is copied there once the program is loaded
+static void run(Chip8Emulator *emulator, Chip8Profile profile,
+                const uint8_t *program, size_t program_size,
+                const uint8_t *keys, size_t key_frames, size_t frames,
+                Chip8Emulator *copy) {
+  chip8_reset(emulator, &pristine);
+  check_reset(emulator);
+  chip8_set_profile(emulator, profile);
+  chip8_load_program(emulator, program, program_size);
+  if (copy) {
+    *copy = *emulator;
+  }
+  run_frames(emulator, keys, key_frames, frames);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  static int ready;
+  if (!ready) {
+    setup();
+    ready = 1;
+  }
+  if (size < 2) {
+    return 0;
+  }
+  size_t program_size = get_le16(data) & 0xfff;
+  Chip8Profile profile = (get_le16(data) >> 12) % CHIP8_PROFILE_COUNT;
+  data += 2;
+  size -= 2;
+  if (program_size > size) {
+    program_size = size;
+  }
+  if (program_size > MAX_PROGRAM_SIZE) {
+    program_size = MAX_PROGRAM_SIZE;
+  }
+  const uint8_t *program = data;
+  const uint8_t *keys = data + program_size;
+  size_t key_frames = (size - program_size) / 2;
+  size_t frames = key_frames < MIN_FRAMES ? MIN_FRAMES : key_frames;
+  if (frames > MAX_FRAMES) {
+    frames = MAX_FRAMES;
+  }
+
+  run(&interpreter, profile, program, program_size, keys, key_frames, frames,
+      NULL);
+#ifdef CHIP8_JIT
+  run(&compiled, profile, program, program_size, keys, key_frames, frames,
+      &loaded);
+  check_same(&interpreter, &compiled);
+
+  // Without reloading, so only blocks the run changed are recompiled
+  chip8_reset(&compiled, &loaded);
+  run_frames(&compiled, keys, key_frames, frames);
+  check_same(&interpreter, &compiled);
+  // The next input resets to pristine, which needs a copy of it
+  chip8_restore_state(&compiled, &pristine);
+#endif
+  return 0;
+}
+
+#ifdef CHIP8_FUZZ_MAIN
+// Without libFuzzer, runs each file named on the command line once, e.g. to
+// reproduce a crash or replay a corpus
+int main(int argc, char **argv) {
+  static uint8_t input[2 + MAX_PROGRAM_SIZE + 2 * MAX_FRAMES];
+  for (int i = 1; i < argc; i++) {
+    FILE *file = fopen(argv[i], "rb");
+    if (!file) {
+      fprintf(stderr, "Failed to open %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+    size_t size = fread(input, 1, sizeof(input), file);
+    fclose(file);
+    LLVMFuzzerTestOneInput(input, size);
+  }
+  fprintf(stderr, "ran %d inputs\n", argc - 1);
+  return EXIT_SUCCESS;
+}
+#endif
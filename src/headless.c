@@ -0,0 +1,469 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "emulator.h"
+#include "frame_stream.h"
+#include "input_log.h"
+#ifdef CHIP8_JIT
+#include "jit.h"
+#endif
+#include "lockstep.h"
+#include "profile.h"
+#ifdef CHIP8_STATS
+#include "stats.h"
+#endif
+#include "trace.h"
+
+// Instructions per emulated 60 Hz frame when none is given on the command line
+static const uint64_t DEFAULT_CYCLES_PER_FRAME = 12;
+// Instructions --trace keeps when --trace-records isn't given
+static const uint64_t DEFAULT_TRACE_RECORDS = 65536;
+
+static void usage(const char *name) {
+  printf("usage: %s <program> [--cycles N | --frames N] "
+         "[--cycles-per-frame N] [--seed N] [--no-decode-cache] [--jit] "
+         "[--lockstep] [--replay FILE] [--stats FILE] [--perf-map] "
+         "[--trace FILE] [--trace-records N] [--trace-on TRIGGERS] "
+         "[--frame-stream FILE] [--profile NAME | --profiles FILE]\n",
+         name);
+}
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Runs CHIP8_LANES copies of the program in lock step, each with its own
+// random seed, for `cycles` lock steps
+static int run_lockstep(const uint8_t *program, long program_size,
+                        uint64_t cycles, uint64_t cycles_per_frame,
+                        uint32_t seed) {
+  Chip8Lockstep *lockstep = malloc(sizeof(Chip8Lockstep));
+  if (!lockstep) {
+    puts("Failed to allocate the lanes");
+    return EXIT_FAILURE;
+  }
+  chip8_lockstep_init(lockstep, program, program_size, seed);
+
+  uint64_t steps = 0;
+  uint64_t lane_cycles = 0;
+  double start = now_seconds();
+  while (steps < cycles) {
+    uint64_t batch = cycles - steps < cycles_per_frame ? cycles - steps
+                                                       : cycles_per_frame;
+    lane_cycles += chip8_lockstep_run(lockstep, batch);
+    chip8_lockstep_tick_timers(lockstep);
+    steps += batch;
+  }
+  double elapsed = now_seconds() - start;
+
+  printf("lanes: %d\n", CHIP8_LANES);
+  printf("steps: %llu\n", (unsigned long long)steps);
+  printf("lane cycles: %llu\n", (unsigned long long)lane_cycles);
+  printf("lane utilization: %.1f%%\n",
+         steps ? 100.0 * lane_cycles / ((double)steps * CHIP8_LANES) : 0.0);
+  printf("seconds: %.6f\n", elapsed);
+  printf("instructions/second: %.0f\n",
+         elapsed > 0 ? (double)lane_cycles / elapsed : 0.0);
+
+  free(lockstep);
+  return EXIT_SUCCESS;
+}
+
+// Replays an input log recorded by the SDL frontend as fast as possible and
+// checks it ends on the same display. The log picks the profile, so one
+// picked on the command line has to agree with it
+static int run_replay(const char *path, const uint8_t *program,
+                      long program_size, int profile_picked,
+                      Chip8Emulator *emulator) {
+  Chip8InputLog log;
+  if (chip8_input_log_load(&log, path) == -1) {
+    printf("Failed to load input log: %s\n", path);
+    return EXIT_FAILURE;
+  }
+  if (log.program_hash !=
+      chip8_input_log_program_hash(program, program_size)) {
+    puts("The input log was recorded with a different program");
+    chip8_input_log_free(&log);
+    return EXIT_FAILURE;
+  }
+  if (profile_picked && log.profile != emulator->profile) {
+    printf("The input log was recorded under the %s profile, not %s\n",
+           chip8_profile_name(log.profile),
+           chip8_profile_name(emulator->profile));
+    chip8_input_log_free(&log);
+    return EXIT_FAILURE;
+  }
+
+  double start = now_seconds();
+  int result = chip8_input_log_replay(&log, emulator);
+  double elapsed = now_seconds() - start;
+
+  printf("cycles: %llu\n", (unsigned long long)emulator->cycles);
+  printf("events: %u\n", log.event_count);
+  printf("seconds: %.6f\n", elapsed);
+  if (emulator->fault) {
+    printf("fault: %s at pc %x\n", chip8_fault_name(emulator->fault),
+           emulator->pc);
+  }
+  printf("framebuffer hash: %016llx, recorded %016llx\n",
+         (unsigned long long)chip8_framebuffer_hash(emulator),
+         (unsigned long long)log.framebuffer_hash);
+  puts(result == 0 ? "replay: ok" : "replay: mismatch");
+
+  chip8_input_log_free(&log);
+  return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Runs `cycles` instructions and reports how fast they ran. The timers
+// tick every cycles_per_frame instructions of emulated time, so
+// timer-driven programs behave as if they ran at real speed. With a frame
+// stream the display goes into it after every frame's instructions
+static int run(Chip8Emulator *emulator, uint64_t cycles,
+               uint64_t cycles_per_frame, Chip8FrameStream *stream) {
+  double start = now_seconds();
+  if (stream) {
+    uint64_t done = 0;
+    while (done < cycles && !emulator->fault) {
+      uint64_t batch = cycles - done < cycles_per_frame ? cycles - done
+                                                        : cycles_per_frame;
+      done += chip8_run_batch(emulator, batch);
+      chip8_frame_stream_push(stream, emulator);
+    }
+    cycles = done;
+  } else {
+    cycles = chip8_run_batch(emulator, cycles);
+  }
+  double elapsed = now_seconds() - start;
+
+  printf("profile: %s\n", chip8_profile_name(emulator->profile));
+  printf("cycles: %llu\n", (unsigned long long)cycles);
+  printf("frames: %llu\n", (unsigned long long)(cycles / cycles_per_frame));
+  printf("seconds: %.6f\n", elapsed);
+  if (emulator->fault) {
+    printf("fault: %s at pc %x\n", chip8_fault_name(emulator->fault),
+           emulator->pc);
+  }
+  printf("instructions/second: %.0f\n",
+         elapsed > 0 ? (double)cycles / elapsed : 0.0);
+
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  uint64_t cycles = 0;
+  uint64_t frames = 0;
+  uint64_t cycles_per_frame = DEFAULT_CYCLES_PER_FRAME;
+  int use_decode_cache = 1;
+  int use_jit = 0;
+  int use_lockstep = 0;
+  uint32_t seed = CHIP8_DEFAULT_SEED;
+  const char *replay = NULL;
+  const char *stats_path = NULL;
+  const char *trace_path = NULL;
+  const char *trace_on = NULL;
+  uint64_t trace_records = DEFAULT_TRACE_RECORDS;
+  const char *frame_stream_path = NULL;
+  const char *profile_name = NULL;
+  const char *profiles_path = NULL;
+  int write_perf_map = 0;
+
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--no-decode-cache") == 0) {
+      use_decode_cache = 0;
+      continue;
+    }
+    if (strcmp(argv[i], "--jit") == 0) {
+      use_jit = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--lockstep") == 0) {
+      use_lockstep = 1;
+      continue;
+    }
+    if (strcmp(argv[i], "--perf-map") == 0) {
+      write_perf_map = 1;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    if (strcmp(argv[i], "--replay") == 0) {
+      replay = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--stats") == 0) {
+      stats_path = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--trace") == 0) {
+      trace_path = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--trace-on") == 0) {
+      trace_on = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--frame-stream") == 0) {
+      frame_stream_path = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--profile") == 0) {
+      profile_name = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--profiles") == 0) {
+      profiles_path = argv[++i];
+      continue;
+    }
+    uint64_t value = strtoull(argv[i + 1], NULL, 0);
+    if (strcmp(argv[i], "--seed") == 0) {
+      seed = (uint32_t)value;
+    } else if (strcmp(argv[i], "--cycles") == 0) {
+      cycles = value;
+    } else if (strcmp(argv[i], "--frames") == 0) {
+      frames = value;
+    } else if (strcmp(argv[i], "--cycles-per-frame") == 0) {
+      cycles_per_frame = value;
+    } else if (strcmp(argv[i], "--trace-records") == 0) {
+      trace_records = value;
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    i++;
+  }
+
+  if (cycles_per_frame == 0) {
+    puts("--cycles-per-frame must be at least 1");
+    return EXIT_FAILURE;
+  }
+  if (cycles_per_frame > UINT32_MAX / CHIP8_TIMER_HZ) {
+    printf("--cycles-per-frame must be at most %u\n",
+           UINT32_MAX / CHIP8_TIMER_HZ);
+    return EXIT_FAILURE;
+  }
+  if (frames > UINT64_MAX / cycles_per_frame) {
+    printf("--frames must be at most %llu\n",
+           (unsigned long long)(UINT64_MAX / cycles_per_frame));
+    return EXIT_FAILURE;
+  }
+#ifndef CHIP8_STATS
+  if (stats_path || write_perf_map) {
+    puts("This build does not include stats, configure with -DCHIP8_STATS=ON");
+    return EXIT_FAILURE;
+  }
+#endif
+#ifndef CHIP8_TRACE
+  if (trace_path) {
+    puts("This build does not include traces, configure with -DCHIP8_TRACE=ON");
+    return EXIT_FAILURE;
+  }
+#endif
+  int trace_triggers = 0;
+  uint16_t trace_first_pc = 0;
+  uint16_t trace_last_pc = 0;
+  if (trace_on &&
+      chip8_parse_trace_triggers(trace_on, &trace_triggers, &trace_first_pc,
+                                 &trace_last_pc) == -1) {
+    printf("Unknown trace triggers: %s\n", trace_on);
+    return EXIT_FAILURE;
+  }
+  if ((trace_on || trace_records != DEFAULT_TRACE_RECORDS) && !trace_path) {
+    puts("--trace-on and --trace-records need --trace");
+    return EXIT_FAILURE;
+  }
+  if (trace_path && (replay || use_lockstep)) {
+    puts("--trace records plain runs, not --replay or --lockstep");
+    return EXIT_FAILURE;
+  }
+  if (frame_stream_path && (replay || use_lockstep)) {
+    puts("--frame-stream records plain runs, not --replay or --lockstep");
+    return EXIT_FAILURE;
+  }
+  if (profile_name && profiles_path) {
+    puts("--profile and --profiles both pick the profile, give only one");
+    return EXIT_FAILURE;
+  }
+  if (write_perf_map && !use_jit) {
+    puts("--perf-map names JIT code, so it needs --jit");
+    return EXIT_FAILURE;
+  }
+  if (cycles == 0) {
+    cycles = frames ? frames * cycles_per_frame : 10000000;
+  }
+
+  uint8_t buffer[MAX_PROGRAM_SIZE];
+  long file_len = chip8_read_program(argv[1], buffer);
+  if (file_len == -1) {
+    printf("Failed to load program: %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  Chip8Profile profile = CHIP8_PROFILE_DEFAULT;
+  if (profile_name) {
+    int parsed = chip8_parse_profile(profile_name);
+    if (parsed == -1) {
+      printf("Unknown profile: %s\n", profile_name);
+      return EXIT_FAILURE;
+    }
+    profile = parsed;
+  } else if (profiles_path) {
+    Chip8ProfileDatabase database;
+    if (chip8_profile_database_load(&database, profiles_path) == -1) {
+      printf("Failed to load profiles: %s\n", profiles_path);
+      return EXIT_FAILURE;
+    }
+    profile = chip8_profile_lookup(&database, buffer, file_len);
+    chip8_profile_database_free(&database);
+  }
+
+  if (use_lockstep) {
+    if (profile != CHIP8_PROFILE_DEFAULT) {
+      puts("--lockstep only runs the default profile");
+      return EXIT_FAILURE;
+    }
+    return run_lockstep(buffer, file_len, cycles, cycles_per_frame, seed);
+  }
+
+  Chip8Emulator emulator;
+  chip8_init_emulator(&emulator);
+  chip8_set_profile(&emulator, profile);
+  chip8_load_program(&emulator, buffer, file_len);
+  chip8_seed_random(&emulator, seed);
+  chip8_set_clock(&emulator, (uint32_t)(cycles_per_frame * CHIP8_TIMER_HZ));
+
+  Chip8DecodeCache *cache = NULL;
+  if (use_decode_cache) {
+    cache = malloc(sizeof(Chip8DecodeCache));
+    if (!cache) {
+      puts("Failed to allocate the decode cache");
+      return EXIT_FAILURE;
+    }
+    chip8_attach_decode_cache(&emulator, cache);
+  }
+
+#ifdef CHIP8_JIT
+  Chip8Jit *jit = NULL;
+  if (use_jit) {
+    jit = chip8_jit_create();
+    if (!jit) {
+      puts("Failed to create the JIT");
+      return EXIT_FAILURE;
+    }
+    chip8_attach_jit(&emulator, jit);
+  }
+#else
+  if (use_jit) {
+    puts("This build does not include the JIT");
+    return EXIT_FAILURE;
+  }
+#endif
+
+#ifdef CHIP8_STATS
+  FILE *perf_map = NULL;
+#ifdef CHIP8_JIT
+  if (write_perf_map) {
+    // perf looks the map up by the pid of the process it profiled
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+    perf_map = fopen(path, "w");
+    if (!perf_map) {
+      printf("Failed to open %s\n", path);
+      return EXIT_FAILURE;
+    }
+    chip8_jit_set_perf_map(jit, perf_map);
+  }
+#endif
+  Chip8Stats *stats = NULL;
+  if (stats_path) {
+    stats = malloc(sizeof(Chip8Stats));
+    if (!stats) {
+      puts("Failed to allocate the stats");
+      return EXIT_FAILURE;
+    }
+    chip8_attach_stats(&emulator, stats);
+    if (use_jit) {
+      puts("The JIT is bypassed while stats are collected");
+    }
+  }
+#endif
+#ifdef CHIP8_TRACE
+  Chip8Trace trace = {0};
+  if (trace_path) {
+    if (chip8_trace_init(&trace, trace_records, trace_triggers,
+                         trace_first_pc, trace_last_pc) == -1) {
+      puts("Failed to allocate the trace");
+      return EXIT_FAILURE;
+    }
+    chip8_attach_trace(&emulator, &trace);
+    if (use_jit) {
+      puts("The JIT is bypassed until the trace stops");
+    }
+  }
+#endif
+
+  int status;
+  if (replay) {
+    status = run_replay(replay, buffer, file_len,
+                        profile_name || profiles_path, &emulator);
+  } else if (frame_stream_path) {
+    Chip8FrameStream *stream = chip8_frame_stream_open(frame_stream_path);
+    if (!stream) {
+      printf("Failed to open frame stream: %s\n", frame_stream_path);
+      return EXIT_FAILURE;
+    }
+    status = run(&emulator, cycles, cycles_per_frame, stream);
+    long long bytes = chip8_frame_stream_close(stream);
+    if (bytes == -1) {
+      printf("Failed to write frame stream: %s\n", frame_stream_path);
+      status = EXIT_FAILURE;
+    } else {
+      printf("frame stream bytes: %lld\n", bytes);
+    }
+  } else {
+    status = run(&emulator, cycles, cycles_per_frame, NULL);
+  }
+
+#ifdef CHIP8_STATS
+  if (stats && chip8_stats_save_json(stats, stats_path) == -1) {
+    printf("Failed to write stats: %s\n", stats_path);
+    status = EXIT_FAILURE;
+  }
+  free(stats);
+  if (perf_map) {
+    fclose(perf_map);
+  }
+#endif
+#ifdef CHIP8_TRACE
+  if (trace_path) {
+    printf("trace records: %llu\n",
+           (unsigned long long)chip8_trace_count(&trace));
+    printf("trace stopped by: %s\n",
+           chip8_trace_trigger_name(trace.triggered));
+    if (chip8_trace_save(&trace, trace_path) == -1) {
+      printf("Failed to write trace: %s\n", trace_path);
+      status = EXIT_FAILURE;
+    }
+  }
+  chip8_trace_free(&trace);
+#endif
+#ifdef CHIP8_JIT
+  chip8_jit_destroy(jit);
+#endif
+  free(cache);
+  return status;
+}
@@ -0,0 +1,236 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "input_log.h"
+
+static const uint8_t MAGIC[4] = {'C', '8', 'I', 'L'};
+#define VERSION 2
+#define HEADER_SIZE 48
+
+static void put_le(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+static uint64_t get_le(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+static uint16_t key_mask(const Chip8Emulator *emulator) {
+  uint16_t keys = 0;
+  for (int i = 0; i < 16; i++) {
+    keys |= (uint16_t)(emulator->inputs[i] != 0) << i;
+  }
+  return keys;
+}
+
+uint64_t chip8_input_log_program_hash(const uint8_t *program,
+                                      long program_size) {
+  // 64 bit FNV-1a
+  uint64_t hash = 0xcbf29ce484222325;
+  for (long i = 0; i < program_size; i++) {
+    hash ^= program[i];
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+void chip8_input_log_init(Chip8InputLog *log, uint32_t seed, uint32_t ips,
+                          Chip8Profile profile, uint64_t program_hash) {
+  memset(log, 0, sizeof(*log));
+  log->seed = seed;
+  log->ips = ips;
+  log->profile = profile;
+  log->program_hash = program_hash;
+}
+
+void chip8_input_log_free(Chip8InputLog *log) {
+  free(log->events);
+  log->events = NULL;
+  log->size = 0;
+  log->capacity = 0;
+}
+
+int chip8_input_log_record(Chip8InputLog *log, const Chip8Emulator *emulator) {
+  uint16_t keys = key_mask(emulator);
+  if (keys == log->last_keys) {
+    return 0;
+  }
+
+  // A 64-bit delta takes at most 10 LEB128 bytes
+  if (log->size + 12 > log->capacity) {
+    size_t capacity = log->capacity ? log->capacity * 2 : 4096;
+    uint8_t *grown = realloc(log->events, capacity);
+    if (!grown) {
+      return -1;
+    }
+    log->events = grown;
+    log->capacity = capacity;
+  }
+
+  uint64_t delta = emulator->cycles - log->last_cycle;
+  do {
+    uint8_t byte = delta & 0x7f;
+    delta >>= 7;
+    log->events[log->size++] = byte | (delta ? 0x80 : 0);
+  } while (delta);
+  put_le(log->events + log->size, keys, 2);
+  log->size += 2;
+
+  log->event_count++;
+  log->last_cycle = emulator->cycles;
+  log->last_keys = keys;
+  return 0;
+}
+
+void chip8_input_log_finish(Chip8InputLog *log, const Chip8Emulator *emulator) {
+  log->end_cycle = emulator->cycles;
+  log->framebuffer_hash = chip8_framebuffer_hash(emulator);
+}
+
+int chip8_input_log_save(const Chip8InputLog *log, const char *path) {
+  uint8_t header[HEADER_SIZE];
+  memcpy(header, MAGIC, sizeof(MAGIC));
+  put_le(header + 4, VERSION, 2);
+  header[6] = log->profile;
+  header[7] = 0;
+  put_le(header + 8, log->seed, 4);
+  put_le(header + 12, log->ips, 4);
+  put_le(header + 16, log->program_hash, 8);
+  put_le(header + 24, log->end_cycle, 8);
+  put_le(header + 32, log->framebuffer_hash, 8);
+  put_le(header + 40, log->event_count, 4);
+  put_le(header + 44, log->size, 4);
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+  int result = 0;
+  if (fwrite(header, 1, HEADER_SIZE, file) != HEADER_SIZE ||
+      fwrite(log->events, 1, log->size, file) != log->size) {
+    result = -1;
+  }
+  if (fclose(file) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int chip8_input_log_load(Chip8InputLog *log, const char *path) {
+  memset(log, 0, sizeof(*log));
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, 1, HEADER_SIZE, file) != HEADER_SIZE ||
+      memcmp(header, MAGIC, sizeof(MAGIC)) != 0 ||
+      get_le(header + 4, 2) != VERSION ||
+      header[6] >= CHIP8_PROFILE_COUNT) {
+    fclose(file);
+    return -1;
+  }
+  log->seed = get_le(header + 8, 4);
+  log->ips = get_le(header + 12, 4);
+  log->profile = header[6];
+  log->program_hash = get_le(header + 16, 8);
+  log->end_cycle = get_le(header + 24, 8);
+  log->framebuffer_hash = get_le(header + 32, 8);
+  log->event_count = get_le(header + 40, 4);
+  log->size = get_le(header + 44, 4);
+
+  log->capacity = log->size ? log->size : 1;
+  log->events = malloc(log->capacity);
+  if (!log->events || fread(log->events, 1, log->size, file) != log->size) {
+    chip8_input_log_free(log);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  return 0;
+}
+
+// Decodes the event at *offset, adding its delta to *cycle. Returns -1 if it
+// runs past the end of the log
+static int next_event(const Chip8InputLog *log, size_t *offset,
+                      uint64_t *cycle, uint16_t *keys) {
+  uint64_t delta = 0;
+  for (int shift = 0;; shift += 7) {
+    if (*offset >= log->size || shift > 63) {
+      return -1;
+    }
+    uint8_t byte = log->events[(*offset)++];
+    delta |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  if (*offset + 2 > log->size) {
+    return -1;
+  }
+  *keys = get_le(log->events + *offset, 2);
+  *offset += 2;
+  *cycle += delta;
+  return 0;
+}
+
+int chip8_input_log_replay(const Chip8InputLog *log, Chip8Emulator *emulator) {
+  if (!log->ips || emulator->cycles != 0) {
+    return -1;
+  }
+  chip8_set_profile(emulator, log->profile);
+  chip8_seed_random(emulator, log->seed);
+  // The timers tick on the same cycles as when the log was recorded, and
+  // a tick at the end of a frame comes before that frame's key changes
+  chip8_set_clock(emulator, log->ips);
+
+  size_t offset = 0;
+  uint32_t events_left = log->event_count;
+  uint64_t event_cycle = 0;
+  uint16_t event_keys = 0;
+  int have_event = 0;
+  if (events_left) {
+    if (next_event(log, &offset, &event_cycle, &event_keys) == -1) {
+      return -1;
+    }
+    have_event = 1;
+    events_left--;
+  }
+
+  for (;;) {
+    while (have_event && event_cycle == emulator->cycles) {
+      for (int i = 0; i < 16; i++) {
+        chip8_set_key(emulator, i, (event_keys >> i) & 1);
+      }
+      have_event = 0;
+      if (events_left) {
+        if (next_event(log, &offset, &event_cycle, &event_keys) == -1) {
+          return -1;
+        }
+        have_event = 1;
+        events_left--;
+      }
+    }
+    if (emulator->cycles >= log->end_cycle || emulator->fault) {
+      break;
+    }
+
+    uint64_t target = log->end_cycle;
+    if (have_event && event_cycle < target) {
+      target = event_cycle;
+    }
+    chip8_run_batch(emulator, target - emulator->cycles);
+  }
+
+  return chip8_framebuffer_hash(emulator) == log->framebuffer_hash ? 0 : -1;
+}
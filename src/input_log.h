@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// A recorded session: the random seed, the instruction rate the timers
+// were ticked at, the profile, and every change to the keys, keyed by the
+// cycle it happened on. Replaying it against the same program reproduces
+// the run exactly, ending on the recorded framebuffer hash.
+//
+// On disk it is a header followed by the events, each a LEB128 cycle delta
+// from the previous event and the 16 key states as a little-endian bit mask
+typedef struct InputLog {
+  uint32_t seed;
+  // Instructions per second. The timers tick once every ips / 60
+  // instructions, carrying the remainder over like the SDL frontend
+  uint32_t ips;
+  // The Chip8Profile the program ran under
+  uint8_t profile;
+  // chip8_input_log_program_hash of the program recorded against
+  uint64_t program_hash;
+  // Filled in by chip8_input_log_finish
+  uint64_t end_cycle;
+  uint64_t framebuffer_hash;
+
+  // Encoded events
+  uint8_t *events;
+  size_t size;
+  size_t capacity;
+  uint32_t event_count;
+  // While recording, the state of the last event
+  uint64_t last_cycle;
+  uint16_t last_keys;
+} Chip8InputLog;
+
+uint64_t chip8_input_log_program_hash(const uint8_t *program,
+                                      long program_size);
+void chip8_input_log_init(Chip8InputLog *log, uint32_t seed, uint32_t ips,
+                          Chip8Profile profile, uint64_t program_hash);
+void chip8_input_log_free(Chip8InputLog *log);
+// Adds an event if the emulator's keys changed since the last one. Call it
+// whenever the keys may have changed, before running more instructions.
+// Returns -1 if out of memory
+int chip8_input_log_record(Chip8InputLog *log, const Chip8Emulator *emulator);
+// Marks the end of the session
+void chip8_input_log_finish(Chip8InputLog *log, const Chip8Emulator *emulator);
+// Both return 0 on success, or -1 if the file can't be written or read or
+// isn't an input log
+int chip8_input_log_save(const Chip8InputLog *log, const char *path);
+int chip8_input_log_load(Chip8InputLog *log, const char *path);
+// Runs an emulator that has the program loaded through the whole session
+// as fast as possible, under the recorded profile. Returns 0 if it ends on
+// the recorded framebuffer hash, or -1 if it doesn't or the log is corrupt
+int chip8_input_log_replay(const Chip8InputLog *log, Chip8Emulator *emulator);
@@ -0,0 +1,688 @@
+#define _DEFAULT_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "emulator.h"
+#include "jit.h"
+
+// Size of the executable buffer blocks are compiled into. When it fills up
+// every block is thrown away and compilation starts over
+#define CODE_SIZE (1 << 20)
+
+// Longest block compiled, in instructions
+#define MAX_BLOCK_LENGTH 64
+
+// Upper bound on the machine code emitted for one block. A block ends early
+// rather than grow past it
+#define MAX_BLOCK_BYTES 4096
+
+// Upper bounds on the code for one instruction, FF65 being the largest,
+// and for the code that ends a block
+#define MAX_INSTRUCTION_BYTES 384
+#define MAX_EPILOGUE_BYTES 64
+
+// Marks an idle loop in the rejected table
+#define REJECTED_IDLE 2
+
+// Chained jumps look up their destination in the block table, which has a
+// few spare entries so skips past the end of memory don't need a bounds check
+#define TABLE_SIZE (MEMORY_SIZE + 4)
+
+// Enters compiled code at entry with `cycles` instructions of budget and
+// returns the budget left over once the chain of blocks exits
+typedef uint64_t (*Chip8JitEntry)(Chip8Emulator *emulator, uint64_t cycles,
+                                  void *entry);
+
+struct Chip8Jit {
+  uint8_t *code;
+  size_t used;
+  Chip8JitEntry enter;
+  uint8_t *exit;
+  // Compiled block for each address, NULL if there is none
+  void *table[TABLE_SIZE];
+  // 1 = the instruction at that address can't start a block, REJECTED_IDLE
+  // = it starts an idle loop
+  uint8_t rejected[MEMORY_SIZE];
+  // 1 = that byte is part of a compiled block
+  uint8_t covered[MEMORY_SIZE];
+  // 1 = the program wrote to that byte, so it is never compiled again
+  uint8_t written[MEMORY_SIZE];
+  // emulator->cycles plus the budget the current chain of blocks was
+  // entered with, so an instruction runs on cycle origin minus the budget
+  // left before it
+  uint64_t origin;
+  // Where emit_timer_sync left displacements for the block being compiled
+  size_t timer_fixups[MAX_BLOCK_LENGTH];
+  int timer_fixup_count;
+#ifdef CHIP8_STATS
+  // Optional, see chip8_jit_set_perf_map
+  FILE *perf_map;
+#endif
+};
+
+// Compiled code keeps the emulator in rbx, the remaining cycle budget in r12
+// and the block table in r13. V registers, I and pc stay in the emulator
+// struct, which is addressed as [rbx + disp32]
+#define REGISTER(i)                                                            \
+  (offsetof(Chip8Emulator, registers) +                                        \
+   (i) * sizeof(((Chip8Emulator *)0)->registers[0]))
+#define INDEX_REGISTER offsetof(Chip8Emulator, index_register)
+#define PC offsetof(Chip8Emulator, pc)
+#define DELAY_TIMER offsetof(Chip8Emulator, delay_timer)
+#define NEXT_TIMER_CYCLE offsetof(Chip8Emulator, next_timer_cycle)
+#define MEMORY offsetof(Chip8Emulator, memory)
+
+// Chip8Jit fields are addressed as [r13 + disp32] relative to the table
+#define JIT_ORIGIN                                                             \
+  ((uint32_t)(offsetof(Chip8Jit, origin) - offsetof(Chip8Jit, table)))
+
+// ModRM byte for [rbx + disp32] with `reg` in the reg field
+#define RBX_DISP32(reg) (0x83 | ((reg) << 3))
+
+enum { AL = 0, CL = 1 };
+
+static inline void emit8(Chip8Jit *jit, uint8_t byte) {
+  jit->code[jit->used++] = byte;
+}
+
+static inline void emit32(Chip8Jit *jit, uint32_t value) {
+  memcpy(jit->code + jit->used, &value, sizeof(value));
+  jit->used += sizeof(value);
+}
+
+static inline void emit64(Chip8Jit *jit, uint64_t value) {
+  memcpy(jit->code + jit->used, &value, sizeof(value));
+  jit->used += sizeof(value);
+}
+
+// Emits `prefix... opcode modrm disp32` addressing [rbx + disp]
+static inline void emit_rbx(Chip8Jit *jit, uint8_t opcode, uint8_t reg,
+                            uint32_t disp) {
+  emit8(jit, opcode);
+  emit8(jit, RBX_DISP32(reg));
+  emit32(jit, disp);
+}
+
+// jcc/jmp rel32 to target
+static inline void emit_jump(Chip8Jit *jit, const uint8_t *opcode,
+                             size_t opcode_size, uint8_t *target) {
+  for (size_t i = 0; i < opcode_size; i++) {
+    emit8(jit, opcode[i]);
+  }
+  int32_t rel = (int32_t)(target - (jit->code + jit->used + 4));
+  emit32(jit, (uint32_t)rel);
+}
+
+static inline void emit_jmp_exit(Chip8Jit *jit) {
+  static const uint8_t jmp[] = {0xe9};
+  emit_jump(jit, jmp, sizeof(jmp), jit->exit);
+}
+
+// mov al, byte [rbx + disp]
+static inline void load_al(Chip8Jit *jit, uint32_t disp) {
+  emit_rbx(jit, 0x8a, AL, disp);
+}
+
+// mov byte [rbx + disp], al
+static inline void store_al(Chip8Jit *jit, uint32_t disp) {
+  emit_rbx(jit, 0x88, AL, disp);
+}
+
+// setc/setnc byte [rbx + disp]
+static inline void store_flag(Chip8Jit *jit, uint8_t setcc, uint32_t disp) {
+  emit8(jit, 0x0f);
+  emit_rbx(jit, setcc, 0, disp);
+}
+
+// Stores eax to pc and jumps to the block compiled for that address, or
+// returns to the caller when there is none
+static void emit_chain(Chip8Jit *jit) {
+  static const uint8_t jz[] = {0x0f, 0x84};
+  // mov word [rbx + pc], ax
+  emit8(jit, 0x66);
+  emit_rbx(jit, 0x89, AL, PC);
+  // mov rdx, [r13 + rax * 8]
+  emit8(jit, 0x49);
+  emit8(jit, 0x8b);
+  emit8(jit, 0x54);
+  emit8(jit, 0xc5);
+  emit8(jit, 0x00);
+  // test rdx, rdx
+  emit8(jit, 0x48);
+  emit8(jit, 0x85);
+  emit8(jit, 0xd2);
+  emit_jump(jit, jz, sizeof(jz), jit->exit);
+  // jmp rdx
+  emit8(jit, 0xff);
+  emit8(jit, 0xe2);
+}
+
+// mov eax, imm32
+static inline void load_eax(Chip8Jit *jit, uint32_t value) {
+  emit8(jit, 0xb8);
+  emit32(jit, value);
+}
+
+// Leaves the next pc in eax for a skip whose condition is in the flags.
+// cmov is 0x44 (skip if equal) or 0x45 (skip if not equal)
+static void emit_skip(Chip8Jit *jit, uint16_t next, uint8_t cmov) {
+  load_eax(jit, next);
+  // mov ecx, next + 2
+  emit8(jit, 0xb9);
+  emit32(jit, next + 2);
+  // cmovcc eax, ecx
+  emit8(jit, 0x0f);
+  emit8(jit, cmov);
+  emit8(jit, 0xc1);
+}
+
+// Runs the timer ticks compiled code has run past. `left` is what the
+// budget would be had the chain stopped right before the calling
+// instruction
+static void sync_timers(Chip8Emulator *emulator, uint64_t left) {
+  chip8_catch_up_timers(emulator, emulator->jit->origin - left);
+}
+
+// Compiled code doesn't tick the timers as it goes, so instructions that
+// use them catch up first, calling out only when a tick is due. The
+// block's prologue took its whole length off the budget, so the length is
+// added back in once it is known
+static void emit_timer_sync(Chip8Jit *jit, uint32_t index) {
+  emit8(jit, 0x49); // lea rsi, [r12 + length - index]
+  emit8(jit, 0x8d);
+  emit8(jit, 0xb4);
+  emit8(jit, 0x24);
+  jit->timer_fixups[jit->timer_fixup_count++] = jit->used;
+  emit32(jit, -index);
+  emit8(jit, 0x49); // mov rax, [r13 + origin]
+  emit8(jit, 0x8b);
+  emit8(jit, 0x85);
+  emit32(jit, JIT_ORIGIN);
+  emit8(jit, 0x48); // sub rax, rsi
+  emit8(jit, 0x29);
+  emit8(jit, 0xf0);
+  emit8(jit, 0x48); // cmp rax, [rbx + next_timer_cycle]
+  emit_rbx(jit, 0x3b, AL, NEXT_TIMER_CYCLE);
+  emit8(jit, 0x72); // jb past the call
+  emit8(jit, 15);
+  emit8(jit, 0x48); // mov rdi, rbx
+  emit8(jit, 0x89);
+  emit8(jit, 0xdf);
+  emit8(jit, 0x48); // mov rax, sync_timers
+  emit8(jit, 0xb8);
+  emit64(jit, (uint64_t)(uintptr_t)sync_timers);
+  emit8(jit, 0xff); // call rax
+  emit8(jit, 0xd0);
+}
+
+// Emits the native code for an instruction that runs inside a block.
+// `index` is its position in the block, and `quirks` the profile's
+// CHIP8_PROFILE_* flags. Returns 0 without emitting anything if the
+// instruction has to go through the interpreter
+static int emit_body(Chip8Jit *jit, uint16_t ins, uint32_t index,
+                     int quirks) {
+  uint8_t x = (ins & 0x0f00) >> 8;
+  uint8_t y = (ins & 0x00f0) >> 4;
+  uint8_t nn = ins & 0x00ff;
+
+  switch (ins >> 12) {
+  case 0x6:
+    // mov byte [rbx + Vx], nn
+    emit_rbx(jit, 0xc6, 0, REGISTER(x));
+    emit8(jit, nn);
+    return 1;
+
+  case 0x7:
+    // add byte [rbx + Vx], nn
+    emit_rbx(jit, 0x80, 0, REGISTER(x));
+    emit8(jit, nn);
+    return 1;
+
+  case 0x8:
+    // The interpreter's results differ when VF is also an operand,
+    // so leave those to it
+    if (x == 0xf || y == 0xf) {
+      return 0;
+    }
+    switch (ins & 0xf) {
+    case 0x0:
+      load_al(jit, REGISTER(y));
+      store_al(jit, REGISTER(x));
+      return 1;
+    case 0x1:
+    case 0x2:
+    case 0x3: {
+      // or, and, xor [Vx], al
+      static const uint8_t opcodes[] = {0x08, 0x20, 0x30};
+      load_al(jit, REGISTER(y));
+      emit_rbx(jit, opcodes[(ins & 0xf) - 1], AL, REGISTER(x));
+      if (quirks & CHIP8_PROFILE_RESETS_VF) {
+        // mov byte [rbx + VF], 0
+        emit_rbx(jit, 0xc6, 0, REGISTER(0xf));
+        emit8(jit, 0);
+      }
+      return 1;
+    }
+    case 0x4:
+      // add [Vx], al then VF = carry
+      load_al(jit, REGISTER(y));
+      emit_rbx(jit, 0x00, AL, REGISTER(x));
+      store_flag(jit, 0x92, REGISTER(0xf));
+      return 1;
+    case 0x5:
+      // VF = no borrow
+      load_al(jit, REGISTER(x));
+      emit_rbx(jit, 0x2a, AL, REGISTER(y));
+      store_al(jit, REGISTER(x));
+      store_flag(jit, 0x93, REGISTER(0xf));
+      return 1;
+    case 0x6:
+      // shr al, 1 then VF = the bit shifted out
+      load_al(jit, REGISTER(quirks & CHIP8_PROFILE_SHIFTS_VX ? x : y));
+      emit8(jit, 0xd0);
+      emit8(jit, 0xe8);
+      store_al(jit, REGISTER(x));
+      store_flag(jit, 0x92, REGISTER(0xf));
+      return 1;
+    case 0x7:
+      load_al(jit, REGISTER(y));
+      emit_rbx(jit, 0x2a, AL, REGISTER(x));
+      store_al(jit, REGISTER(x));
+      store_flag(jit, 0x93, REGISTER(0xf));
+      return 1;
+    case 0xe:
+      // shl al, 1
+      load_al(jit, REGISTER(quirks & CHIP8_PROFILE_SHIFTS_VX ? x : y));
+      emit8(jit, 0xd0);
+      emit8(jit, 0xe0);
+      store_al(jit, REGISTER(x));
+      store_flag(jit, 0x92, REGISTER(0xf));
+      return 1;
+    default:
+      // Unassigned 8xyN operations do nothing
+      return 1;
+    }
+
+  case 0xa:
+    // mov word [rbx + I], nnn
+    emit8(jit, 0x66);
+    emit_rbx(jit, 0xc7, 0, INDEX_REGISTER);
+    emit8(jit, ins & 0xff);
+    emit8(jit, (ins & 0x0f00) >> 8);
+    return 1;
+
+  case 0xf:
+    switch (nn) {
+    case 0x07:
+      emit_timer_sync(jit, index);
+      load_al(jit, DELAY_TIMER);
+      store_al(jit, REGISTER(x));
+      return 1;
+    case 0x15:
+      emit_timer_sync(jit, index);
+      load_al(jit, REGISTER(x));
+      store_al(jit, DELAY_TIMER);
+      return 1;
+    // Fx18 is left to the interpreter, which tells any attached audio
+    case 0x1e:
+      // movzx eax, byte [rbx + Vx]; add word [rbx + I], ax
+      emit8(jit, 0x0f);
+      emit_rbx(jit, 0xb6, AL, REGISTER(x));
+      emit8(jit, 0x66);
+      emit_rbx(jit, 0x01, AL, INDEX_REGISTER);
+      return 1;
+    case 0x29:
+      // I = FONT_OFFSET + (Vx & 0xf) * FONT_SIZE
+      emit8(jit, 0x0f);
+      emit_rbx(jit, 0xb6, AL, REGISTER(x));
+      emit8(jit, 0x83);
+      emit8(jit, 0xe0);
+      emit8(jit, 0x0f);
+      emit8(jit, 0x6b);
+      emit8(jit, 0xc0);
+      emit8(jit, CHIP8_FONT_SIZE);
+      emit8(jit, 0x05);
+      emit32(jit, CHIP8_FONT_OFFSET);
+      emit8(jit, 0x66);
+      emit_rbx(jit, 0x89, AL, INDEX_REGISTER);
+      return 1;
+    case 0x65:
+      // movzx ecx, word [rbx + I], then V0..Vx = memory[I..]
+      emit8(jit, 0x0f);
+      emit_rbx(jit, 0xb7, CL, INDEX_REGISTER);
+      for (uint8_t i = 0; i <= x; i++) {
+        // lea eax, [rcx + i]; and eax, 0xfff, wrapping like the interpreter
+        emit8(jit, 0x8d);
+        emit8(jit, 0x41);
+        emit8(jit, i);
+        emit8(jit, 0x25);
+        emit32(jit, MEMORY_SIZE - 1);
+        // mov al, byte [rbx + rax + memory]
+        emit8(jit, 0x8a);
+        emit8(jit, 0x84);
+        emit8(jit, 0x03);
+        emit32(jit, MEMORY);
+        store_al(jit, REGISTER(i));
+      }
+      if (quirks & CHIP8_PROFILE_MOVES_I) {
+        // add word [rbx + I], x + 1
+        emit8(jit, 0x66);
+        emit_rbx(jit, 0x83, 0, INDEX_REGISTER);
+        emit8(jit, x + 1);
+      }
+      return 1;
+    default:
+      return 0;
+    }
+
+  default:
+    return 0;
+  }
+}
+
+// Emits a jump or skip that ends a block. Returns 0 if the instruction
+// isn't one
+static int emit_terminator(Chip8Jit *jit, uint16_t ins, uint16_t next) {
+  uint8_t x = (ins & 0x0f00) >> 8;
+  uint8_t y = (ins & 0x00f0) >> 4;
+
+  switch (ins >> 12) {
+  case 0x1:
+    load_eax(jit, ins & 0x0fff);
+    break;
+
+  case 0x3:
+  case 0x4:
+    // cmp byte [rbx + Vx], nn
+    emit_rbx(jit, 0x80, 7, REGISTER(x));
+    emit8(jit, ins & 0xff);
+    emit_skip(jit, next, (ins >> 12) == 0x3 ? 0x44 : 0x45);
+    break;
+
+  case 0x5:
+  case 0x9:
+    if (ins & 0xf) {
+      return 0;
+    }
+    // mov al, [rbx + Vx]; cmp al, [rbx + Vy]
+    load_al(jit, REGISTER(x));
+    emit_rbx(jit, 0x3a, AL, REGISTER(y));
+    emit_skip(jit, next, (ins >> 12) == 0x5 ? 0x44 : 0x45);
+    break;
+
+  default:
+    return 0;
+  }
+
+  emit_chain(jit);
+  return 1;
+}
+
+static int compilable(Chip8Jit *jit, uint16_t address) {
+  return address + 1 < MEMORY_SIZE && !jit->written[address] &&
+         !jit->written[address + 1];
+}
+
+static void emit_runtime(Chip8Jit *jit) {
+  // Entry: rdi = emulator, rsi = cycles, rdx = block
+  jit->enter = (Chip8JitEntry)(uintptr_t)(jit->code + jit->used);
+  emit8(jit, 0x53); // push rbx
+  emit8(jit, 0x41); // push r12
+  emit8(jit, 0x54);
+  emit8(jit, 0x41); // push r13
+  emit8(jit, 0x55);
+  emit8(jit, 0x48); // mov rbx, rdi
+  emit8(jit, 0x89);
+  emit8(jit, 0xfb);
+  emit8(jit, 0x49); // mov r12, rsi
+  emit8(jit, 0x89);
+  emit8(jit, 0xf4);
+  emit8(jit, 0x49); // mov r13, table
+  emit8(jit, 0xbd);
+  emit64(jit, (uint64_t)(uintptr_t)jit->table);
+  emit8(jit, 0xff); // jmp rdx
+  emit8(jit, 0xe2);
+
+  // Exit: returns the remaining budget
+  jit->exit = jit->code + jit->used;
+  emit8(jit, 0x4c); // mov rax, r12
+  emit8(jit, 0x89);
+  emit8(jit, 0xe0);
+  emit8(jit, 0x41); // pop r13
+  emit8(jit, 0x5d);
+  emit8(jit, 0x41); // pop r12
+  emit8(jit, 0x5c);
+  emit8(jit, 0x5b); // pop rbx
+  emit8(jit, 0xc3); // ret
+}
+
+// Drops every compiled block but keeps track of written memory
+static void flush(Chip8Jit *jit) {
+  memset(jit->table, 0, sizeof(jit->table));
+  memset(jit->rejected, 0, sizeof(jit->rejected));
+  memset(jit->covered, 0, sizeof(jit->covered));
+  jit->used = 0;
+  emit_runtime(jit);
+}
+
+// Compiles the block starting at address. Returns NULL if the first
+// instruction can't be compiled
+static void *compile(Chip8Jit *jit, const Chip8Emulator *emulator,
+                     uint16_t address) {
+  if (!compilable(jit, address)) {
+    jit->rejected[address] = 1;
+    return NULL;
+  }
+  if (chip8_idle_loop(emulator)) {
+    jit->rejected[address] = REJECTED_IDLE;
+    return NULL;
+  }
+  if (jit->used + MAX_BLOCK_BYTES > CODE_SIZE) {
+    flush(jit);
+  }
+
+  size_t start = jit->used;
+  uint8_t *entry = jit->code + jit->used;
+
+  // The prologue checks the budget for the whole block up front, so
+  // remember where its length goes and fill it in at the end
+  static const uint8_t jb[] = {0x0f, 0x82};
+  emit8(jit, 0x49); // cmp r12, imm32
+  emit8(jit, 0x81);
+  emit8(jit, 0xfc);
+  size_t cmp_length = jit->used;
+  emit32(jit, 0);
+  emit_jump(jit, jb, sizeof(jb), jit->exit);
+  emit8(jit, 0x49); // sub r12, imm32
+  emit8(jit, 0x81);
+  emit8(jit, 0xec);
+  size_t sub_length = jit->used;
+  emit32(jit, 0);
+
+  int quirks = chip8_profile_quirks(emulator->profile);
+  jit->timer_fixup_count = 0;
+  uint32_t length = 0;
+  uint16_t pc = address;
+  int terminated = 0;
+  int full = 0;
+  while (length < MAX_BLOCK_LENGTH && compilable(jit, pc)) {
+    if (jit->used - start + MAX_INSTRUCTION_BYTES + MAX_EPILOGUE_BYTES >
+        MAX_BLOCK_BYTES) {
+      full = 1;
+      break;
+    }
+    uint16_t ins = (emulator->memory[pc] << 8) | emulator->memory[pc + 1];
+    if (emit_terminator(jit, ins, pc + 2)) {
+      length += 1;
+      pc += 2;
+      terminated = 1;
+      break;
+    }
+    if (!emit_body(jit, ins, length, quirks)) {
+      break;
+    }
+    length += 1;
+    pc += 2;
+  }
+
+  if (length == 0) {
+    jit->used = start;
+    jit->rejected[address] = 1;
+    return NULL;
+  }
+
+  if (!terminated) {
+    if (length == MAX_BLOCK_LENGTH || full) {
+      // Long straight-line code continues in the next block
+      load_eax(jit, pc);
+      emit_chain(jit);
+    } else {
+      // mov word [rbx + pc], pc then return to the interpreter
+      emit8(jit, 0x66);
+      emit_rbx(jit, 0xc7, 0, PC);
+      emit8(jit, pc & 0xff);
+      emit8(jit, pc >> 8);
+      emit_jmp_exit(jit);
+    }
+  }
+
+  memcpy(jit->code + cmp_length, &length, sizeof(length));
+  memcpy(jit->code + sub_length, &length, sizeof(length));
+  for (int i = 0; i < jit->timer_fixup_count; i++) {
+    uint32_t displacement;
+    memcpy(&displacement, jit->code + jit->timer_fixups[i], 4);
+    displacement += length;
+    memcpy(jit->code + jit->timer_fixups[i], &displacement, 4);
+  }
+  memset(jit->covered + address, 1, pc - address);
+  jit->table[address] = entry;
+#ifdef CHIP8_STATS
+  if (jit->perf_map) {
+    fprintf(jit->perf_map, "%llx %zx chip8_block_%03x\n",
+            (unsigned long long)(uintptr_t)entry, jit->used - start, address);
+  }
+#endif
+  return entry;
+}
+
+Chip8Jit *chip8_jit_create(void) {
+  Chip8Jit *jit = calloc(1, sizeof(Chip8Jit));
+  if (!jit) {
+    return NULL;
+  }
+  jit->code = mmap(NULL, CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED) {
+    free(jit);
+    return NULL;
+  }
+  flush(jit);
+  return jit;
+}
+
+void chip8_jit_destroy(Chip8Jit *jit) {
+  if (!jit) {
+    return;
+  }
+  munmap(jit->code, CODE_SIZE);
+  free(jit);
+}
+
+void chip8_jit_reset(Chip8Jit *jit) {
+  memset(jit->written, 0, sizeof(jit->written));
+  flush(jit);
+}
+
+void chip8_jit_invalidate(Chip8Jit *jit, uint16_t address, uint16_t length) {
+  int stale = 0;
+  for (uint32_t i = address; i < (uint32_t)address + length && i < MEMORY_SIZE;
+       i++) {
+    jit->written[i] = 1;
+    stale |= jit->covered[i];
+  }
+  if (stale) {
+    flush(jit);
+  }
+}
+
+void chip8_jit_discard(Chip8Jit *jit, uint16_t address, uint16_t length) {
+  int stale = 0;
+  // An instruction starting one byte before the range may have been
+  // rejected for overlapping it
+  for (uint32_t i = address ? address - 1 : 0;
+       i < (uint32_t)address + length && i < MEMORY_SIZE; i++) {
+    if (i >= address) {
+      jit->written[i] = 0;
+      stale |= jit->covered[i];
+    }
+    jit->rejected[i] = 0;
+  }
+  if (stale) {
+    flush(jit);
+  }
+}
+
+#ifdef CHIP8_STATS
+void chip8_jit_set_perf_map(Chip8Jit *jit, FILE *file) {
+  jit->perf_map = file;
+}
+#endif
+
+void chip8_attach_jit(Chip8Emulator *emulator, Chip8Jit *jit) {
+  emulator->jit = jit;
+  if (jit) {
+    chip8_jit_reset(jit);
+  }
+}
+
+uint64_t chip8_jit_run(Chip8Emulator *emulator, uint64_t cycles) {
+  Chip8Jit *jit = emulator->jit;
+  uint64_t budget = cycles;
+
+  while (cycles) {
+    uint16_t pc = emulator->pc;
+    void *entry = NULL;
+    if (pc < MEMORY_SIZE) {
+      entry = jit->table[pc];
+      if (!entry && !jit->rejected[pc]) {
+        entry = compile(jit, emulator, pc);
+      }
+    }
+
+    if (entry) {
+      jit->origin = emulator->cycles + cycles;
+      uint64_t remaining = jit->enter(emulator, cycles, entry);
+      if (remaining != cycles) {
+        // Compiled code doesn't count instructions or tick the timers as it
+        // goes, so catch up on both
+        emulator->cycles += cycles - remaining;
+        cycles = remaining;
+        chip8_catch_up_timers(emulator, emulator->cycles);
+        continue;
+      }
+    }
+
+    // Idle loops and Fx0A are left to the interpreter, which can skip them
+    if (emulator->key_wait ||
+        (pc < MEMORY_SIZE && jit->rejected[pc] == REJECTED_IDLE)) {
+      uint64_t skipped = chip8_skip_idle(emulator, cycles);
+      if (skipped) {
+        cycles -= skipped;
+        continue;
+      }
+    }
+
+    // Not compiled, or too little budget left for the whole block
+    chip8_step(emulator);
+    if (emulator->fault) {
+      break;
+    }
+    cycles -= 1;
+  }
+  return budget - cycles;
+}
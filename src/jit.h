@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "emulator.h"
+
+// Basic-block recompiler to x86-64. Straight-line runs of simple
+// instructions ending at a jump or skip are compiled to native code and
+// chained together; everything else, including any code the program has
+// written to, runs through the interpreter
+typedef struct Chip8Jit Chip8Jit;
+
+Chip8Jit *chip8_jit_create(void);
+void chip8_jit_destroy(Chip8Jit *jit);
+// Attaches a JIT, or detaches it when jit is NULL. A JIT serves one
+// emulator at a time and is reset when attached
+void chip8_attach_jit(Chip8Emulator *emulator, Chip8Jit *jit);
+// Runs `cycles` instructions, the JIT equivalent of chip8_run_batch
+uint64_t chip8_jit_run(Chip8Emulator *emulator, uint64_t cycles);
+// Forgets every compiled block, for when a new program is loaded or the
+// profile changes
+void chip8_jit_reset(Chip8Jit *jit);
+// Called when the program writes to memory[address, address + length)
+void chip8_jit_invalidate(Chip8Jit *jit, uint16_t address, uint16_t length);
+// Called when memory[address, address + length) is put back by a reset.
+// That isn't self-modification, so the code may be compiled again
+void chip8_jit_discard(Chip8Jit *jit, uint16_t address, uint16_t length);
+#ifdef CHIP8_STATS
+// Logs every block compiled from now on to file, or stops when file is
+// NULL. The lines are in the /tmp/perf-<pid>.map format perf uses to name
+// JIT code, so samples in a block show up as chip8_block_<address>
+void chip8_jit_set_perf_map(Chip8Jit *jit, FILE *file);
+#endif
@@ -0,0 +1,499 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "lockstep.h"
+
+// When the slowest live lane falls this many instructions behind the
+// fastest, it is run next even if it isn't at the lowest pc. This keeps a
+// lane spinning at a low address from starving the others
+#define MAX_LAG 1024
+
+// Lock steps between checks for a lagging lane
+#define LAG_CHECK_INTERVAL 64
+
+// Memory is indexed with wrap-around so a bad I can't leave the lane
+#define ADDRESS(a) ((a) & (MEMORY_SIZE - 1))
+
+#define LANES for (int l = 0; l < CHIP8_LANES; l++)
+
+void chip8_lockstep_init(Chip8Lockstep *lockstep, const uint8_t *program,
+                         long program_size, uint32_t seed) {
+  // Build one machine the usual way and copy it into every lane
+  Chip8Emulator emulator;
+  chip8_init_emulator(&emulator);
+  chip8_load_program(&emulator, program, program_size);
+
+  memset(lockstep, 0, sizeof(Chip8Lockstep));
+  LANES {
+    memcpy(lockstep->memory[l], emulator.memory, MEMORY_SIZE);
+    lockstep->pc[l] = emulator.pc;
+    // xorshift never leaves a zero state
+    lockstep->random_state[l] = (seed + l) ? seed + l : 1;
+  }
+}
+
+void chip8_lockstep_set_key(Chip8Lockstep *lockstep, int lane, uint8_t key,
+                            int down) {
+  key &= 0xf;
+  // A parked lane resumes past its Fx0A when a key goes up
+  uint8_t wait = lockstep->key_wait[lane];
+  if (wait && !down && lockstep->inputs[key][lane]) {
+    lockstep->registers[wait & 0xf][lane] = key;
+    lockstep->key_wait[lane] = 0;
+    lockstep->pc[lane] += 2;
+  }
+  lockstep->inputs[key][lane] = down != 0;
+}
+
+void chip8_lockstep_tick_timers(Chip8Lockstep *lockstep) {
+  LANES {
+    lockstep->delay_timer[l] -= lockstep->delay_timer[l] != 0;
+    lockstep->sound_timer[l] -= lockstep->sound_timer[l] != 0;
+  }
+}
+
+void chip8_lockstep_extract(const Chip8Lockstep *lockstep, int lane,
+                            Chip8Emulator *emulator) {
+  chip8_init_emulator(emulator);
+  memcpy(emulator->memory, lockstep->memory[lane], MEMORY_SIZE);
+  for (int i = 0; i < 16; i++) {
+    emulator->registers[i] = lockstep->registers[i][lane];
+    emulator->inputs[i] = lockstep->inputs[i][lane];
+  }
+  emulator->index_register = lockstep->index_register[lane];
+  emulator->pc = lockstep->pc[lane];
+  emulator->sp = lockstep->sp[lane];
+  for (int i = 0; i < CHIP8_LOCKSTEP_STACK_SIZE; i++) {
+    emulator->stack[i] = lockstep->stack[i][lane];
+  }
+  emulator->delay_timer = lockstep->delay_timer[lane];
+  emulator->sound_timer = lockstep->sound_timer[lane];
+  emulator->random_state = lockstep->random_state[lane];
+  emulator->cycles = lockstep->cycles[lane];
+  // Start the timer schedule over from the lane's cycle count
+  chip8_set_clock(emulator, emulator->ips);
+  for (int y = 0; y < CHIP8_DISPLAY_HEIGHT; y++) {
+    emulator->graphics[0][0][y] = lockstep->graphics[y][lane];
+  }
+  emulator->fault = lockstep->fault[lane];
+  emulator->key_wait = lockstep->key_wait[lane];
+  emulator->key_wait_cycle = emulator->cycles;
+}
+
+// Lane masks are 0xff for lanes that run the instruction and 0 for lanes
+// that sit it out. Updates are written as bitwise blends rather than
+// branches or ternaries so the compiler emits vector code for them
+#define BLEND(mask, a, b) (uint8_t)(((a) & (mask)) | ((b) & ~(mask)))
+#define BLEND16(mask, a, b)                                                    \
+  (uint16_t)(((a) & (uint16_t)(int8_t)(mask)) |                                \
+             ((b) & ~(uint16_t)(int8_t)(mask)))
+// 0xff when cond holds, 0 otherwise
+#define MASK(cond) ((uint8_t) - (uint8_t)(cond))
+
+// 8xyN across the lanes. Each lane is updated in the same order the
+// interpreter uses, so the results match when VF is also an operand. When
+// x, y and VF are three different registers the restrict version lets the
+// compiler vectorize the loops
+#define DEFINE_ARITHMETIC(name, qualifier)                                     \
+  static void name(uint8_t operation, uint8_t *qualifier vx,                   \
+                   uint8_t *qualifier vy, uint8_t *qualifier vf,               \
+                   const uint8_t *qualifier mask) {                            \
+    switch (operation) {                                                       \
+    case 0x0:                                                                  \
+      LANES { vx[l] = BLEND(mask[l], vy[l], vx[l]); }                          \
+      break;                                                                   \
+    case 0x1:                                                                  \
+      LANES { vx[l] = BLEND(mask[l], vx[l] | vy[l], vx[l]); }                  \
+      break;                                                                   \
+    case 0x2:                                                                  \
+      LANES { vx[l] = BLEND(mask[l], vx[l] & vy[l], vx[l]); }                  \
+      break;                                                                   \
+    case 0x3:                                                                  \
+      LANES { vx[l] = BLEND(mask[l], vx[l] ^ vy[l], vx[l]); }                  \
+      break;                                                                   \
+    case 0x4:                                                                  \
+      LANES {                                                                  \
+        uint8_t x = vx[l];                                                     \
+        uint8_t sum = x + vy[l];                                               \
+        vx[l] = BLEND(mask[l], sum, vx[l]);                                    \
+        vf[l] = BLEND(mask[l], sum < x, vf[l]);                                \
+      }                                                                        \
+      break;                                                                   \
+    case 0x5:                                                                  \
+      LANES {                                                                  \
+        uint8_t x = vx[l];                                                     \
+        uint8_t y = vy[l];                                                     \
+        vx[l] = BLEND(mask[l], x - y, vx[l]);                                  \
+        vf[l] = BLEND(mask[l], x >= y, vf[l]);                                 \
+      }                                                                        \
+      break;                                                                   \
+    case 0x6:                                                                  \
+      LANES {                                                                  \
+        vx[l] = BLEND(mask[l], vy[l], vx[l]);                                  \
+        vf[l] = BLEND(mask[l], vx[l] & 0x01, vf[l]);                           \
+        vx[l] = BLEND(mask[l], vx[l] >> 1, vx[l]);                             \
+      }                                                                        \
+      break;                                                                   \
+    case 0x7:                                                                  \
+      LANES {                                                                  \
+        uint8_t x = vx[l];                                                     \
+        uint8_t y = vy[l];                                                     \
+        uint8_t no_borrow = MASK(y >= x);                                      \
+        /* Without a borrow VF is cleared before Vx is read again */           \
+        vf[l] = BLEND(mask[l], no_borrow & 1, vf[l]);                          \
+        vx[l] = BLEND(mask[l], y - BLEND(no_borrow, x, vx[l]), vx[l]);         \
+        vf[l] = BLEND(mask[l] & no_borrow, 1, vf[l]);                          \
+      }                                                                        \
+      break;                                                                   \
+    case 0xe:                                                                  \
+      LANES {                                                                  \
+        vx[l] = BLEND(mask[l], vy[l], vx[l]);                                  \
+        uint8_t shifted = vx[l] >> 7;                                          \
+        vx[l] = BLEND(mask[l], vx[l] << 1, vx[l]);                             \
+        vf[l] = BLEND(mask[l], shifted, vf[l]);                                \
+      }                                                                        \
+      break;                                                                   \
+    }                                                                          \
+  }
+
+DEFINE_ARITHMETIC(arithmetic_distinct, restrict)
+DEFINE_ARITHMETIC(arithmetic_aliased, )
+
+static void arithmetic(Chip8Lockstep *lockstep, uint16_t ins,
+                       const uint8_t *mask) {
+  uint8_t x = (ins & 0x0f00) >> 8;
+  uint8_t y = (ins & 0x00f0) >> 4;
+  uint8_t *vx = lockstep->registers[x];
+  uint8_t *vy = lockstep->registers[y];
+  uint8_t *vf = lockstep->registers[0xf];
+
+  if (x != y && x != 0xf && y != 0xf) {
+    arithmetic_distinct(ins & 0xf, vx, vy, vf, mask);
+  } else {
+    arithmetic_aliased(ins & 0xf, vx, vy, vf, mask);
+  }
+}
+
+static void draw(Chip8Lockstep *lockstep, uint16_t ins, const uint8_t *mask) {
+  uint8_t x = (ins & 0x0f00) >> 8;
+  uint8_t y = (ins & 0x00f0) >> 4;
+  uint8_t height = ins & 0xf;
+
+  // Each lane draws at its own position from its own memory, so the rows
+  // are gathered lane by lane
+  LANES {
+    if (!mask[l]) {
+      continue;
+    }
+    lockstep->registers[0xf][l] = 0;
+    uint16_t column = lockstep->registers[x][l] & 63;
+    uint16_t row = lockstep->registers[y][l] & 31;
+    uint8_t collision = 0;
+    for (int i = 0; i < height && row < CHIP8_DISPLAY_HEIGHT; i++, row++) {
+      uint64_t data = lockstep->memory[l][ADDRESS(
+          lockstep->index_register[l] + i)];
+      uint64_t new_bytes = (data << 56) >> column;
+      collision |= (new_bytes & lockstep->graphics[row][l]) != 0;
+      lockstep->graphics[row][l] ^= new_bytes;
+    }
+    lockstep->registers[0xf][l] = collision;
+  }
+}
+
+static void execute_e(Chip8Lockstep *lockstep, uint16_t ins,
+                      const uint8_t *mask) {
+  uint8_t *vx = lockstep->registers[(ins & 0x0f00) >> 8];
+  uint8_t want = (ins & 0xff) == 0x9e;
+  if ((ins & 0xff) != 0x9e && (ins & 0xff) != 0xa1) {
+    printf("unrecognized instruction %x\n", ins);
+    return;
+  }
+  LANES {
+    uint8_t down = lockstep->inputs[vx[l] & 0xf][l] != 0;
+    lockstep->pc[l] += mask[l] & MASK(down == want) & 2;
+  }
+}
+
+static void execute_f(Chip8Lockstep *lockstep, uint16_t ins,
+                      const uint8_t *mask) {
+  uint8_t x = (ins & 0x0f00) >> 8;
+  uint8_t *vx = lockstep->registers[x];
+
+  switch (ins & 0xff) {
+  case 0x07:
+    LANES { vx[l] = BLEND(mask[l], lockstep->delay_timer[l], vx[l]); }
+    break;
+  case 0x0a:
+    // Park on the Fx0A until a key goes up
+    LANES {
+      lockstep->pc[l] -= mask[l] & 2;
+      lockstep->key_wait[l] =
+          BLEND(mask[l], CHIP8_KEY_WAIT | x, lockstep->key_wait[l]);
+    }
+    break;
+  case 0x15:
+    LANES {
+      lockstep->delay_timer[l] =
+          BLEND(mask[l], vx[l], lockstep->delay_timer[l]);
+    }
+    break;
+  case 0x18:
+    LANES {
+      lockstep->sound_timer[l] =
+          BLEND(mask[l], vx[l], lockstep->sound_timer[l]);
+    }
+    break;
+  case 0x1e:
+    LANES {
+      lockstep->index_register[l] += vx[l] & mask[l];
+    }
+    break;
+  case 0x29:
+    LANES {
+      uint16_t font = CHIP8_FONT_OFFSET + (vx[l] & 0xf) * CHIP8_FONT_SIZE;
+      lockstep->index_register[l] =
+          BLEND16(mask[l], font, lockstep->index_register[l]);
+    }
+    break;
+  case 0x33:
+    lockstep->memory_written = 1;
+    LANES {
+      if (mask[l]) {
+        uint16_t i = lockstep->index_register[l];
+        lockstep->memory[l][ADDRESS(i)] = vx[l] / 100;
+        lockstep->memory[l][ADDRESS(i + 1)] = vx[l] / 10 % 10;
+        lockstep->memory[l][ADDRESS(i + 2)] = vx[l] % 10;
+      }
+    }
+    break;
+  case 0x55:
+    lockstep->memory_written = 1;
+    LANES {
+      if (mask[l]) {
+        for (int r = 0; r <= x; r++) {
+          lockstep->memory[l][ADDRESS(lockstep->index_register[l] + r)] =
+              lockstep->registers[r][l];
+        }
+      }
+    }
+    break;
+  case 0x65:
+    LANES {
+      if (mask[l]) {
+        for (int r = 0; r <= x; r++) {
+          lockstep->registers[r][l] =
+              lockstep->memory[l][ADDRESS(lockstep->index_register[l] + r)];
+        }
+      }
+    }
+    break;
+  default:
+    printf("unrecognized instruction %x\n", ins);
+    break;
+  }
+}
+
+// Runs ins on every lane in mask. pc has already moved past it
+static void execute(Chip8Lockstep *lockstep, uint16_t ins,
+                    const uint8_t *mask) {
+  uint8_t x = (ins & 0x0f00) >> 8;
+  uint8_t y = (ins & 0x00f0) >> 4;
+  uint8_t nn = ins & 0x00ff;
+  uint16_t nnn = ins & 0x0fff;
+  uint8_t *vx = lockstep->registers[x];
+  uint8_t *vy = lockstep->registers[y];
+
+  switch (ins >> 12) {
+  case 0x0:
+    if (ins == 0x00e0) {
+      for (int row = 0; row < CHIP8_DISPLAY_HEIGHT; row++) {
+        LANES {
+          lockstep->graphics[row][l] &= ~(uint64_t)(int8_t)mask[l];
+        }
+      }
+    } else if (ins == 0x00ee) {
+      LANES {
+        if (!mask[l]) {
+          continue;
+        }
+        if (lockstep->sp[l] == 0) {
+          lockstep->fault[l] = CHIP8_FAULT_STACK_UNDERFLOW;
+          continue;
+        }
+        lockstep->sp[l] -= 1;
+        lockstep->pc[l] = lockstep->stack[lockstep->sp[l]][l];
+      }
+    } else {
+      printf("unrecognized instruction %x\n", ins);
+    }
+    break;
+  case 0x1:
+    LANES { lockstep->pc[l] = BLEND16(mask[l], nnn, lockstep->pc[l]); }
+    break;
+  case 0x2:
+    LANES {
+      if (!mask[l]) {
+        continue;
+      }
+      if (lockstep->sp[l] >= CHIP8_LOCKSTEP_STACK_SIZE) {
+        lockstep->fault[l] = CHIP8_FAULT_STACK_OVERFLOW;
+        continue;
+      }
+      lockstep->stack[lockstep->sp[l]][l] = lockstep->pc[l];
+      lockstep->sp[l] += 1;
+      lockstep->pc[l] = nnn;
+    }
+    break;
+  case 0x3:
+    LANES { lockstep->pc[l] += mask[l] & MASK(vx[l] == nn) & 2; }
+    break;
+  case 0x4:
+    LANES { lockstep->pc[l] += mask[l] & MASK(vx[l] != nn) & 2; }
+    break;
+  case 0x5:
+    LANES { lockstep->pc[l] += mask[l] & MASK(vx[l] == vy[l]) & 2; }
+    break;
+  case 0x6:
+    LANES { vx[l] = BLEND(mask[l], nn, vx[l]); }
+    break;
+  case 0x7:
+    LANES { vx[l] = BLEND(mask[l], vx[l] + nn, vx[l]); }
+    break;
+  case 0x8:
+    arithmetic(lockstep, ins, mask);
+    break;
+  case 0x9:
+    LANES { lockstep->pc[l] += mask[l] & MASK(vx[l] != vy[l]) & 2; }
+    break;
+  case 0xa:
+    LANES {
+      lockstep->index_register[l] =
+          BLEND16(mask[l], nnn, lockstep->index_register[l]);
+    }
+    break;
+  case 0xb:
+    LANES {
+      lockstep->pc[l] =
+          BLEND16(mask[l], lockstep->registers[0][l] + nnn, lockstep->pc[l]);
+    }
+    break;
+  case 0xc:
+    LANES {
+      uint32_t state = lockstep->random_state[l];
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      uint32_t keep = (uint32_t)(int8_t)mask[l];
+      lockstep->random_state[l] =
+          (state & keep) | (lockstep->random_state[l] & ~keep);
+      vx[l] = BLEND(mask[l], state & nn, vx[l]);
+    }
+    break;
+  case 0xd:
+    draw(lockstep, ins, mask);
+    break;
+  case 0xe:
+    execute_e(lockstep, ins, mask);
+    break;
+  default:
+    execute_f(lockstep, ins, mask);
+    break;
+  }
+}
+
+// Live lanes are the ones that haven't faulted or parked on Fx0A
+#define LIVE(lockstep, l) (!(lockstep)->fault[l] && !(lockstep)->key_wait[l])
+
+// Lowest pc among the live lanes, or 0xffff when there are none
+static uint16_t lowest_pc(const Chip8Lockstep *lockstep) {
+  uint16_t lowest = 0xffff;
+  LANES {
+    uint16_t pc = lockstep->pc[l] | (uint16_t)(int8_t)MASK(!LIVE(lockstep, l));
+    lowest = pc < lowest ? pc : lowest;
+  }
+  return lowest;
+}
+
+// The pc of the live lane furthest behind if it trails the furthest ahead
+// by more than MAX_LAG instructions, otherwise -1
+static int32_t lagging_pc(const Chip8Lockstep *lockstep) {
+  int behind = -1;
+  uint64_t fastest = 0;
+  LANES {
+    if (!LIVE(lockstep, l)) {
+      continue;
+    }
+    if (behind == -1 || lockstep->cycles[l] < lockstep->cycles[behind]) {
+      behind = l;
+    }
+    if (lockstep->cycles[l] > fastest) {
+      fastest = lockstep->cycles[l];
+    }
+  }
+  if (behind != -1 && fastest - lockstep->cycles[behind] > MAX_LAG) {
+    return lockstep->pc[behind];
+  }
+  return -1;
+}
+
+uint64_t chip8_lockstep_run(Chip8Lockstep *lockstep, uint64_t steps) {
+  uint64_t total = 0;
+
+  for (uint64_t step = 0; step < steps; step++) {
+    // Normally run the lowest pc, and now and then give a lane that has
+    // fallen far behind its turn
+    int32_t leader = -1;
+    if (step % LAG_CHECK_INTERVAL == 0) {
+      leader = lagging_pc(lockstep);
+    }
+    if (leader == -1) {
+      leader = lowest_pc(lockstep);
+      if (leader == 0xffff) {
+        break;
+      }
+    }
+
+    uint8_t mask[CHIP8_LANES];
+    if (leader + 1 >= MEMORY_SIZE) {
+      LANES {
+        if (LIVE(lockstep, l) && lockstep->pc[l] == leader) {
+          lockstep->fault[l] = CHIP8_FAULT_PC_OUT_OF_RANGE;
+        }
+      }
+      continue;
+    }
+
+    LANES { mask[l] = MASK(LIVE(lockstep, l) && lockstep->pc[l] == leader); }
+
+    // The first lane at the leader's pc decides the instruction
+    int first = 0;
+    while (!mask[first]) {
+      first++;
+    }
+    uint16_t ins = (lockstep->memory[first][leader] << 8) |
+                   lockstep->memory[first][leader + 1];
+
+    // Once the lanes have written to memory their code may differ, so lanes
+    // with a different instruction at that pc wait for their own turn
+    if (lockstep->memory_written) {
+      LANES {
+        uint16_t lane_ins = (lockstep->memory[l][leader] << 8) |
+                            lockstep->memory[l][leader + 1];
+        mask[l] &= MASK(lane_ins == ins);
+      }
+    }
+
+    uint32_t active = 0;
+    LANES {
+      lockstep->pc[l] += mask[l] & 2;
+      lockstep->cycles[l] += mask[l] & 1;
+      active += mask[l] & 1;
+    }
+
+    execute(lockstep, ins, mask);
+    total += active;
+  }
+  return total;
+}
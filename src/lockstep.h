@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Number of instances run side by side, set by CHIP8_LOCKSTEP_LANES in CMake
+#ifndef CHIP8_LANES
+#define CHIP8_LANES 16
+#endif
+
+// Return stack depth for each lane
+#define CHIP8_LOCKSTEP_STACK_SIZE STACK_SIZE
+
+// Runs CHIP8_LANES copies of one program in lock step. State is stored
+// structure-of-arrays, one array entry per lane, so each instruction is
+// applied to every lane with a single masked loop the compiler can turn
+// into vector instructions. Lanes that branch away from the others are
+// masked off and wait; every step runs the lowest pc among the live lanes,
+// which pulls diverged lanes back together at the next common address.
+// A lane that runs Fx0A parks on it, like the interpreter, and sits out
+// until chip8_lockstep_set_key lets a key go up on it. Only the CHIP-8
+// instruction set and its 64x32 display are supported
+typedef struct Lockstep {
+  uint8_t registers[16][CHIP8_LANES];
+  uint16_t index_register[CHIP8_LANES];
+  uint16_t pc[CHIP8_LANES];
+  uint16_t sp[CHIP8_LANES];
+  uint8_t delay_timer[CHIP8_LANES];
+  uint8_t sound_timer[CHIP8_LANES];
+  // Per-lane xorshift state for Cxnn
+  uint32_t random_state[CHIP8_LANES];
+  // Instructions each lane has run
+  uint64_t cycles[CHIP8_LANES];
+  uint8_t fault[CHIP8_LANES];
+  // While Fx0A waits for a key, CHIP8_KEY_WAIT | x, otherwise 0
+  uint8_t key_wait[CHIP8_LANES];
+  // Set once any lane has stored to memory, after which lanes may no
+  // longer share the same code
+  uint8_t memory_written;
+  uint8_t inputs[16][CHIP8_LANES];
+  uint16_t stack[CHIP8_LOCKSTEP_STACK_SIZE][CHIP8_LANES];
+  uint64_t graphics[CHIP8_DISPLAY_HEIGHT][CHIP8_LANES];
+  // Memory is addressed through each lane's own I, so it stays per lane
+  uint8_t memory[CHIP8_LANES][MEMORY_SIZE];
+} Chip8Lockstep;
+
+// Loads the program into every lane, seeding lane i's random numbers
+// with seed + i
+void chip8_lockstep_init(Chip8Lockstep *lockstep, const uint8_t *program,
+                         long program_size, uint32_t seed);
+// Runs `steps` lock steps. Returns how many lane-instructions ran in total,
+// which is at most steps * CHIP8_LANES
+uint64_t chip8_lockstep_run(Chip8Lockstep *lockstep, uint64_t steps);
+// Presses or releases a key on one lane, as chip8_set_key does
+void chip8_lockstep_set_key(Chip8Lockstep *lockstep, int lane, uint8_t key,
+                            int down);
+// Decrements every lane's nonzero timers, once per 60 Hz frame
+void chip8_lockstep_tick_timers(Chip8Lockstep *lockstep);
+// Copies one lane out into a regular emulator, e.g. to hash its display
+void chip8_lockstep_extract(const Chip8Lockstep *lockstep, int lane,
+                            Chip8Emulator *emulator);
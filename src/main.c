@@ -1,24 +1,343 @@
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "SDL.h"
 
+#include "SDL_audio.h"
 #include "SDL_events.h"
+#include "SDL_mutex.h"
 #include "SDL_pixels.h"
 #include "SDL_render.h"
 #include "SDL_stdinc.h"
 #include "SDL_surface.h"
+#include "SDL_thread.h"
 #include "SDL_timer.h"
 #include "SDL_video.h"
+#include "audio.h"
 #include "emulator.h"
+#include "input_log.h"
+#include "phosphor.h"
+#include "profile.h"
+#include "render.h"
+#include "rewind.h"
+#include "triple_buffer.h"
 
 const int SCREEN_WIDTH = 1280;
 const int SCREEN_HEIGHT = 640;
 
+// Emulated frames per second
+#define FRAME_HZ CHIP8_TIMER_HZ
+// How far behind schedule we let the emulation fall before giving up on
+// catching up, e.g. after the window was dragged or the machine slept
+#define MAX_CATCH_UP_FRAMES 4
+#define DEFAULT_REWIND_SECONDS 10
+// Emulated frames between full snapshots in the rewind buffer
+#define REWIND_KEYFRAME_INTERVAL 60
+// 256 samples at 48 kHz is about 5 ms of buffered sound
+#define AUDIO_SAMPLE_RATE 48000
+#define AUDIO_BUFFER_SAMPLES 256
+// How often a fading phosphor is stepped when no new frame comes, in ms
+#define PHOSPHOR_STEP_MS (1000 / FRAME_HZ)
+
+// The CHIP-8 key each host key stands for, in the usual 4x4 layout
+// starting at 1 and ending at V
+static const SDL_Keycode KEYMAP[16] = {
+    [0x1] = SDLK_1, [0x2] = SDLK_2, [0x3] = SDLK_3, [0xc] = SDLK_4,
+    [0x4] = SDLK_q, [0x5] = SDLK_w, [0x6] = SDLK_e, [0xd] = SDLK_r,
+    [0x7] = SDLK_a, [0x8] = SDLK_s, [0x9] = SDLK_d, [0xe] = SDLK_f,
+    [0xa] = SDLK_z, [0x0] = SDLK_x, [0xb] = SDLK_c, [0xf] = SDLK_v,
+};
+
+typedef struct Options {
+  const char *program;
+  // Instructions per second, 0 = as fast as possible
+  uint64_t ips;
+  // Paces drawing only, the emulation keeps its own time
+  int vsync;
+  // How much history Backspace can rewind through, 0 = off
+  unsigned rewind_seconds;
+  // Where to save an input log of the session, or NULL
+  const char *record;
+  uint32_t seed;
+  int mute;
+  // A Chip8Profile, or -1 to look the program up in `profiles`
+  int profile;
+  // Profile database, or NULL to run under the default profile
+  const char *profiles;
+  // Half-life of the display's afterglow in ms, or the frames a pixel
+  // stays on for. At most one of them is set, 0 = raw display
+  unsigned phosphor;
+  unsigned phosphor_frames;
+} Options;
+
+static void print_usage(const char *name) {
+  printf("Usage: %s <program> [--ips N | --ips unlimited] [--vsync] "
+         "[--rewind SECONDS] [--record FILE] [--seed N] [--mute] "
+         "[--profile NAME | --profiles FILE] "
+         "[--phosphor MS | --phosphor-frames N]\n",
+         name);
+}
+
+static int parse_options(int argc, char **argv, Options *options) {
+  options->program = NULL;
+  options->ips = CHIP8_DEFAULT_IPS;
+  options->vsync = 0;
+  options->rewind_seconds = DEFAULT_REWIND_SECONDS;
+  options->record = NULL;
+  options->seed = CHIP8_DEFAULT_SEED;
+  options->mute = 0;
+  options->profile = -1;
+  options->profiles = NULL;
+  options->phosphor = 0;
+  options->phosphor_frames = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--vsync") == 0) {
+      options->vsync = 1;
+    } else if (strcmp(argv[i], "--mute") == 0) {
+      options->mute = 1;
+    } else if (strcmp(argv[i], "--ips") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "unlimited") == 0) {
+        options->ips = 0;
+      } else {
+        options->ips = strtoull(argv[i], NULL, 10);
+        // At least one instruction per frame
+        if (options->ips < FRAME_HZ) {
+          return -1;
+        }
+      }
+    } else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc) {
+      options->rewind_seconds = (unsigned)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      options->record = argv[++i];
+    } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+      options->seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      options->profile = chip8_parse_profile(argv[++i]);
+      if (options->profile == -1) {
+        return -1;
+      }
+    } else if (strcmp(argv[i], "--profiles") == 0 && i + 1 < argc) {
+      options->profiles = argv[++i];
+    } else if (strcmp(argv[i], "--phosphor") == 0 && i + 1 < argc) {
+      options->phosphor = (unsigned)strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--phosphor-frames") == 0 && i + 1 < argc) {
+      options->phosphor_frames = (unsigned)strtoul(argv[++i], NULL, 10);
+      if (options->phosphor_frames > CHIP8_PHOSPHOR_MAX_FRAMES) {
+        return -1;
+      }
+    } else if (argv[i][0] != '-' && !options->program) {
+      options->program = argv[i];
+    } else {
+      return -1;
+    }
+  }
+  if ((options->profile != -1 && options->profiles) ||
+      (options->phosphor && options->phosphor_frames)) {
+    return -1;
+  }
+  return options->program ? 0 : -1;
+}
+
+// Instructions in the next frame. ips rarely divides evenly into frames,
+// so the remainder is carried over, which puts the end of frame k at cycle
+// k * ips / 60 just like an input log replay expects
+static uint64_t frame_cycles(uint64_t ips, uint64_t *remainder) {
+  uint64_t cycles = ips + *remainder;
+  *remainder = cycles % FRAME_HZ;
+  return cycles / FRAME_HZ;
+}
+
+// Runs one emulated frame's worth of instructions, which ends on a timer
+// tick, and records the frame for rewinding. Key changes since the last
+// frame go into the input log first
+static void run_frame(Chip8Emulator *emulator, uint64_t cycles,
+                      Chip8Rewind *rewind, Chip8InputLog *log) {
+  if (log && chip8_input_log_record(log, emulator) == -1) {
+    puts("Out of memory for the input log");
+  }
+  chip8_run_batch(emulator, cycles);
+  if (rewind) {
+    chip8_rewind_push(rewind, emulator);
+  }
+}
+
+// Runs on SDL's audio thread
+static void audio_callback(void *userdata, Uint8 *stream, int length) {
+  chip8_audio_render(userdata, (int16_t *)stream, length / sizeof(int16_t));
+}
+
+// Opens the default device with the callback playing audio. Returns 0 if
+// there is no sound to be had, which isn't worth stopping for
+static SDL_AudioDeviceID open_audio(Chip8Audio *audio, uint32_t ips) {
+  if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0) {
+    printf("No sound, SDL_Error: %s\n", SDL_GetError());
+    return 0;
+  }
+  SDL_AudioSpec want = {
+      .freq = AUDIO_SAMPLE_RATE,
+      .format = AUDIO_S16SYS,
+      .channels = 1,
+      .samples = AUDIO_BUFFER_SAMPLES,
+      .callback = audio_callback,
+      .userdata = audio,
+  };
+  SDL_AudioSpec have;
+  SDL_AudioDeviceID device = SDL_OpenAudioDevice(
+      NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if (!device) {
+    printf("No sound, SDL_Error: %s\n", SDL_GetError());
+    return 0;
+  }
+  chip8_audio_init(audio, ips, have.freq);
+  return device;
+}
+
+// What the render thread and the emulation thread share. Everything else
+// in it belongs to the emulation thread while it runs
+typedef struct Session {
+  const Options *options;
+  Chip8Emulator *emulator;
+  uint64_t ips;
+  Chip8Rewind *rewind;
+  Chip8InputLog *log;
+  Chip8Audio *audio;
+  Chip8TripleBuffer frames;
+  // The SDL event the emulation thread sends when it publishes a frame,
+  // and whether one is already waiting, so at most one is queued
+  Uint32 frame_event;
+  _Atomic int frame_pending;
+  // Bit i set = CHIP-8 key i is held
+  _Atomic uint16_t keys;
+  // Set while Backspace is held
+  _Atomic int rewinding;
+  _Atomic int quit;
+  // Posted on every key change and on quitting, to wake an emulation
+  // thread parked on Fx0A
+  SDL_sem *wake;
+} Session;
+
+// Wakes the render thread for a new frame. The exchange pairs with the one
+// in main, so either it sees the frame or an event is sent
+static void notify_frame(Session *session) {
+  if (atomic_exchange(&session->frame_pending, 1)) {
+    return;
+  }
+  SDL_Event event = {.type = session->frame_event};
+  SDL_PushEvent(&event);
+}
+
+// The emulation thread. Keeps to its own schedule however long drawing
+// takes, and publishes every frame that changed the display
+static int emulate(void *data) {
+  Session *session = data;
+  const Options *options = session->options;
+  Chip8Emulator *emulator = session->emulator;
+  uint64_t ips = session->ips;
+  Chip8Rewind *rewind = session->rewind;
+  uint16_t keys = 0;
+
+  uint64_t frequency = SDL_GetPerformanceFrequency();
+  uint64_t frame_ticks = frequency / FRAME_HZ;
+  uint64_t deadline = SDL_GetPerformanceCounter() + frame_ticks;
+  uint64_t cycle_remainder = 0;
+
+  while (!atomic_load_explicit(&session->quit, memory_order_relaxed)) {
+    // Parked on Fx0A with no timer left to count down, nothing can happen
+    // until a key changes, so sleep until one does rather than running
+    // empty frames. Emulated time stands still meanwhile, which the
+    // program can't tell
+    if (emulator->key_wait && !emulator->delay_timer &&
+        !emulator->sound_timer &&
+        !atomic_load_explicit(&session->rewinding, memory_order_relaxed) &&
+        atomic_load_explicit(&session->keys, memory_order_relaxed) == keys) {
+      SDL_SemWait(session->wake);
+      deadline = SDL_GetPerformanceCounter() + frame_ticks;
+      continue;
+    }
+
+    // Set when an unthrottled run stops at a loop that waits for keys
+    int idle = 0;
+    // Keys change between frames, where an input log replays them
+    uint16_t down = atomic_load_explicit(&session->keys, memory_order_relaxed);
+    for (uint8_t i = 0; i < 16; i++) {
+      if ((down ^ keys) >> i & 1) {
+        chip8_set_key(emulator, i, down >> i & 1);
+      }
+    }
+    keys = down;
+
+    if (rewind &&
+        atomic_load_explicit(&session->rewinding, memory_order_relaxed)) {
+      // One frame back per host frame. The snapshot's display replaces
+      // ours wholesale, so redraw all of it
+      if (chip8_rewind_pop(rewind, emulator) == 0) {
+        emulator->dirty_rows = UINT32_MAX;
+      }
+    } else if (!emulator->fault) {
+      if (options->ips) {
+        run_frame(emulator, frame_cycles(ips, &cycle_remainder), rewind,
+                  session->log);
+      } else {
+        // Unthrottled, so keep running whole frames until this host frame
+        // is used up. A loop that doesn't read the delay timer can only end
+        // on a key press, which isn't looked at before the next host frame
+        int flags;
+        do {
+          run_frame(emulator, frame_cycles(ips, &cycle_remainder), rewind,
+                    session->log);
+          flags = chip8_idle_loop(emulator);
+          idle = flags && !(flags & CHIP8_IDLE_TIMER);
+        } while (!emulator->fault && !idle &&
+                 SDL_GetPerformanceCounter() < deadline);
+      }
+    }
+    if (session->audio) {
+      chip8_audio_sync(session->audio, emulator);
+    }
+    if (chip8_triple_buffer_publish(&session->frames, emulator)) {
+      notify_frame(session);
+    }
+    // 00FD ends the program the same way closing the window does
+    if (emulator->fault == CHIP8_FAULT_EXIT) {
+      SDL_Event event = {.type = SDL_QUIT};
+      SDL_PushEvent(&event);
+      break;
+    }
+
+    uint64_t now = SDL_GetPerformanceCounter();
+    if ((options->ips || idle) && now < deadline) {
+      SDL_Delay((Uint32)((deadline - now) * 1000 / frequency));
+    }
+    deadline += frame_ticks;
+    if (now > deadline + MAX_CATCH_UP_FRAMES * frame_ticks) {
+      deadline = now + frame_ticks;
+    }
+  }
+  return 0;
+}
+
+static void present(SDL_Renderer *renderer, const Chip8Display *display) {
+  SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xff);
+  SDL_RenderClear(renderer);
+  chip8_render_display(renderer, SCREEN_WIDTH, SCREEN_HEIGHT, display);
+  // chip8_render_grid(renderer, SCREEN_WIDTH, SCREEN_HEIGHT);
+  SDL_RenderPresent(renderer);
+}
+
 int main(int argc, char **argv) {
   SDL_Window *window;
   SDL_Renderer *renderer;
 
+  Options options;
+  if (parse_options(argc, argv, &options) == -1) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
   if (SDL_Init(SDL_INIT_VIDEO) < 0) {
     printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
     exit(EXIT_FAILURE);
@@ -32,207 +351,233 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+  Uint32 renderer_flags = SDL_RENDERER_ACCELERATED;
+  if (options.vsync) {
+    renderer_flags |= SDL_RENDERER_PRESENTVSYNC;
+  }
+  renderer = SDL_CreateRenderer(window, -1, renderer_flags);
   if (!renderer) {
     printf("Could not initialize renderer\n");
     exit(EXIT_FAILURE);
   }
 
-  Chip8Emulator emulator;
+  Chip8Display display;
+  if (chip8_display_init(&display, renderer) == -1) {
+    printf("Could not create display texture: %s\n", SDL_GetError());
+    exit(EXIT_FAILURE);
+  }
+
+  static Chip8Emulator emulator;
+  static Chip8DecodeCache decode_cache;
   chip8_init_emulator(&emulator);
+  chip8_attach_decode_cache(&emulator, &decode_cache);
 
-  // check that the user provides a file
-  if (argc < 2) {
-    puts("Please point the emulator to a program file");
+  uint8_t buffer[MAX_PROGRAM_SIZE];
+  long file_len = chip8_read_program(options.program, buffer);
+  if (file_len == -1) {
+    printf("Failed to load program: %s\n", options.program);
     return EXIT_FAILURE;
   }
-  FILE *program;
-  program = fopen(argv[1], "rb");
-  if (!program) {
-    printf("Failed to open file: %s", argv[1]);
-    goto Error;
-  }
-  fseek(program, 0, SEEK_END);
-  long file_len = ftell(program);
-  if (file_len > MAX_PROGRAM_SIZE || file_len == -1) {
-    puts("The program provided may be too large");
-    goto Error;
+
+  Chip8Profile profile = CHIP8_PROFILE_DEFAULT;
+  if (options.profile != -1) {
+    profile = options.profile;
+  } else if (options.profiles) {
+    Chip8ProfileDatabase database;
+    if (chip8_profile_database_load(&database, options.profiles) == -1) {
+      printf("Failed to load profiles: %s\n", options.profiles);
+      return EXIT_FAILURE;
+    }
+    profile = chip8_profile_lookup(&database, buffer, file_len);
+    chip8_profile_database_free(&database);
   }
-  rewind(program);
-  uint8_t buffer[4096];
-  fread(buffer, file_len, 1, program);
-  fclose(program);
+  chip8_set_profile(&emulator, profile);
 
   chip8_load_program(&emulator, buffer, file_len);
+  chip8_seed_random(&emulator, options.seed);
+
+  // Unthrottled runs still count emulated time at the default rate, so the
+  // timers tick just as often per instruction however fast they run
+  uint64_t ips = options.ips ? options.ips : CHIP8_DEFAULT_IPS;
+  chip8_set_clock(&emulator, ips);
+
+  Chip8InputLog log_buffer;
+  Chip8InputLog *log = NULL;
+  if (options.record) {
+    chip8_input_log_init(&log_buffer, options.seed, ips, profile,
+                         chip8_input_log_program_hash(buffer, file_len));
+    log = &log_buffer;
+    if (options.rewind_seconds) {
+      // Going back in time can't be replayed from a log of keys
+      puts("Rewind is disabled while recording");
+      options.rewind_seconds = 0;
+    }
+  }
 
-  SDL_Event window_event;
-  int running = 1;
-
-  uint64_t timer = SDL_GetTicks64();
-
-  while(running) {
-    uint64_t current_time = SDL_GetTicks64();
-    uint64_t delta_time = current_time - timer;
-    timer = current_time;
-    
-    while (SDL_PollEvent(&window_event)) {
-      switch (window_event.type) {
-      case SDL_QUIT:
-        running = 0;
-        break;
-      case SDL_KEYDOWN:
-      switch (window_event.key.keysym.sym) {
-        case SDLK_1:
-        emulator.inputs[1] = 1;
-        break;
-        
-        case SDLK_2:
-        emulator.inputs[2] = 1;
-        break;
-
-        case SDLK_3:
-        emulator.inputs[3] = 1;
-        break;
-
-        case SDLK_4:
-        emulator.inputs[0xc] = 1;
-        break;
-
-        case SDLK_q:
-        emulator.inputs[0x4] = 1;
-        break;
-
-        case SDLK_w:
-        emulator.inputs[0x5] = 1;
-        break;
-
-        case SDLK_e:
-        emulator.inputs[0x6] = 1;
-        break;
-
-        case SDLK_r:
-        emulator.inputs[0xd] = 1;
-        break;
-
-        case SDLK_a:
-        emulator.inputs[0x7] = 1;
-        break;
-
-        case SDLK_s:
-        emulator.inputs[0x8] = 1;
-        break;
-
-        case SDLK_d:
-        emulator.inputs[0x9] = 1;
-        break;
+  static Chip8Audio audio_buffer;
+  Chip8Audio *audio = NULL;
+  SDL_AudioDeviceID audio_device = 0;
+  if (!options.mute) {
+    audio_device = open_audio(&audio_buffer, ips);
+  }
+  if (audio_device) {
+    audio = &audio_buffer;
+    chip8_attach_audio(&emulator, audio);
+    SDL_PauseAudioDevice(audio_device, 0);
+  }
 
-        case SDLK_f:
-        emulator.inputs[0xe] = 1;
-        break;
+  Chip8Rewind rewind_buffer;
+  Chip8Rewind *rewind = NULL;
+  if (options.rewind_seconds) {
+    if (chip8_rewind_init(&rewind_buffer, options.rewind_seconds * FRAME_HZ,
+                          REWIND_KEYFRAME_INTERVAL) == -1) {
+      puts("Could not allocate the rewind buffer");
+      return EXIT_FAILURE;
+    }
+    rewind = &rewind_buffer;
+  }
 
-        case SDLK_z:
-        emulator.inputs[0xa] = 1;
-        break;
+  static Session session;
+  session.options = &options;
+  session.emulator = &emulator;
+  session.ips = ips;
+  session.rewind = rewind;
+  session.log = log;
+  session.audio = audio;
+  chip8_triple_buffer_init(&session.frames);
+  session.wake = SDL_CreateSemaphore(0);
+  if (!session.wake) {
+    printf("Could not create a semaphore: %s\n", SDL_GetError());
+    return EXIT_FAILURE;
+  }
+  session.frame_event = SDL_RegisterEvents(1);
+  if (session.frame_event == (Uint32)-1) {
+    printf("Could not register an event: %s\n", SDL_GetError());
+    return EXIT_FAILURE;
+  }
 
-        case SDLK_x:
-        emulator.inputs[0x0] = 1;
-        break;
+  SDL_Thread *thread = SDL_CreateThread(emulate, "emulation", &session);
+  if (!thread) {
+    printf("Could not start the emulation thread: %s\n", SDL_GetError());
+    return EXIT_FAILURE;
+  }
 
-        case SDLK_c:
-        emulator.inputs[0xb] = 1;
-        break;
+  // Rendering and events stay on this thread, as SDL wants. Drawing waits
+  // for a new frame or the window needing one, and the newest frame is all
+  // that gets drawn however many came since
+  SDL_Event window_event;
+  int running = 1;
+  uint16_t keys = 0;
+  // Draw the first frame even though nothing has changed yet
+  int redraw = 1;
+
+  // With a phosphor the display is drawn from its intensities, which keep
+  // changing for a while after the frames stop, so it is stepped towards
+  // the newest frame on every new frame and every PHOSPHOR_STEP_MS between
+  static Chip8Phosphor phosphor;
+  static uint64_t shown[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT];
+  int use_phosphor = options.phosphor || options.phosphor_frames;
+  if (options.phosphor) {
+    chip8_phosphor_init_decay(&phosphor, options.phosphor);
+  } else if (options.phosphor_frames) {
+    chip8_phosphor_init_or(&phosphor, options.phosphor_frames);
+  }
+  uint8_t shown_hires = 0;
+  int fading = 0;
+  uint64_t frequency = SDL_GetPerformanceFrequency();
+  uint64_t last_step = SDL_GetPerformanceCounter();
+
+  while (running) {
+    const Chip8DisplayFrame *frame = chip8_triple_buffer_take(&session.frames);
+    if (frame && !use_phosphor) {
+      chip8_display_update(&display, frame);
+      redraw = 1;
+    }
+    if (use_phosphor) {
+      if (frame) {
+        memcpy(shown, frame->graphics, sizeof(shown));
+        shown_hires = frame->hires;
+      }
+      uint64_t now = SDL_GetPerformanceCounter();
+      double elapsed = (double)(now - last_step) * 1000 / frequency;
+      if (frame || (fading && elapsed >= PHOSPHOR_STEP_MS)) {
+        fading = chip8_phosphor_step(
+            &phosphor, (const uint64_t(*)[2][CHIP8_HIRES_HEIGHT])shown,
+            shown_hires, elapsed);
+        last_step = now;
+        chip8_display_update_phosphor(&display, &phosphor);
+        redraw = 1;
+      }
+    }
+    if (redraw) {
+      present(renderer, &display);
+      redraw = 0;
+    }
 
-        case SDLK_v:
-        emulator.inputs[0xf] = 1;
-        break;
+    // A fading phosphor wakes up for its next step even without events
+    if (fading) {
+      if (!SDL_WaitEventTimeout(&window_event, PHOSPHOR_STEP_MS)) {
+        continue;
       }
+    } else if (!SDL_WaitEvent(&window_event)) {
       break;
-
-      case SDL_KEYUP:
-      switch (window_event.key.keysym.sym) {
-        case SDLK_1:
-        emulator.inputs[1] = 0;
-        break;
-        
-        case SDLK_2:
-        emulator.inputs[2] = 0;
-        break;
-
-        case SDLK_3:
-        emulator.inputs[3] = 0;
-        break;
-
-        case SDLK_4:
-        emulator.inputs[0xc] = 0;
-        break;
-
-        case SDLK_q:
-        emulator.inputs[0x4] = 0;
-        break;
-
-        case SDLK_w:
-        emulator.inputs[0x5] = 0;
-        break;
-
-        case SDLK_e:
-        emulator.inputs[0x6] = 0;
-        break;
-
-        case SDLK_r:
-        emulator.inputs[0xd] = 0;
-        break;
-
-        case SDLK_a:
-        emulator.inputs[0x7] = 0;
-        break;
-
-        case SDLK_s:
-        emulator.inputs[0x8] = 0;
-        break;
-
-        case SDLK_d:
-        emulator.inputs[0x9] = 0;
-        break;
-
-        case SDLK_f:
-        emulator.inputs[0xe] = 0;
-        break;
-
-        case SDLK_z:
-        emulator.inputs[0xa] = 0;
-        break;
-
-        case SDLK_x:
-        emulator.inputs[0x0] = 0;
+    }
+    do {
+      if (window_event.type == session.frame_event) {
+        atomic_exchange(&session.frame_pending, 0);
+        continue;
+      }
+      switch (window_event.type) {
+      case SDL_QUIT:
+        running = 0;
         break;
-
-        case SDLK_c:
-        emulator.inputs[0xb] = 0;
+      case SDL_WINDOWEVENT:
+        if (window_event.window.event == SDL_WINDOWEVENT_EXPOSED) {
+          redraw = 1;
+        }
         break;
-
-        case SDLK_v:
-        emulator.inputs[0xf] = 0;
+      case SDL_KEYDOWN:
+      case SDL_KEYUP: {
+        int down = window_event.type == SDL_KEYDOWN;
+        SDL_Keycode key = window_event.key.keysym.sym;
+        if (key == SDLK_BACKSPACE) {
+          atomic_store_explicit(&session.rewinding, down,
+                                memory_order_relaxed);
+        }
+        for (uint8_t i = 0; i < 16; i++) {
+          if (KEYMAP[i] == key) {
+            keys = down ? keys | 1 << i : keys & ~(1 << i);
+          }
+        }
+        atomic_store_explicit(&session.keys, keys, memory_order_relaxed);
+        SDL_SemPost(session.wake);
         break;
       }
-      
-
+      }
+    } while (SDL_PollEvent(&window_event));
   }
-    }
-    chip8_run(&emulator, delta_time, window_event);
-    SDL_SetRenderDrawColor(renderer, 0x00, 0x00, 0x00, 0xff);
-    SDL_RenderClear(renderer);
-    chip8_render_display(renderer, SCREEN_WIDTH, SCREEN_HEIGHT, &emulator);
-    // chip8_render_grid(renderer, SCREEN_WIDTH, SCREEN_HEIGHT);
-    SDL_RenderPresent(renderer);
-  } 
 
+  atomic_store(&session.quit, 1);
+  SDL_SemPost(session.wake);
+  SDL_WaitThread(thread, NULL);
+  SDL_DestroySemaphore(session.wake);
+
+  if (log) {
+    chip8_input_log_finish(log, &emulator);
+    if (chip8_input_log_save(log, options.record) == -1) {
+      printf("Failed to save the input log: %s\n", options.record);
+    }
+    chip8_input_log_free(log);
+  }
+  if (rewind) {
+    chip8_rewind_free(rewind);
+  }
+  if (audio_device) {
+    SDL_CloseAudioDevice(audio_device);
+  }
+  chip8_display_destroy(&display);
+  SDL_DestroyRenderer(renderer);
   SDL_DestroyWindow(window);
   SDL_Quit();
   return EXIT_SUCCESS;
-
-Error:
-  if (program) {
-    fclose(program);
-  }
-  return EXIT_FAILURE;
 }
@@ -0,0 +1,176 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "phosphor.h"
+
+#define FULL 0xffff
+
+// Masks for the 8 pixels of a display byte, 0xffff for each one that's on,
+// leftmost first
+#define PIXEL_MASK(byte, x) (((byte) >> (7 - (x)) & 1) ? 0xffff : 0)
+#define MASKS(b)                                                              \
+  {PIXEL_MASK(b, 0), PIXEL_MASK(b, 1), PIXEL_MASK(b, 2), PIXEL_MASK(b, 3),    \
+   PIXEL_MASK(b, 4), PIXEL_MASK(b, 5), PIXEL_MASK(b, 6), PIXEL_MASK(b, 7)}
+#define MASKS_4(b) MASKS(b), MASKS(b + 1), MASKS(b + 2), MASKS(b + 3)
+#define MASKS_16(b) MASKS_4(b), MASKS_4(b + 4), MASKS_4(b + 8), MASKS_4(b + 12)
+#define MASKS_64(b)                                                           \
+  MASKS_16(b), MASKS_16(b + 16), MASKS_16(b + 32), MASKS_16(b + 48)
+static const uint16_t BYTE_MASKS[256][8] = {MASKS_64(0), MASKS_64(64),
+                                            MASKS_64(128), MASKS_64(192)};
+
+static void phosphor_init(Chip8Phosphor *phosphor, Chip8PhosphorMode mode) {
+  memset(phosphor->intensity, 0, sizeof(phosphor->intensity));
+  memset(phosphor->history, 0, sizeof(phosphor->history));
+  phosphor->mode = mode;
+  phosphor->half_life = 0;
+  phosphor->frames = 1;
+  phosphor->newest = 0;
+  phosphor->hires = 0;
+}
+
+void chip8_phosphor_init_decay(Chip8Phosphor *phosphor, unsigned half_life) {
+  phosphor_init(phosphor, CHIP8_PHOSPHOR_DECAY);
+  phosphor->half_life = half_life;
+}
+
+void chip8_phosphor_init_or(Chip8Phosphor *phosphor, unsigned frames) {
+  phosphor_init(phosphor, CHIP8_PHOSPHOR_OR);
+  if (frames < 1) {
+    frames = 1;
+  }
+  if (frames > CHIP8_PHOSPHOR_MAX_FRAMES) {
+    frames = CHIP8_PHOSPHOR_MAX_FRAMES;
+  }
+  phosphor->frames = frames;
+}
+
+// Scales every intensity by decay / 65536 and sets the ones whose pixel is
+// on to full. Returns 1 if any is left between off and full
+static int fade(Chip8Phosphor *phosphor,
+                const uint64_t graphics[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT],
+                int hires, uint16_t decay) {
+  int words = hires ? 2 : 1;
+  int height = hires ? CHIP8_HIRES_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+  uint16_t fading = 0;
+  for (int plane = 0; plane < CHIP8_PLANES; plane++) {
+    for (int y = 0; y < height; y++) {
+      uint16_t *row = phosphor->intensity[plane][y];
+      for (int word = 0; word < words; word++, row += 64) {
+        uint64_t bits = graphics[plane][word][y];
+        uint16_t on[64];
+        for (int i = 0; i < 8; i++) {
+          memcpy(on + 8 * i, BYTE_MASKS[(bits >> (56 - 8 * i)) & 0xff],
+                 sizeof(BYTE_MASKS[0]));
+        }
+        // Branch free so the compiler can vectorize it, a multiply high
+        // and an or per pixel
+        for (int x = 0; x < 64; x++) {
+          uint16_t value = (uint16_t)(((uint32_t)row[x] * decay) >> 16) | on[x];
+          row[x] = value;
+          // Only off and full wrap around to 0 and 1
+          fading |= (uint16_t)(value + 1) > 1;
+        }
+      }
+    }
+  }
+  return fading != 0;
+}
+
+int chip8_phosphor_step(
+    Chip8Phosphor *phosphor,
+    const uint64_t graphics[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT], int hires,
+    double elapsed) {
+  hires = hires != 0;
+  // What was on screen in the other mode has nothing to fade into
+  if (hires != phosphor->hires) {
+    memset(phosphor->intensity, 0, sizeof(phosphor->intensity));
+    memset(phosphor->history, 0, sizeof(phosphor->history));
+    phosphor->hires = hires;
+  }
+
+  if (phosphor->mode == CHIP8_PHOSPHOR_DECAY) {
+    double decay = phosphor->half_life
+                       ? 65536.0 * exp2(-elapsed / phosphor->half_life)
+                       : 0.0;
+    return fade(phosphor, graphics, hires,
+                decay >= FULL ? FULL : (uint16_t)decay);
+  }
+
+  // Every pixel on in any of the last frames is fully on, everything else
+  // is off
+  phosphor->newest = (phosphor->newest + 1) % CHIP8_PHOSPHOR_MAX_FRAMES;
+  memcpy(phosphor->history[phosphor->newest], graphics,
+         sizeof(phosphor->history[0]));
+  uint64_t combined[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT];
+  memcpy(combined, graphics, sizeof(combined));
+  int settled = 1;
+  for (unsigned i = 1; i < phosphor->frames; i++) {
+    unsigned frame = (phosphor->newest + CHIP8_PHOSPHOR_MAX_FRAMES - i) %
+                     CHIP8_PHOSPHOR_MAX_FRAMES;
+    const uint64_t *older = &phosphor->history[frame][0][0][0];
+    uint64_t *out = &combined[0][0][0];
+    for (size_t word = 0; word < sizeof(combined) / sizeof(uint64_t);
+         word++) {
+      out[word] |= older[word];
+    }
+    settled &= memcmp(phosphor->history[frame], graphics,
+                      sizeof(combined)) == 0;
+  }
+  fade(phosphor,
+       (const uint64_t(*)[2][CHIP8_HIRES_HEIGHT])combined, hires, 0);
+  return !settled;
+}
+
+// Mixes two colors by weight / 256, two 8-bit channels at a time in 16-bit
+// halves, which each product fits
+static inline uint32_t blend(uint32_t from, uint32_t to, uint32_t weight) {
+  uint32_t red_blue = ((from & 0xff00ff) * (256 - weight) +
+                       (to & 0xff00ff) * weight) >> 8;
+  uint32_t alpha_green = ((from >> 8 & 0xff00ff) * (256 - weight) +
+                          (to >> 8 & 0xff00ff) * weight);
+  return (red_blue & 0xff00ff) | (alpha_green & 0xff00ff00);
+}
+
+void chip8_phosphor_unpack(const Chip8Phosphor *phosphor, int first_row,
+                           int rows, const uint32_t palette[4], void *pixels,
+                           int pitch) {
+  int width = phosphor->hires ? CHIP8_HIRES_WIDTH : CHIP8_DISPLAY_WIDTH;
+  // Every color a pixel can have in plane 0 alone, and with plane 1 fully
+  // on, by weight out of 256 so full on picks a palette color exactly
+  uint32_t plane0[257];
+  uint32_t both[257];
+  for (uint32_t weight = 0; weight <= 256; weight++) {
+    plane0[weight] = blend(palette[0], palette[1], weight);
+    both[weight] = blend(palette[2], palette[3], weight);
+  }
+
+  for (int y = 0; y < rows; y++) {
+    const uint16_t *low = phosphor->intensity[0][first_row + y];
+    const uint16_t *high = phosphor->intensity[1][first_row + y];
+    uint32_t *out = (uint32_t *)((uint8_t *)pixels + (size_t)y * pitch);
+    // Only XO-CHIP programs draw to plane 1, so most rows need just the
+    // one table
+    uint16_t any_high = 0;
+    for (int x = 0; x < width; x++) {
+      any_high |= high[x];
+    }
+    if (!any_high) {
+      for (int x = 0; x < width; x++) {
+        out[x] = plane0[((uint32_t)low[x] + 128) >> 8];
+      }
+      continue;
+    }
+    for (int x = 0; x < width; x++) {
+      uint32_t a = ((uint32_t)low[x] + 128) >> 8;
+      uint32_t b = ((uint32_t)high[x] + 128) >> 8;
+      // Only pixels fading in plane 1 need blending
+      uint32_t pixel = (b ? both : plane0)[a];
+      if (b & 0xff) {
+        pixel = blend(plane0[a], both[a], b);
+      }
+      out[x] = pixel;
+    }
+  }
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Persistence for the display, which hides the flicker of programs that
+// erase and redraw their sprites every frame. Every pixel keeps an
+// intensity per plane, which is full while the pixel is on and otherwise
+// dies down, and the display is drawn from the intensities rather than
+// the bits. Stepping and drawing are plain loops over fixed size rows, so
+// the compiler vectorizes them for whatever the target flags allow
+
+// Most frames CHIP8_PHOSPHOR_OR can hold on to
+#define CHIP8_PHOSPHOR_MAX_FRAMES 8
+
+typedef enum PhosphorMode {
+  // Pixels that go off fade out, halving every half_life milliseconds
+  CHIP8_PHOSPHOR_DECAY = 0,
+  // Pixels stay fully on while they were on in any of the last `frames`
+  // steps, and go off at once after that
+  CHIP8_PHOSPHOR_OR,
+} Chip8PhosphorMode;
+
+typedef struct Phosphor {
+  // 0 for off to 0xffff for fully on. In 64x32 mode only the top left
+  // corner is used
+  _Alignas(CHIP8_CACHE_LINE) uint16_t
+      intensity[CHIP8_PLANES][CHIP8_HIRES_HEIGHT][CHIP8_HIRES_WIDTH];
+  // The displays of the last steps in CHIP8_PHOSPHOR_OR mode, the newest
+  // at history[newest]
+  uint64_t history[CHIP8_PHOSPHOR_MAX_FRAMES][CHIP8_PLANES][2]
+                  [CHIP8_HIRES_HEIGHT];
+  Chip8PhosphorMode mode;
+  unsigned half_life;
+  unsigned frames;
+  unsigned newest;
+  // Mode of the displays stepped to. Switching clears the intensities
+  uint8_t hires;
+} Chip8Phosphor;
+
+// Starts with every pixel off
+void chip8_phosphor_init_decay(Chip8Phosphor *phosphor, unsigned half_life);
+// `frames` is clamped to 1 - CHIP8_PHOSPHOR_MAX_FRAMES
+void chip8_phosphor_init_or(Chip8Phosphor *phosphor, unsigned frames);
+// Moves the intensities on towards a display, `elapsed` milliseconds after
+// the last step. In CHIP8_PHOSPHOR_OR mode every step counts as a frame,
+// however long it took. Returns 1 if stepping again to the same display
+// would still change the intensities, 0 once they have settled
+int chip8_phosphor_step(
+    Chip8Phosphor *phosphor,
+    const uint64_t graphics[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT], int hires,
+    double elapsed);
+// chip8_unpack_graphics for the intensities. A pixel gets the palette
+// colors blended by how far on it is in each plane
+void chip8_phosphor_unpack(const Chip8Phosphor *phosphor, int first_row,
+                           int rows, const uint32_t palette[4], void *pixels,
+                           int pitch);
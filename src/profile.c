@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "input_log.h"
+#include "profile.h"
+
+// Longest line read, far more than a hash and a name need
+#define MAX_LINE 256
+
+static int compare_entries(const void *a, const void *b) {
+  uint64_t left = ((const Chip8ProfileEntry *)a)->hash;
+  uint64_t right = ((const Chip8ProfileEntry *)b)->hash;
+  return (left > right) - (left < right);
+}
+
+int chip8_parse_profile(const char *name) {
+  for (int profile = 0; profile < CHIP8_PROFILE_COUNT; profile++) {
+    if (strcmp(name, chip8_profile_name(profile)) == 0) {
+      return profile;
+    }
+  }
+  return -1;
+}
+
+// Parses one line into entry. Returns 1 if it held an entry, 0 if it was
+// blank or a comment, or -1 if it doesn't parse
+static int parse_line(char *line, Chip8ProfileEntry *entry) {
+  char *comment = strchr(line, '#');
+  if (comment) {
+    *comment = '\0';
+  }
+  char hash[32];
+  char name[32];
+  char extra;
+  int fields = sscanf(line, "%31s %31s %c", hash, name, &extra);
+  if (fields <= 0) {
+    return 0;
+  }
+  if (fields != 2) {
+    return -1;
+  }
+  char *end;
+  entry->hash = strtoull(hash, &end, 16);
+  int profile = chip8_parse_profile(name);
+  if (*end != '\0' || profile == -1) {
+    return -1;
+  }
+  entry->profile = profile;
+  return 1;
+}
+
+int chip8_profile_database_load(Chip8ProfileDatabase *database,
+                                const char *path) {
+  database->entries = NULL;
+  database->count = 0;
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+
+  size_t capacity = 0;
+  char line[MAX_LINE];
+  while (fgets(line, sizeof(line), file)) {
+    Chip8ProfileEntry entry;
+    int parsed = parse_line(line, &entry);
+    if (parsed == -1) {
+      goto Fail;
+    }
+    if (!parsed) {
+      continue;
+    }
+    if (database->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      Chip8ProfileEntry *entries =
+          realloc(database->entries, capacity * sizeof(Chip8ProfileEntry));
+      if (!entries) {
+        goto Fail;
+      }
+      database->entries = entries;
+    }
+    database->entries[database->count++] = entry;
+  }
+  if (ferror(file)) {
+    goto Fail;
+  }
+  fclose(file);
+
+  if (database->count > 0) {
+    qsort(database->entries, database->count, sizeof(Chip8ProfileEntry),
+          compare_entries);
+  }
+  return 0;
+
+Fail:
+  fclose(file);
+  chip8_profile_database_free(database);
+  return -1;
+}
+
+void chip8_profile_database_free(Chip8ProfileDatabase *database) {
+  free(database->entries);
+  database->entries = NULL;
+  database->count = 0;
+}
+
+Chip8Profile chip8_profile_lookup(const Chip8ProfileDatabase *database,
+                                  const uint8_t *program, long program_size) {
+  if (database->count == 0) {
+    return CHIP8_PROFILE_DEFAULT;
+  }
+  Chip8ProfileEntry key = {
+      .hash = chip8_input_log_program_hash(program, program_size),
+  };
+  const Chip8ProfileEntry *entry =
+      bsearch(&key, database->entries, database->count,
+              sizeof(Chip8ProfileEntry), compare_entries);
+  return entry ? entry->profile : CHIP8_PROFILE_DEFAULT;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Which profile each ROM in a catalog runs under, looked up by content so
+// renamed copies still match. The file is plain text, one ROM per line:
+//   <chip8_input_log_program_hash in hex> <profile name>
+// Blank lines and everything after a '#' are ignored. ROMs that aren't
+// listed run under CHIP8_PROFILE_DEFAULT
+
+typedef struct ProfileEntry {
+  uint64_t hash;
+  Chip8Profile profile;
+} Chip8ProfileEntry;
+
+typedef struct ProfileDatabase {
+  // Sorted by hash
+  Chip8ProfileEntry *entries;
+  size_t count;
+} Chip8ProfileDatabase;
+
+// Returns 0 on success, or -1 if the file can't be read or a line doesn't
+// parse
+int chip8_profile_database_load(Chip8ProfileDatabase *database,
+                                const char *path);
+void chip8_profile_database_free(Chip8ProfileDatabase *database);
+Chip8Profile chip8_profile_lookup(const Chip8ProfileDatabase *database,
+                                  const uint8_t *program, long program_size);
+// The profile chip8_profile_name gives `name`, or -1 if there is none
+int chip8_parse_profile(const char *name);
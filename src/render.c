@@ -0,0 +1,100 @@
+#include <stdint.h>
+
+#include "SDL_pixels.h"
+#include "SDL_render.h"
+#include "emulator.h"
+#include "phosphor.h"
+#include "render.h"
+#include "triple_buffer.h"
+
+#define PIXEL_OFF 0xff000000
+
+// Indexed by the pixel's bit in each plane, plane 0 in bit 0
+static const uint32_t PALETTE[4] = {PIXEL_OFF, 0xffffffff, 0xffaaaaaa,
+                                    0xff555555};
+
+int chip8_display_init(Chip8Display *display, SDL_Renderer *r) {
+  display->texture = SDL_CreateTexture(
+      r, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+      CHIP8_HIRES_WIDTH, CHIP8_HIRES_HEIGHT);
+  if (!display->texture) {
+    return -1;
+  }
+  display->width = CHIP8_DISPLAY_WIDTH;
+  display->height = CHIP8_DISPLAY_HEIGHT;
+
+  // Streaming textures start out undefined, so clear it to black
+  static uint32_t black[CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT];
+  for (int i = 0; i < CHIP8_HIRES_WIDTH * CHIP8_HIRES_HEIGHT; i++) {
+    black[i] = PIXEL_OFF;
+  }
+  SDL_UpdateTexture(display->texture, NULL, black,
+                    CHIP8_HIRES_WIDTH * sizeof(uint32_t));
+  return 0;
+}
+
+void chip8_display_destroy(Chip8Display *display) {
+  SDL_DestroyTexture(display->texture);
+  display->texture = NULL;
+}
+
+void chip8_display_update(Chip8Display *display,
+                          const Chip8DisplayFrame *frame) {
+  uint32_t dirty = frame->dirty_rows;
+  if (!dirty) {
+    return;
+  }
+
+  // Upload one band from the first to the last changed row. In 128x64
+  // mode each dirty bit covers two rows
+  int first = __builtin_ctz(dirty) << frame->hires;
+  int last = ((32 - __builtin_clz(dirty)) << frame->hires) - 1;
+  display->width = frame->hires ? CHIP8_HIRES_WIDTH : CHIP8_DISPLAY_WIDTH;
+  display->height = frame->hires ? CHIP8_HIRES_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+  SDL_Rect band = {0, first, display->width, last - first + 1};
+  void *pixels;
+  int pitch;
+  if (SDL_LockTexture(display->texture, &band, &pixels, &pitch) < 0) {
+    return;
+  }
+
+  chip8_unpack_graphics(frame->graphics, frame->hires, first,
+                        last - first + 1, PALETTE, pixels, pitch);
+
+  SDL_UnlockTexture(display->texture);
+}
+
+void chip8_display_update_phosphor(Chip8Display *display,
+                                   const Chip8Phosphor *phosphor) {
+  display->width = phosphor->hires ? CHIP8_HIRES_WIDTH : CHIP8_DISPLAY_WIDTH;
+  display->height =
+      phosphor->hires ? CHIP8_HIRES_HEIGHT : CHIP8_DISPLAY_HEIGHT;
+  SDL_Rect area = {0, 0, display->width, display->height};
+  void *pixels;
+  int pitch;
+  if (SDL_LockTexture(display->texture, &area, &pixels, &pitch) < 0) {
+    return;
+  }
+
+  chip8_phosphor_unpack(phosphor, 0, display->height, PALETTE, pixels, pitch);
+
+  SDL_UnlockTexture(display->texture);
+}
+
+void chip8_render_grid(SDL_Renderer *r, double width, double height) {
+  SDL_SetRenderDrawColor(r, 0xff, 0xff, 0, 0x0f);
+  for (int x = 1; x < CHIP8_DISPLAY_WIDTH; x++) {
+    SDL_RenderDrawLine(r, width / 64.0 * x, 0, width / 64 * x, height);
+  }
+
+  for (int y = 1; y < CHIP8_DISPLAY_HEIGHT; y++) {
+    SDL_RenderDrawLine(r, 0, height / 32.0 * y, width, height / 32 * y);
+  }
+}
+
+void chip8_render_display(SDL_Renderer *r, double width, double height,
+                          const Chip8Display *display) {
+  SDL_Rect source = {0, 0, display->width, display->height};
+  SDL_Rect target = {0, 0, (int)width, (int)height};
+  SDL_RenderCopy(r, display->texture, &source, &target);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "SDL_render.h"
+#include "emulator.h"
+#include "phosphor.h"
+#include "triple_buffer.h"
+
+// The display as a 128x64 streaming texture, scaled up when it is drawn.
+// In 64x32 mode only the top left corner is used
+typedef struct Display {
+  SDL_Texture *texture;
+  // Size of the display in the mode last uploaded
+  int width;
+  int height;
+} Chip8Display;
+
+// Returns 0 on success, or -1 if the texture could not be created
+int chip8_display_init(Chip8Display *display, SDL_Renderer *r);
+void chip8_display_destroy(Chip8Display *display);
+// Uploads the rows in frame->dirty_rows. Does nothing when no rows changed
+void chip8_display_update(Chip8Display *display,
+                          const Chip8DisplayFrame *frame);
+// Uploads all of the display from a phosphor's intensities instead
+void chip8_display_update_phosphor(Chip8Display *display,
+                                   const Chip8Phosphor *phosphor);
+
+void chip8_render_grid(SDL_Renderer *r, double width, double height);
+void chip8_render_display(SDL_Renderer *r, double width, double height,
+                          const Chip8Display *display);
@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "rewind.h"
+
+#define STATE_SIZE sizeof(Chip8Emulator)
+// Equal bytes needed to end a literal run. Shorter gaps are cheaper to
+// store in the literal than to start a new run for
+#define MIN_ZERO_RUN 8
+// A delta is a list of runs, each a uint16_t count of unchanged bytes to
+// skip, a uint16_t literal length, then that many bytes XORed with the
+// keyframe. Unchanged bytes after the last run are left out
+#define RUN_HEADER_SIZE (2 * sizeof(uint16_t))
+#define MAX_DELTA_SIZE                                                         \
+  (STATE_SIZE + RUN_HEADER_SIZE * (STATE_SIZE / MIN_ZERO_RUN + 1))
+
+_Static_assert(STATE_SIZE <= UINT16_MAX, "delta runs are 16-bit");
+
+// Counts the bytes from i on that match the keyframe
+static size_t equal_run(const uint8_t *key, const uint8_t *state, size_t i) {
+  size_t start = i;
+  while (i + sizeof(uint64_t) <= STATE_SIZE) {
+    uint64_t a, b;
+    memcpy(&a, key + i, sizeof(a));
+    memcpy(&b, state + i, sizeof(b));
+    if (a != b) {
+      break;
+    }
+    i += sizeof(uint64_t);
+  }
+  while (i < STATE_SIZE && key[i] == state[i]) {
+    i++;
+  }
+  return i - start;
+}
+
+static size_t encode_delta(const uint8_t *key, const uint8_t *state,
+                           uint8_t *out) {
+  size_t size = 0;
+  size_t i = 0;
+  while (i < STATE_SIZE) {
+    uint16_t skip = equal_run(key, state, i);
+    i += skip;
+    if (i == STATE_SIZE) {
+      break;
+    }
+
+    // The literal runs until the next MIN_ZERO_RUN equal bytes
+    size_t start = i;
+    size_t end = i;
+    while (end < STATE_SIZE) {
+      size_t equal = equal_run(key, state, end);
+      if (equal >= MIN_ZERO_RUN || end + equal == STATE_SIZE) {
+        break;
+      }
+      end += equal + 1;
+    }
+    uint16_t length = end - start;
+
+    memcpy(out + size, &skip, sizeof(skip));
+    memcpy(out + size + sizeof(skip), &length, sizeof(length));
+    size += RUN_HEADER_SIZE;
+    for (size_t j = start; j < end; j++) {
+      out[size++] = key[j] ^ state[j];
+    }
+    i = end;
+  }
+  return size;
+}
+
+static void decode_delta(const uint8_t *delta, size_t size, uint8_t *state) {
+  size_t i = 0;
+  size_t offset = 0;
+  while (offset < size) {
+    uint16_t skip, length;
+    memcpy(&skip, delta + offset, sizeof(skip));
+    memcpy(&length, delta + offset + sizeof(skip), sizeof(length));
+    offset += RUN_HEADER_SIZE;
+    i += skip;
+    for (uint16_t j = 0; j < length; j++) {
+      state[i++] ^= delta[offset++];
+    }
+  }
+}
+
+int chip8_rewind_init(Chip8Rewind *rewind, size_t states,
+                      size_t keyframe_interval) {
+  if (!states || !keyframe_interval) {
+    return -1;
+  }
+  memset(rewind, 0, sizeof(*rewind));
+  rewind->keyframe_interval = keyframe_interval;
+  rewind->capacity =
+      (states + keyframe_interval - 1) / keyframe_interval * keyframe_interval;
+  rewind->slots = calloc(rewind->capacity, sizeof(Chip8RewindSlot));
+  rewind->scratch = malloc(MAX_DELTA_SIZE);
+  if (!rewind->slots || !rewind->scratch) {
+    chip8_rewind_free(rewind);
+    return -1;
+  }
+  return 0;
+}
+
+void chip8_rewind_free(Chip8Rewind *rewind) {
+  if (rewind->slots) {
+    for (size_t i = 0; i < rewind->capacity; i++) {
+      free(rewind->slots[i].data);
+    }
+  }
+  free(rewind->slots);
+  free(rewind->scratch);
+  rewind->slots = NULL;
+  rewind->scratch = NULL;
+  rewind->count = 0;
+}
+
+int chip8_rewind_push(Chip8Rewind *rewind, const Chip8Emulator *emulator) {
+  uint64_t state_index = rewind->head;
+  uint64_t keyframe = state_index - state_index % rewind->keyframe_interval;
+  const uint8_t *state = (const uint8_t *)emulator;
+
+  const uint8_t *data = state;
+  size_t size = STATE_SIZE;
+  if (state_index != keyframe) {
+    const Chip8RewindSlot *key = &rewind->slots[keyframe % rewind->capacity];
+    size = encode_delta(key->data, state, rewind->scratch);
+    data = rewind->scratch;
+  }
+
+  // Slots keep their buffers, so once the ring has gone around this rarely
+  // allocates. A failed realloc leaves the old contents in place
+  Chip8RewindSlot *slot = &rewind->slots[state_index % rewind->capacity];
+  if (slot->capacity < size) {
+    uint8_t *grown = realloc(slot->data, size);
+    if (!grown) {
+      return -1;
+    }
+    slot->data = grown;
+    slot->capacity = size;
+  }
+
+  // Full, so this overwrites the oldest keyframe. Its deltas go with it
+  if (rewind->count == rewind->capacity) {
+    rewind->count -= rewind->keyframe_interval;
+  }
+  if (size) {
+    memcpy(slot->data, data, size);
+  }
+  slot->size = size;
+  rewind->head++;
+  rewind->count++;
+  return 0;
+}
+
+int chip8_rewind_restore(Chip8Rewind *rewind, size_t age,
+                         Chip8Emulator *emulator) {
+  if (age >= rewind->count) {
+    return -1;
+  }
+  uint64_t state_index = rewind->head - 1 - age;
+  uint64_t keyframe = state_index - state_index % rewind->keyframe_interval;
+
+  uint8_t *decoded = (uint8_t *)&rewind->decoded;
+  memcpy(decoded, rewind->slots[keyframe % rewind->capacity].data, STATE_SIZE);
+  if (state_index != keyframe) {
+    const Chip8RewindSlot *slot =
+        &rewind->slots[state_index % rewind->capacity];
+    decode_delta(slot->data, slot->size, decoded);
+  }
+  chip8_restore_state(emulator, &rewind->decoded);
+  return 0;
+}
+
+int chip8_rewind_pop(Chip8Rewind *rewind, Chip8Emulator *emulator) {
+  if (chip8_rewind_restore(rewind, 0, emulator) == -1) {
+    return -1;
+  }
+  rewind->head--;
+  rewind->count--;
+  return 0;
+}
+
+size_t chip8_rewind_memory_used(const Chip8Rewind *rewind) {
+  size_t used = 0;
+  for (size_t i = 0; i < rewind->capacity; i++) {
+    used += rewind->slots[i].capacity;
+  }
+  return used;
+}
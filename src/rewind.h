@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Keeps the most recent emulator states, normally one per frame, so the
+// machine can be stepped backwards. Every keyframe_interval'th state is
+// stored in full and the ones in between as a run-length encoded XOR
+// against that keyframe, which is usually a few dozen bytes since memory
+// and the stack rarely change. States are dropped a keyframe group at a
+// time once the buffer is full
+typedef struct RewindSlot {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+} Chip8RewindSlot;
+
+typedef struct Rewind {
+  Chip8RewindSlot *slots;
+  // Multiple of keyframe_interval
+  size_t capacity;
+  size_t keyframe_interval;
+  // States pushed so far, minus the ones popped
+  uint64_t head;
+  // States currently stored, the newest being head - 1
+  size_t count;
+  // Room for the worst-case encoding of one state
+  uint8_t *scratch;
+  Chip8Emulator decoded;
+} Chip8Rewind;
+
+// Keeps at least `states` states, rounded up to whole keyframe groups.
+// Returns 0 on success, or -1 if the arguments are invalid or out of memory
+int chip8_rewind_init(Chip8Rewind *rewind, size_t states,
+                      size_t keyframe_interval);
+void chip8_rewind_free(Chip8Rewind *rewind);
+// Stores the current state of emulator. Returns 0 on success, or -1 if out
+// of memory, in which case the state is not stored
+int chip8_rewind_push(Chip8Rewind *rewind, const Chip8Emulator *emulator);
+// Restores the state stored `age` pushes ago, 0 being the newest, with
+// chip8_restore_state. Returns -1 if fewer than age + 1 states are stored
+int chip8_rewind_restore(Chip8Rewind *rewind, size_t age,
+                         Chip8Emulator *emulator);
+// Restores the newest state and removes it, stepping back one push.
+// Returns -1 if the buffer is empty
+int chip8_rewind_pop(Chip8Rewind *rewind, Chip8Emulator *emulator);
+// Bytes held by the stored states
+size_t chip8_rewind_memory_used(const Chip8Rewind *rewind);
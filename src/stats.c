@@ -0,0 +1,229 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "stats.h"
+
+static const char *const OP_NAMES[] = {
+#define CHIP8_OP_NAME(name, text) text,
+    CHIP8_OPS(CHIP8_OP_NAME)
+#undef CHIP8_OP_NAME
+};
+
+static const Chip8Op SKIPS[] = {
+    CHIP8_OP_SE_BYTE, CHIP8_OP_SNE_BYTE, CHIP8_OP_SE_REG,
+    CHIP8_OP_SNE_REG, CHIP8_OP_SKP,      CHIP8_OP_SKNP,
+};
+
+void chip8_attach_stats(Chip8Emulator *emulator, Chip8Stats *stats) {
+  emulator->stats = stats;
+  if (stats) {
+    memset(stats, 0, sizeof(Chip8Stats));
+  }
+}
+
+const char *chip8_op_name(Chip8Op op) {
+  return op < CHIP8_OP_COUNT ? OP_NAMES[op] : "unknown";
+}
+
+// Mirrors decode() in emulator.c, so every instruction is counted under
+// the handler that actually runs it
+Chip8Op chip8_stats_classify(uint16_t instruction, int quirks) {
+  int extended = quirks & CHIP8_PROFILE_EXTENDED;
+  switch (instruction >> 12) {
+  case 0x0:
+    switch (instruction) {
+    case 0x00e0:
+      return CHIP8_OP_CLS;
+    case 0x00ee:
+      return CHIP8_OP_RET;
+    }
+    if (!extended) {
+      return CHIP8_OP_UNKNOWN;
+    }
+    switch (instruction & 0xfff0) {
+    case 0x00c0:
+      return CHIP8_OP_SCD;
+    case 0x00d0:
+      return CHIP8_OP_SCU;
+    }
+    switch (instruction) {
+    case 0x00fb:
+      return CHIP8_OP_SCR;
+    case 0x00fc:
+      return CHIP8_OP_SCL;
+    case 0x00fd:
+      return CHIP8_OP_EXIT;
+    case 0x00fe:
+      return CHIP8_OP_LOW;
+    case 0x00ff:
+      return CHIP8_OP_HIGH;
+    default:
+      return CHIP8_OP_UNKNOWN;
+    }
+  case 0x1:
+    return CHIP8_OP_JP;
+  case 0x2:
+    return CHIP8_OP_CALL;
+  case 0x3:
+    return CHIP8_OP_SE_BYTE;
+  case 0x4:
+    return CHIP8_OP_SNE_BYTE;
+  case 0x5:
+    return CHIP8_OP_SE_REG;
+  case 0x6:
+    return CHIP8_OP_LD_BYTE;
+  case 0x7:
+    return CHIP8_OP_ADD_BYTE;
+  case 0x8:
+    switch (instruction & 0xf) {
+    case 0x0:
+      return CHIP8_OP_LD_REG;
+    case 0x1:
+      return CHIP8_OP_OR;
+    case 0x2:
+      return CHIP8_OP_AND;
+    case 0x3:
+      return CHIP8_OP_XOR;
+    case 0x4:
+      return CHIP8_OP_ADD_REG;
+    case 0x5:
+      return CHIP8_OP_SUB;
+    case 0x6:
+      return CHIP8_OP_SHR;
+    case 0x7:
+      return CHIP8_OP_SUBN;
+    case 0xe:
+      return CHIP8_OP_SHL;
+    default:
+      return CHIP8_OP_ALU_NONE;
+    }
+  case 0x9:
+    return CHIP8_OP_SNE_REG;
+  case 0xa:
+    return CHIP8_OP_LD_I;
+  case 0xb:
+    return CHIP8_OP_JP_V0;
+  case 0xc:
+    return CHIP8_OP_RND;
+  case 0xd:
+    return CHIP8_OP_DRW;
+  case 0xe:
+    switch (instruction & 0xff) {
+    case 0x9e:
+      return CHIP8_OP_SKP;
+    case 0xa1:
+      return CHIP8_OP_SKNP;
+    default:
+      return CHIP8_OP_UNKNOWN;
+    }
+  default:
+    switch (instruction & 0xff) {
+    case 0x01:
+      return extended ? CHIP8_OP_PLANE : CHIP8_OP_UNKNOWN;
+    case 0x07:
+      return CHIP8_OP_LD_VX_DT;
+    case 0x0a:
+      return CHIP8_OP_LD_K;
+    case 0x15:
+      return CHIP8_OP_LD_DT;
+    case 0x18:
+      return CHIP8_OP_LD_ST;
+    case 0x1e:
+      return CHIP8_OP_ADD_I;
+    case 0x29:
+      return CHIP8_OP_LD_F;
+    case 0x30:
+      return extended ? CHIP8_OP_LD_HF : CHIP8_OP_UNKNOWN;
+    case 0x33:
+      return CHIP8_OP_LD_B;
+    case 0x55:
+      return CHIP8_OP_LD_MEM;
+    case 0x65:
+      return CHIP8_OP_LD_REGS;
+    default:
+      return CHIP8_OP_UNKNOWN;
+    }
+  }
+}
+
+void chip8_stats_count(Chip8Stats *stats, uint16_t pc, uint16_t instruction,
+                       int quirks) {
+  stats->instructions += 1;
+  stats->families[instruction >> 12] += 1;
+  stats->ops[chip8_stats_classify(instruction, quirks)] += 1;
+  stats->pc_heat[pc] += 1;
+}
+
+static double ratio(uint64_t part, uint64_t whole) {
+  return whole ? (double)part / whole : 0.0;
+}
+
+static void write_json(const Chip8Stats *stats, FILE *file) {
+  fprintf(file, "{\n  \"instructions\": %llu,\n",
+          (unsigned long long)stats->instructions);
+
+  fputs("  \"families\": {", file);
+  for (int i = 0; i < 16; i++) {
+    fprintf(file, "%s\"%X\": %llu", i ? ", " : "", i,
+            (unsigned long long)stats->families[i]);
+  }
+  fputs("},\n", file);
+
+  fputs("  \"ops\": {", file);
+  for (int i = 0; i < CHIP8_OP_COUNT; i++) {
+    fprintf(file, "%s\n    \"%s\": %llu", i ? "," : "", OP_NAMES[i],
+            (unsigned long long)stats->ops[i]);
+  }
+  fputs("\n  },\n", file);
+
+  fputs("  \"skips\": {", file);
+  for (size_t i = 0; i < sizeof(SKIPS) / sizeof(SKIPS[0]); i++) {
+    uint64_t executed = stats->ops[SKIPS[i]];
+    uint64_t taken = stats->skips_taken[SKIPS[i]];
+    fprintf(file,
+            "%s\n    \"%s\": {\"executed\": %llu, \"taken\": %llu, "
+            "\"taken_ratio\": %.6f}",
+            i ? "," : "", OP_NAMES[SKIPS[i]], (unsigned long long)executed,
+            (unsigned long long)taken, ratio(taken, executed));
+  }
+  fputs("\n  },\n", file);
+
+  fprintf(file,
+          "  \"draw\": {\"calls\": %llu, \"rows\": %llu, \"collisions\": %llu, "
+          "\"collision_rate\": %.6f},\n",
+          (unsigned long long)stats->draws,
+          (unsigned long long)stats->draw_rows,
+          (unsigned long long)stats->draw_collisions,
+          ratio(stats->draw_collisions, stats->draws));
+  fprintf(file, "  \"timer_underflows\": {\"delay\": %llu, \"sound\": %llu},\n",
+          (unsigned long long)stats->delay_underflows,
+          (unsigned long long)stats->sound_underflows);
+
+  // Only addresses that ran, most programs touch a small part of memory
+  fputs("  \"pc_heat\": [", file);
+  int first = 1;
+  for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+    if (!stats->pc_heat[pc]) {
+      continue;
+    }
+    fprintf(file, "%s\n    {\"pc\": %d, \"count\": %llu}", first ? "" : ",",
+            pc, (unsigned long long)stats->pc_heat[pc]);
+    first = 0;
+  }
+  fputs(first ? "]\n}\n" : "\n  ]\n}\n", file);
+}
+
+int chip8_stats_save_json(const Chip8Stats *stats, const char *path) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    return -1;
+  }
+  write_json(stats, file);
+  int result = ferror(file) ? -1 : 0;
+  if (fclose(file) != 0) {
+    result = -1;
+  }
+  return result;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Execution statistics, only built with CHIP8_STATS. Without it the
+// emulator has no stats pointer and the hooks compile to nothing
+
+// Every instruction the interpreter tells apart, with the name it is
+// reported under
+#define CHIP8_OPS(X)                                                           \
+  X(SCD, "00Cn")                                                               \
+  X(SCU, "00Dn")                                                               \
+  X(CLS, "00E0")                                                               \
+  X(RET, "00EE")                                                               \
+  X(SCR, "00FB")                                                               \
+  X(SCL, "00FC")                                                               \
+  X(EXIT, "00FD")                                                              \
+  X(LOW, "00FE")                                                               \
+  X(HIGH, "00FF")                                                              \
+  X(JP, "1nnn")                                                                \
+  X(CALL, "2nnn")                                                              \
+  X(SE_BYTE, "3xnn")                                                           \
+  X(SNE_BYTE, "4xnn")                                                          \
+  X(SE_REG, "5xy0")                                                            \
+  X(LD_BYTE, "6xnn")                                                           \
+  X(ADD_BYTE, "7xnn")                                                          \
+  X(LD_REG, "8xy0")                                                            \
+  X(OR, "8xy1")                                                                \
+  X(AND, "8xy2")                                                               \
+  X(XOR, "8xy3")                                                               \
+  X(ADD_REG, "8xy4")                                                           \
+  X(SUB, "8xy5")                                                               \
+  X(SHR, "8xy6")                                                               \
+  X(SUBN, "8xy7")                                                              \
+  X(SHL, "8xyE")                                                               \
+  X(ALU_NONE, "8xy?")                                                          \
+  X(SNE_REG, "9xy0")                                                           \
+  X(LD_I, "Annn")                                                              \
+  X(JP_V0, "Bnnn")                                                             \
+  X(RND, "Cxnn")                                                               \
+  X(DRW, "Dxyn")                                                               \
+  X(SKP, "Ex9E")                                                               \
+  X(SKNP, "ExA1")                                                              \
+  X(PLANE, "Fn01")                                                             \
+  X(LD_VX_DT, "Fx07")                                                          \
+  X(LD_K, "Fx0A")                                                              \
+  X(LD_DT, "Fx15")                                                             \
+  X(LD_ST, "Fx18")                                                             \
+  X(ADD_I, "Fx1E")                                                             \
+  X(LD_F, "Fx29")                                                              \
+  X(LD_HF, "Fx30")                                                             \
+  X(LD_B, "Fx33")                                                              \
+  X(LD_MEM, "Fx55")                                                            \
+  X(LD_REGS, "Fx65")                                                           \
+  X(UNKNOWN, "unknown")
+
+typedef enum Op {
+#define CHIP8_OP_ENUM(name, text) CHIP8_OP_##name,
+  CHIP8_OPS(CHIP8_OP_ENUM)
+#undef CHIP8_OP_ENUM
+  CHIP8_OP_COUNT
+} Chip8Op;
+
+typedef struct Chip8Stats {
+  uint64_t instructions;
+  // Indexed by the top nibble of the instruction
+  uint64_t families[16];
+  uint64_t ops[CHIP8_OP_COUNT];
+  // Times each skip instruction skipped, zero for everything else
+  uint64_t skips_taken[CHIP8_OP_COUNT];
+  // Instructions run at each address
+  uint64_t pc_heat[MEMORY_SIZE];
+  uint64_t draws;
+  // Sprite rows drawn, not counting rows clipped off the bottom
+  uint64_t draw_rows;
+  // Draws that set VF
+  uint64_t draw_collisions;
+  // Times the delay and sound timers counted down to zero
+  uint64_t delay_underflows;
+  uint64_t sound_underflows;
+} Chip8Stats;
+
+// Attaches stats, or detaches them when stats is NULL. The stats are
+// cleared. Instructions run by the JIT aren't seen by the hooks, so
+// chip8_run_batch interprets while stats are attached
+void chip8_attach_stats(Chip8Emulator *emulator, Chip8Stats *stats);
+// Which op `instruction` runs as under a profile with CHIP8_PROFILE_*
+// flags `quirks`
+Chip8Op chip8_stats_classify(uint16_t instruction, int quirks);
+const char *chip8_op_name(Chip8Op op);
+// Counts the instruction about to run at pc
+void chip8_stats_count(Chip8Stats *stats, uint16_t pc, uint16_t instruction,
+                       int quirks);
+// Writes the stats as JSON. Returns -1 if the file could not be written
+int chip8_stats_save_json(const Chip8Stats *stats, const char *path);
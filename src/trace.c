@@ -0,0 +1,384 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "trace.h"
+
+static const uint8_t MAGIC[4] = {'C', '8', 'T', 'R'};
+#define VERSION 1
+#define HEADER_SIZE 32
+#define RECORD_SIZE 16
+// Far more than fits in memory, it only keeps a bad file from overflowing
+#define MAX_RECORDS ((uint64_t)1 << 36)
+
+_Static_assert(sizeof(Chip8TraceRecord) == RECORD_SIZE,
+               "trace records must stay 16 bytes");
+
+static void put_le(uint8_t *out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    out[i] = (value >> (8 * i)) & 0xff;
+  }
+}
+
+static uint64_t get_le(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+static int ring_init(Chip8Trace *trace, uint64_t capacity) {
+  memset(trace, 0, sizeof(*trace));
+  if (capacity > MAX_RECORDS) {
+    return -1;
+  }
+  uint64_t size = 1;
+  while (size < capacity) {
+    size <<= 1;
+  }
+  trace->records = calloc(size, sizeof(Chip8TraceRecord));
+  if (!trace->records) {
+    return -1;
+  }
+  trace->mask = size - 1;
+  return 0;
+}
+
+int chip8_trace_init(Chip8Trace *trace, uint64_t capacity, int triggers,
+                     uint16_t first_pc, uint16_t last_pc) {
+  if (ring_init(trace, capacity) == -1) {
+    return -1;
+  }
+  trace->triggers = triggers;
+  trace->first_pc = first_pc;
+  trace->last_pc = last_pc;
+  return 0;
+}
+
+void chip8_trace_free(Chip8Trace *trace) {
+  free(trace->records);
+  trace->records = NULL;
+  trace->mask = 0;
+  trace->written = 0;
+}
+
+#ifdef CHIP8_TRACE
+void chip8_attach_trace(Chip8Emulator *emulator, Chip8Trace *trace) {
+  emulator->trace = trace;
+}
+#endif
+
+uint64_t chip8_trace_count(const Chip8Trace *trace) {
+  return trace->written <= trace->mask ? trace->written : trace->mask + 1;
+}
+
+const Chip8TraceRecord *chip8_trace_at(const Chip8Trace *trace, uint64_t i) {
+  uint64_t first = trace->written - chip8_trace_count(trace);
+  return &trace->records[(first + i) & trace->mask];
+}
+
+static void put_record(uint8_t *out, const Chip8TraceRecord *record) {
+  put_le(out, record->cycle, 8);
+  put_le(out + 8, record->pc, 2);
+  put_le(out + 10, record->instruction, 2);
+  put_le(out + 12, record->index_register, 2);
+  out[14] = record->vx;
+  out[15] = record->vf;
+}
+
+static void get_record(const uint8_t *in, Chip8TraceRecord *record) {
+  record->cycle = get_le(in, 8);
+  record->pc = get_le(in + 8, 2);
+  record->instruction = get_le(in + 10, 2);
+  record->index_register = get_le(in + 12, 2);
+  record->vx = in[14];
+  record->vf = in[15];
+}
+
+int chip8_trace_save(const Chip8Trace *trace, const char *path) {
+  uint64_t count = chip8_trace_count(trace);
+  uint8_t header[HEADER_SIZE];
+  memcpy(header, MAGIC, sizeof(MAGIC));
+  put_le(header + 4, VERSION, 2);
+  put_le(header + 6, trace->triggers, 2);
+  put_le(header + 8, trace->triggered, 2);
+  put_le(header + 10, RECORD_SIZE, 2);
+  put_le(header + 12, trace->first_pc, 2);
+  put_le(header + 14, trace->last_pc, 2);
+  put_le(header + 16, trace->written, 8);
+  put_le(header + 24, count, 8);
+
+  FILE *file = fopen(path, "wb");
+  if (!file) {
+    return -1;
+  }
+  int result = 0;
+  if (fwrite(header, 1, HEADER_SIZE, file) != HEADER_SIZE) {
+    result = -1;
+  }
+  // Through a buffer rather than a write per record
+  uint8_t buffer[256 * RECORD_SIZE];
+  for (uint64_t i = 0; i < count && result == 0;) {
+    size_t size = 0;
+    for (; i < count && size < sizeof(buffer); i++, size += RECORD_SIZE) {
+      put_record(buffer + size, chip8_trace_at(trace, i));
+    }
+    if (fwrite(buffer, 1, size, file) != size) {
+      result = -1;
+    }
+  }
+  if (fclose(file) != 0) {
+    result = -1;
+  }
+  return result;
+}
+
+int chip8_trace_load(Chip8Trace *trace, const char *path) {
+  memset(trace, 0, sizeof(*trace));
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    return -1;
+  }
+
+  uint8_t header[HEADER_SIZE];
+  if (fread(header, 1, HEADER_SIZE, file) != HEADER_SIZE ||
+      memcmp(header, MAGIC, sizeof(MAGIC)) != 0 ||
+      get_le(header + 4, 2) != VERSION ||
+      get_le(header + 10, 2) != RECORD_SIZE) {
+    fclose(file);
+    return -1;
+  }
+  uint64_t written = get_le(header + 16, 8);
+  uint64_t count = get_le(header + 24, 8);
+  // A ring that wrapped around is full, and rings are a power of two
+  if (count > written || (count < written && (count & (count - 1))) ||
+      ring_init(trace, count) == -1) {
+    fclose(file);
+    return -1;
+  }
+  trace->triggers = get_le(header + 6, 2);
+  trace->triggered = get_le(header + 8, 2);
+  trace->first_pc = get_le(header + 12, 2);
+  trace->last_pc = get_le(header + 14, 2);
+  trace->written = written;
+
+  uint8_t buffer[256 * RECORD_SIZE];
+  for (uint64_t i = 0; i < count;) {
+    uint64_t left = (count - i) * RECORD_SIZE;
+    size_t size = left < sizeof(buffer) ? left : sizeof(buffer);
+    if (fread(buffer, 1, size, file) != size) {
+      chip8_trace_free(trace);
+      fclose(file);
+      return -1;
+    }
+    for (size_t offset = 0; offset < size; offset += RECORD_SIZE, i++) {
+      get_record(buffer + offset,
+                 &trace->records[(written - count + i) & trace->mask]);
+    }
+  }
+  fclose(file);
+  return 0;
+}
+
+const char *chip8_trace_trigger_name(int trigger) {
+  switch (trigger) {
+  case CHIP8_TRACE_UNKNOWN:
+    return "unknown";
+  case CHIP8_TRACE_PC:
+    return "pc";
+  case CHIP8_TRACE_COLLISION:
+    return "collision";
+  case CHIP8_TRACE_FAULT:
+    return "fault";
+  }
+  return "none";
+}
+
+int chip8_parse_trace_triggers(const char *text, int *triggers,
+                               uint16_t *first_pc, uint16_t *last_pc) {
+  *triggers = 0;
+  while (*text) {
+    size_t length = strcspn(text, ",");
+    int parsed = 0;
+    for (int trigger = 1; trigger <= CHIP8_TRACE_FAULT; trigger <<= 1) {
+      const char *name = chip8_trace_trigger_name(trigger);
+      if (trigger != CHIP8_TRACE_PC && strlen(name) == length &&
+          strncmp(text, name, length) == 0) {
+        parsed = trigger;
+      }
+    }
+    if (!parsed && strncmp(text, "pc=", 3) == 0) {
+      char *end;
+      unsigned long first = strtoul(text + 3, &end, 0);
+      unsigned long last = first;
+      if (end == text + 3) {
+        return -1;
+      }
+      if (*end == '-') {
+        last = strtoul(end + 1, &end, 0);
+      }
+      if (end != text + length || first > last || last >= MEMORY_SIZE) {
+        return -1;
+      }
+      *first_pc = first;
+      *last_pc = last;
+      parsed = CHIP8_TRACE_PC;
+    }
+    if (!parsed) {
+      return -1;
+    }
+    *triggers |= parsed;
+    text += length;
+    if (*text == ',') {
+      text++;
+    }
+  }
+  return 0;
+}
+
+// Names for the 8xyN operations, NULL for the ones the emulator ignores
+static const char *const ARITHMETIC[16] = {
+    "LD", "OR", "AND", "XOR", "ADD", "SUB", "SHR", "SUBN",
+    NULL, NULL, NULL, NULL,  NULL,  NULL,  "SHL", NULL,
+};
+
+// Mirrors decode() in emulator.c, in the syntax of Cowgod's reference.
+// Anything it ignores or doesn't recognize comes out as data
+const char *chip8_disassemble(uint16_t instruction, char *out, size_t size) {
+  unsigned nnn = instruction & 0x0fff;
+  unsigned x = (instruction >> 8) & 0xf;
+  unsigned y = (instruction >> 4) & 0xf;
+  unsigned nn = instruction & 0xff;
+  unsigned n = instruction & 0xf;
+
+  switch (instruction >> 12) {
+  case 0x0:
+    switch (instruction & 0xfff0) {
+    case 0x00c0:
+      snprintf(out, size, "SCD %u", n);
+      return out;
+    case 0x00d0:
+      snprintf(out, size, "SCU %u", n);
+      return out;
+    }
+    switch (instruction) {
+    case 0x00e0:
+      snprintf(out, size, "CLS");
+      return out;
+    case 0x00ee:
+      snprintf(out, size, "RET");
+      return out;
+    case 0x00fb:
+      snprintf(out, size, "SCR");
+      return out;
+    case 0x00fc:
+      snprintf(out, size, "SCL");
+      return out;
+    case 0x00fd:
+      snprintf(out, size, "EXIT");
+      return out;
+    case 0x00fe:
+      snprintf(out, size, "LOW");
+      return out;
+    case 0x00ff:
+      snprintf(out, size, "HIGH");
+      return out;
+    }
+    break;
+  case 0x1:
+    snprintf(out, size, "JP 0x%03X", nnn);
+    return out;
+  case 0x2:
+    snprintf(out, size, "CALL 0x%03X", nnn);
+    return out;
+  case 0x3:
+    snprintf(out, size, "SE V%X, 0x%02X", x, nn);
+    return out;
+  case 0x4:
+    snprintf(out, size, "SNE V%X, 0x%02X", x, nn);
+    return out;
+  // The emulator doesn't look at the last nibble of 5xy0 and 9xy0
+  case 0x5:
+    snprintf(out, size, "SE V%X, V%X", x, y);
+    return out;
+  case 0x6:
+    snprintf(out, size, "LD V%X, 0x%02X", x, nn);
+    return out;
+  case 0x7:
+    snprintf(out, size, "ADD V%X, 0x%02X", x, nn);
+    return out;
+  case 0x8:
+    if (ARITHMETIC[n]) {
+      snprintf(out, size, "%s V%X, V%X", ARITHMETIC[n], x, y);
+      return out;
+    }
+    break;
+  case 0x9:
+    snprintf(out, size, "SNE V%X, V%X", x, y);
+    return out;
+  case 0xa:
+    snprintf(out, size, "LD I, 0x%03X", nnn);
+    return out;
+  case 0xb:
+    snprintf(out, size, "JP V0, 0x%03X", nnn);
+    return out;
+  case 0xc:
+    snprintf(out, size, "RND V%X, 0x%02X", x, nn);
+    return out;
+  case 0xd:
+    snprintf(out, size, "DRW V%X, V%X, %u", x, y, n);
+    return out;
+  case 0xe:
+    if (nn == 0x9e) {
+      snprintf(out, size, "SKP V%X", x);
+      return out;
+    }
+    if (nn == 0xa1) {
+      snprintf(out, size, "SKNP V%X", x);
+      return out;
+    }
+    break;
+  default:
+    switch (nn) {
+    case 0x01:
+      snprintf(out, size, "PLANE %u", x);
+      return out;
+    case 0x07:
+      snprintf(out, size, "LD V%X, DT", x);
+      return out;
+    case 0x0a:
+      snprintf(out, size, "LD V%X, K", x);
+      return out;
+    case 0x15:
+      snprintf(out, size, "LD DT, V%X", x);
+      return out;
+    case 0x18:
+      snprintf(out, size, "LD ST, V%X", x);
+      return out;
+    case 0x1e:
+      snprintf(out, size, "ADD I, V%X", x);
+      return out;
+    case 0x29:
+      snprintf(out, size, "LD F, V%X", x);
+      return out;
+    case 0x30:
+      snprintf(out, size, "LD HF, V%X", x);
+      return out;
+    case 0x33:
+      snprintf(out, size, "LD B, V%X", x);
+      return out;
+    case 0x55:
+      snprintf(out, size, "LD [I], V%X", x);
+      return out;
+    case 0x65:
+      snprintf(out, size, "LD V%X, [I]", x);
+      return out;
+    }
+    break;
+  }
+  snprintf(out, size, "DW 0x%04X", instruction);
+  return out;
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Execution traces: the last instructions an emulator ran, kept in a ring
+// of fixed size records so a misbehaving program can be looked at after
+// billions of cycles. The ring is written only by the thread running the
+// emulator, so it needs no locks. Recording needs a build with
+// CHIP8_TRACE, without it the emulator has no trace pointer and the hook
+// compiles to nothing. Saved traces can be read by any build, see
+// trace_main.c
+//
+// A saved trace is a 32 byte header, "C8TR", a version, the triggers, the
+// trigger that stopped it, the record size, the pc range, the number of
+// instructions recorded and the number of records in the file, then the
+// records oldest first. All numbers are little endian
+
+typedef struct TraceRecord {
+  // emulator->cycles once the instruction ran, counting it. Idle loops the
+  // emulator skips over leave a gap rather than filling the ring
+  uint64_t cycle;
+  uint16_t pc;
+  uint16_t instruction;
+  // I, Vx and VF after it ran, x being the instruction's second nibble.
+  // Every instruction that writes registers writes Vx, VF or both, apart
+  // from Fx65 which also loads the ones below x
+  uint16_t index_register;
+  uint8_t vx;
+  uint8_t vf;
+} Chip8TraceRecord;
+
+// What stops a trace. The ring then ends on the instruction that matched,
+// and the emulator runs on unrecorded
+// An instruction the emulator doesn't know
+#define CHIP8_TRACE_UNKNOWN 1
+// An instruction at an address in [first_pc, last_pc]
+#define CHIP8_TRACE_PC 2
+// A draw that turned a pixel off, setting VF
+#define CHIP8_TRACE_COLLISION 4
+// An instruction that faulted or sent pc out of memory
+#define CHIP8_TRACE_FAULT 8
+
+typedef struct Chip8Trace {
+  // A power of two records, the newest at records[(written - 1) & mask]
+  Chip8TraceRecord *records;
+  uint64_t mask;
+  // Instructions recorded so far, including ones since overwritten
+  uint64_t written;
+  int triggers;
+  uint16_t first_pc;
+  uint16_t last_pc;
+  // The trigger that stopped recording, 0 while it goes on
+  int triggered;
+  // Triggers the handler of the instruction running has seen
+  int pending;
+} Chip8Trace;
+
+// Makes an empty trace keeping the last `capacity` instructions, rounded up
+// to a power of two, that stops at any of `triggers`. first_pc and last_pc
+// are only used with CHIP8_TRACE_PC. Returns 0 on success, or -1 if the
+// ring can't be allocated
+int chip8_trace_init(Chip8Trace *trace, uint64_t capacity, int triggers,
+                     uint16_t first_pc, uint16_t last_pc);
+void chip8_trace_free(Chip8Trace *trace);
+#ifdef CHIP8_TRACE
+// Attaches a trace, or detaches it when trace is NULL. Instructions run by
+// the JIT aren't seen by the hook, so chip8_run_batch interprets until the
+// trace stops
+void chip8_attach_trace(Chip8Emulator *emulator, Chip8Trace *trace);
+#endif
+// Records in the ring, at most its capacity
+uint64_t chip8_trace_count(const Chip8Trace *trace);
+// Record i, counting from the oldest
+const Chip8TraceRecord *chip8_trace_at(const Chip8Trace *trace, uint64_t i);
+// Returns -1 if the file could not be written
+int chip8_trace_save(const Chip8Trace *trace, const char *path);
+// Loads a saved trace into an uninitialized one, to be freed with
+// chip8_trace_free. Returns -1 if it can't be read or isn't a trace
+int chip8_trace_load(Chip8Trace *trace, const char *path);
+// "collision" and so on for a single trigger
+const char *chip8_trace_trigger_name(int trigger);
+// Parses a comma separated list of trigger names, with the pc trigger
+// written "pc=FIRST-LAST", e.g. "collision,pc=0x200-0x20f". Returns -1 if
+// it doesn't parse
+int chip8_parse_trace_triggers(const char *text, int *triggers,
+                               uint16_t *first_pc, uint16_t *last_pc);
+// Writes instruction as assembly, e.g. "ADD V3, 0x05", and returns out
+const char *chip8_disassemble(uint16_t instruction, char *out, size_t size);
@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+// Matching records shown before the first difference
+#define DIFF_CONTEXT 8
+
+static void usage(const char *name) {
+  printf("usage: %s <trace> [--pc FIRST-LAST] [--op PATTERN] [--last N] "
+         "[--diff TRACE]\n",
+         name);
+}
+
+// "0x200-0x2ff", or a single address
+static int parse_range(const char *text, uint16_t *first, uint16_t *last) {
+  char *end;
+  unsigned long from = strtoul(text, &end, 0);
+  unsigned long to = from;
+  if (*end == '-') {
+    to = strtoul(end + 1, &end, 0);
+  }
+  if (*end != '\0' || end == text || from > to || to > UINT16_MAX) {
+    return -1;
+  }
+  *first = from;
+  *last = to;
+  return 0;
+}
+
+// Instructions written the way stats.h names them, hex digits matching
+// themselves and any other letter anything, e.g. "Dxyn" or "8xy4"
+static int parse_pattern(const char *text, uint16_t *mask, uint16_t *value) {
+  if (strlen(text) != 4) {
+    return -1;
+  }
+  *mask = 0;
+  *value = 0;
+  for (int i = 0; i < 4; i++) {
+    char digit[2] = {text[i], '\0'};
+    char *end;
+    unsigned long nibble = strtoul(digit, &end, 16);
+    *mask <<= 4;
+    *value <<= 4;
+    if (*end == '\0') {
+      *mask |= 0xf;
+      *value |= nibble;
+    }
+  }
+  return 0;
+}
+
+static void print_record(const char *prefix, const Chip8TraceRecord *record) {
+  char text[32];
+  chip8_disassemble(record->instruction, text, sizeof(text));
+  printf("%s%12llu %03X %04X %-18s I=%03X", prefix,
+         (unsigned long long)record->cycle, record->pc, record->instruction,
+         text, record->index_register);
+  unsigned x = (record->instruction >> 8) & 0xf;
+  if (x != 0xf) {
+    printf(" V%X=%02X", x, record->vx);
+  }
+  printf(" VF=%02X\n", record->vf);
+}
+
+static void print_triggers(int triggers) {
+  if (!triggers) {
+    printf(" none");
+  }
+  for (int trigger = 1; trigger <= CHIP8_TRACE_FAULT; trigger <<= 1) {
+    if (triggers & trigger) {
+      printf(" %s", chip8_trace_trigger_name(trigger));
+    }
+  }
+  printf("\n");
+}
+
+typedef struct Filter {
+  uint16_t first_pc;
+  uint16_t last_pc;
+  uint16_t op_mask;
+  uint16_t op_value;
+} Filter;
+
+static int matches(const Filter *filter, const Chip8TraceRecord *record) {
+  return record->pc >= filter->first_pc && record->pc <= filter->last_pc &&
+         (record->instruction & filter->op_mask) == filter->op_value;
+}
+
+static int same_record(const Chip8TraceRecord *a, const Chip8TraceRecord *b) {
+  return a->pc == b->pc && a->instruction == b->instruction &&
+         a->index_register == b->index_register && a->vx == b->vx &&
+         a->vf == b->vf;
+}
+
+// Walks both traces by cycle, skipping cycles only one of them has, and
+// stops at the first that ran differently. Returns 1 if one did
+static int diff(const Chip8Trace *a, const Chip8Trace *b) {
+  uint64_t a_count = chip8_trace_count(a);
+  uint64_t b_count = chip8_trace_count(b);
+  uint64_t i = 0, j = 0;
+  uint64_t compared = 0;
+  // The last matching records, a ring of indices into a
+  uint64_t context[DIFF_CONTEXT];
+  while (i < a_count && j < b_count) {
+    const Chip8TraceRecord *left = chip8_trace_at(a, i);
+    const Chip8TraceRecord *right = chip8_trace_at(b, j);
+    if (left->cycle < right->cycle) {
+      i++;
+      continue;
+    }
+    if (left->cycle > right->cycle) {
+      j++;
+      continue;
+    }
+    if (!same_record(left, right)) {
+      uint64_t shown = compared < DIFF_CONTEXT ? compared : DIFF_CONTEXT;
+      for (uint64_t k = compared - shown; k < compared; k++) {
+        print_record("  ", chip8_trace_at(a, context[k % DIFF_CONTEXT]));
+      }
+      print_record("< ", left);
+      print_record("> ", right);
+      return 1;
+    }
+    context[compared++ % DIFF_CONTEXT] = i;
+    i++;
+    j++;
+  }
+
+  if (!compared) {
+    puts("no cycles in common");
+  } else {
+    printf("same over %llu cycles\n", (unsigned long long)compared);
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+  Filter filter = {.first_pc = 0, .last_pc = UINT16_MAX};
+  uint64_t last = UINT64_MAX;
+  const char *other_path = NULL;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "--pc") == 0 && i + 1 < argc &&
+        parse_range(argv[i + 1], &filter.first_pc, &filter.last_pc) == 0) {
+      i++;
+    } else if (strcmp(argv[i], "--op") == 0 && i + 1 < argc &&
+               parse_pattern(argv[i + 1], &filter.op_mask,
+                             &filter.op_value) == 0) {
+      i++;
+    } else if (strcmp(argv[i], "--last") == 0 && i + 1 < argc) {
+      last = strtoull(argv[++i], NULL, 0);
+    } else if (strcmp(argv[i], "--diff") == 0 && i + 1 < argc) {
+      other_path = argv[++i];
+    } else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  Chip8Trace trace;
+  if (chip8_trace_load(&trace, argv[1]) == -1) {
+    printf("Failed to load trace: %s\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  if (other_path) {
+    Chip8Trace other;
+    if (chip8_trace_load(&other, other_path) == -1) {
+      printf("Failed to load trace: %s\n", other_path);
+      chip8_trace_free(&trace);
+      return EXIT_FAILURE;
+    }
+    int differ = diff(&trace, &other);
+    chip8_trace_free(&trace);
+    chip8_trace_free(&other);
+    return differ ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  uint64_t count = chip8_trace_count(&trace);
+  printf("records: %llu of %llu\n", (unsigned long long)count,
+         (unsigned long long)trace.written);
+  printf("triggers:");
+  print_triggers(trace.triggers);
+  if (trace.triggers & CHIP8_TRACE_PC) {
+    printf("pc range: %03X-%03X\n", trace.first_pc, trace.last_pc);
+  }
+  printf("stopped by:");
+  print_triggers(trace.triggered);
+
+  // --last counts the records that pass the filters, so find where they
+  // start from the newest end
+  uint64_t start = count;
+  for (uint64_t matched = 0; start > 0 && matched < last; start--) {
+    matched += matches(&filter, chip8_trace_at(&trace, start - 1));
+  }
+  for (uint64_t i = start; i < count; i++) {
+    const Chip8TraceRecord *record = chip8_trace_at(&trace, i);
+    if (matches(&filter, record)) {
+      print_record("", record);
+    }
+  }
+
+  chip8_trace_free(&trace);
+  return EXIT_SUCCESS;
+}
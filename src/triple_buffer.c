@@ -0,0 +1,54 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "emulator.h"
+#include "triple_buffer.h"
+
+// Set in middle when it holds a frame the reader hasn't taken
+#define FRESH 0x80
+#define INDEX 0x03
+
+void chip8_triple_buffer_init(Chip8TripleBuffer *buffer) {
+  memset(buffer->frames, 0, sizeof(buffer->frames));
+  buffer->back = 0;
+  buffer->unseen_rows = 0;
+  atomic_init(&buffer->middle, 1);
+  buffer->front = 2;
+}
+
+int chip8_triple_buffer_publish(Chip8TripleBuffer *buffer,
+                                Chip8Emulator *emulator) {
+  if (!emulator->dirty_rows) {
+    return 0;
+  }
+  // The back frame is two or more frames old, so it takes a whole copy
+  Chip8DisplayFrame *frame = &buffer->frames[buffer->back];
+  memcpy(frame->graphics, emulator->graphics, sizeof(frame->graphics));
+  frame->hires = emulator->hires;
+  frame->dirty_rows = emulator->dirty_rows | buffer->unseen_rows;
+
+  // Release hands the copy over, acquire gets back the frame the reader
+  // may have been drawing, finished with
+  uint8_t previous = atomic_exchange_explicit(
+      &buffer->middle, buffer->back | FRESH, memory_order_acq_rel);
+  buffer->back = previous & INDEX;
+  // If the frame before was taken, the reader has drawn up to there and
+  // only this frame's rows may be unseen. If it wasn't, it never will be,
+  // and this frame already carries its rows
+  buffer->unseen_rows = previous & FRESH ? frame->dirty_rows
+                                         : emulator->dirty_rows;
+  emulator->dirty_rows = 0;
+  return 1;
+}
+
+const Chip8DisplayFrame *chip8_triple_buffer_take(Chip8TripleBuffer *buffer) {
+  if (!(atomic_load_explicit(&buffer->middle, memory_order_relaxed) &
+        FRESH)) {
+    return NULL;
+  }
+  uint8_t previous = atomic_exchange_explicit(&buffer->middle, buffer->front,
+                                              memory_order_acq_rel);
+  buffer->front = previous & INDEX;
+  return &buffer->frames[buffer->front];
+}
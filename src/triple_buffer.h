@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "emulator.h"
+
+// Hands finished displays from the emulation thread to the render thread
+// without either ever waiting on the other. There are three frames: the
+// writer fills the back one, the reader draws the front one, and the
+// middle one is swapped with either side by a single atomic exchange. The
+// reader always gets the newest frame, and frames it never took are simply
+// overwritten
+
+typedef struct DisplayFrame {
+  _Alignas(CHIP8_CACHE_LINE) uint64_t
+      graphics[CHIP8_PLANES][2][CHIP8_HIRES_HEIGHT];
+  uint8_t hires;
+  // Rows that changed since the last frame the reader took, in the same
+  // form as the emulator's dirty_rows
+  uint32_t dirty_rows;
+} Chip8DisplayFrame;
+
+typedef struct TripleBuffer {
+  Chip8DisplayFrame frames[3];
+  // Writer side. The frame being filled, and the rows changed in frames
+  // published that the reader may not have taken, which the next frame
+  // has to carry
+  uint8_t back;
+  uint32_t unseen_rows;
+  // The index of the middle frame, plus a flag set when it was published
+  // since the reader last took one
+  _Alignas(CHIP8_CACHE_LINE) _Atomic uint8_t middle;
+  // Reader side, the frame being drawn
+  _Alignas(CHIP8_CACHE_LINE) uint8_t front;
+} Chip8TripleBuffer;
+
+void chip8_triple_buffer_init(Chip8TripleBuffer *buffer);
+// From the emulation thread. If any rows changed, copies the display into
+// the back frame and publishes it. Clears emulator->dirty_rows and returns
+// 1 if a frame was published, 0 otherwise
+int chip8_triple_buffer_publish(Chip8TripleBuffer *buffer,
+                                Chip8Emulator *emulator);
+// From the render thread. Returns the newest frame if one was published
+// since the last call, otherwise NULL. The frame is the reader's until the
+// next call
+const Chip8DisplayFrame *chip8_triple_buffer_take(Chip8TripleBuffer *buffer);